@@ -0,0 +1,378 @@
+#include "DatagramChannel.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+
+DatagramChannel::DatagramChannel(io_context& ioContext, SocketStats& socketStats,
+	TraceLog& traceLog, FramePool& pool) :
+	socket(ioContext),
+	stats(socketStats),
+	trace(traceLog),
+	framePool(pool)
+{
+}
+
+int DatagramChannel::open(const ip::address& remote, int remotePort, int localPort, error_code& error)
+{
+	close();
+	ip::udp::endpoint local(remote.is_v6() ? ip::udp::v6() : ip::udp::v4(), (unsigned short) localPort);
+	socket.open(local.protocol(), error);
+	if(!error) {
+		socket.bind(local, error);
+	}
+	// Connected, so the kernel drops datagrams from anyone but the peer.
+	if(!error) {
+		socket.connect(ip::udp::endpoint(remote, (unsigned short) remotePort), error);
+	}
+	if(!error) {
+		socket.non_blocking(true, error);
+	}
+	if(error) {
+		close();
+		return -1;
+	}
+
+	nextSequence = 1;
+	sequenceSeen = false;
+	return 0;
+}
+
+void DatagramChannel::close()
+{
+	if(socket.is_open()) {
+		error_code ignored;
+		socket.close(ignored);
+	}
+	staged.clear();
+	stagedEnds.clear();
+}
+
+bool DatagramChannel::is_open() const
+{
+	return socket.is_open();
+}
+
+int DatagramChannel::local_port() const
+{
+	error_code error;
+	ip::udp::endpoint local = socket.local_endpoint(error);
+	return error ? 0 : local.port();
+}
+
+void DatagramChannel::set_framing(FrameFormat format, size_t fixedSize, size_t maxSize)
+{
+	frameFormat = format;
+	fixedFrameSize = fixedSize;
+	maxMessageSize = maxSize;
+}
+
+void DatagramChannel::set_max_datagram_size(size_t size)
+{
+	maxDatagramSize = size;
+}
+
+size_t DatagramChannel::max_message_size() const
+{
+	unsigned char header[MAX_FRAME_HEADER_SIZE];
+	size_t limit = frame_size_limit(frameFormat, fixedFrameSize, maxMessageSize);
+	size_t room = maxDatagramSize - SEQUENCE_SIZE - encode_frame_header(frameFormat, maxDatagramSize, header);
+	return limit < room ? limit : room;
+}
+
+/*
+ * Appends the message to the last staged datagram, or starts a new one
+ * when it does not fit. Sequence numbers are given out here, so they
+ * follow the order messages were staged in.
+ */
+int DatagramChannel::stage(const char* bytes, size_t numBytes)
+{
+	if(numBytes == 0 || numBytes > max_message_size() ||
+		(frameFormat == FrameFormat::Fixed && numBytes != fixedFrameSize)) {
+		return -1;
+	}
+
+	unsigned char header[MAX_FRAME_HEADER_SIZE];
+	size_t headerSize = encode_frame_header(frameFormat, numBytes, header);
+	size_t lastStart = stagedEnds.size() < 2 ? 0 : stagedEnds[stagedEnds.size() - 2];
+
+	if(stagedEnds.empty() || staged.size() - lastStart + headerSize + numBytes > maxDatagramSize) {
+		unsigned char sequence[SEQUENCE_SIZE];
+		U32BECodec().encode(nextSequence++, sequence);
+		staged.insert(staged.end(), sequence, sequence + SEQUENCE_SIZE);
+		stagedEnds.push_back(staged.size());
+	}
+
+	staged.insert(staged.end(), header, header + headerSize);
+	staged.insert(staged.end(), bytes, bytes + numBytes);
+	stagedEnds.back() = staged.size();
+	count(stats.messagesOut);
+	stats.messageSizeOut.record(numBytes);
+	return 0;
+}
+
+size_t DatagramChannel::staged_datagrams() const
+{
+	return stagedEnds.size();
+}
+
+int DatagramChannel::flush(error_code& error)
+{
+	size_t sent = 0;
+	while(sent < stagedEnds.size()) {
+		size_t batch = stagedEnds.size() - sent;
+		if(batch > (size_t) BATCH_SIZE) {
+			batch = BATCH_SIZE;
+		}
+		size_t done = send_batch(sent, batch, error);
+		sent += done;
+		if(done < batch) {
+			break;
+		}
+	}
+
+	// Whatever did not fit in the send buffer is dropped, a datagram
+	// delayed until the next flush would be stale by then anyway.
+	if(sent < stagedEnds.size()) {
+		count(stats.droppedDatagrams, stagedEnds.size() - sent);
+	}
+	staged.clear();
+	stagedEnds.clear();
+
+	if(error) {
+		SOCKET_TRACE_EVENT(trace, TRACE_WRITE_FAILED, -1, error.value());
+		return -1;
+	}
+	return (int) sent;
+}
+
+// Sends staged datagrams starting at index first, returns how many went out.
+size_t DatagramChannel::send_batch(size_t first, size_t datagrams, error_code& error)
+{
+	size_t bytes = 0;
+	size_t sent = 0;
+#if defined(__linux__)
+	mmsghdr headers[BATCH_SIZE] = {};
+	iovec vectors[BATCH_SIZE];
+	for(size_t i = 0; i < datagrams; i++) {
+		size_t start = first + i == 0 ? 0 : stagedEnds[first + i - 1];
+		vectors[i].iov_base = &staged[start];
+		vectors[i].iov_len = stagedEnds[first + i] - start;
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+	int result = sendmmsg(socket.native_handle(), headers, (unsigned int) datagrams, 0);
+	count(stats.datagramSendCalls);
+	if(result < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+			error = error_code(errno, boost::system::system_category());
+		}
+		return 0;
+	}
+	sent = (size_t) result;
+	for(size_t i = 0; i < sent; i++) {
+		bytes += headers[i].msg_len;
+	}
+#else
+	for(; sent < datagrams; sent++) {
+		size_t start = first + sent == 0 ? 0 : stagedEnds[first + sent - 1];
+		error_code sendError;
+		bytes += socket.send(buffer(&staged[start], stagedEnds[first + sent] - start), 0, sendError);
+		count(stats.datagramSendCalls);
+		if(sendError) {
+			if(sendError != error::would_block && sendError != error::connection_refused) {
+				error = sendError;
+			}
+			break;
+		}
+	}
+#endif
+	count(stats.datagramsOut, sent);
+	count(stats.bytesOut, bytes);
+	SOCKET_TRACE_EVENT(trace, TRACE_DATAGRAMS_OUT, sent, bytes);
+	return sent;
+}
+
+int DatagramChannel::receive(std::vector<PooledFrame>& frames, size_t maxCount, int waitMs, error_code& error)
+{
+	size_t before = frames.size();
+	if(receiveSlots.size() != BATCH_SIZE * maxDatagramSize) {
+		receiveSlots.resize(BATCH_SIZE * maxDatagramSize);
+	}
+
+	// Readability is checked first, a receive on an empty non blocking
+	// socket is a wasted system call, and callers poll this every frame.
+	namespace socket_ops = boost::asio::detail::socket_ops;
+	int readable = 0;
+	do {
+		error = error_code();
+		readable = socket_ops::poll_read(socket.native_handle(), 0, waitMs, error);
+	} while(error == error::interrupted);
+	if(error) {
+		SOCKET_TRACE_EVENT(trace, TRACE_READ_FAILED, -1, error.value());
+		return -1;
+	}
+	if(readable == 0) {
+		return 0;
+	}
+
+	while(frames.size() - before < maxCount) {
+		int received = receive_batch(error);
+		if(received <= 0) {
+			break;
+		}
+		for(int i = 0; i < received; i++) {
+			decode(&receiveSlots[i * maxDatagramSize], receivedSizes[i], frames);
+		}
+		if(received < BATCH_SIZE) {
+			break;
+		}
+	}
+
+	if(error) {
+		SOCKET_TRACE_EVENT(trace, TRACE_READ_FAILED, -1, error.value());
+		return -1;
+	}
+	return (int) (frames.size() - before);
+}
+
+/*
+ * Reads up to a batch of datagrams into the receive slots. Sizes of
+ * datagrams that did not fit a slot are set to 0. Returns the number of
+ * datagrams read, 0 when none are waiting.
+ */
+int DatagramChannel::receive_batch(error_code& error)
+{
+	receivedSizes.assign(BATCH_SIZE, 0);
+	int received = 0;
+#if defined(__linux__)
+	mmsghdr headers[BATCH_SIZE] = {};
+	iovec vectors[BATCH_SIZE];
+	for(int i = 0; i < BATCH_SIZE; i++) {
+		vectors[i].iov_base = &receiveSlots[i * maxDatagramSize];
+		vectors[i].iov_len = maxDatagramSize;
+		headers[i].msg_hdr.msg_iov = &vectors[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+	received = recvmmsg(socket.native_handle(), headers, BATCH_SIZE, 0, nullptr);
+	if(received < 0) {
+		// Refused means an earlier datagram found no one listening yet.
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+			error = error_code(errno, boost::system::system_category());
+		}
+		return 0;
+	}
+	if(received > 0) {
+		count(stats.datagramReceiveCalls);
+	}
+	for(int i = 0; i < received; i++) {
+		bool truncated = (headers[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+		receivedSizes[i] = truncated ? 0 : headers[i].msg_len;
+	}
+#else
+	for(; received < BATCH_SIZE; received++) {
+		error_code receiveError;
+		size_t size = socket.receive(buffer(&receiveSlots[received * maxDatagramSize], maxDatagramSize),
+			0, receiveError);
+		if(receiveError == error::message_size) {
+			count(stats.datagramReceiveCalls);
+			continue;
+		}
+		if(receiveError) {
+			if(receiveError != error::would_block && receiveError != error::connection_refused) {
+				error = receiveError;
+			}
+			break;
+		}
+		count(stats.datagramReceiveCalls);
+		receivedSizes[received] = size;
+	}
+#endif
+	return received;
+}
+
+// How far behind the newest a datagram can arrive and still be taken as
+// reordered, and how long the peer can be silent before the next datagram
+// starts the sequence over.
+static const int32_t REORDER_WINDOW = 1024;
+static const std::chrono::milliseconds RESTART_SILENCE(2000);
+
+/*
+ * Serial number comparison, so the sequence can wrap. A peer that
+ * restarted counts from 1 again, which would otherwise drop everything
+ * it sends until it passes the old newest. So a datagram more than
+ * REORDER_WINDOW behind the newest with a sequence inside that window
+ * from the start, or the first one after RESTART_SILENCE without any,
+ * starts the sequence over instead of being stale.
+ */
+bool DatagramChannel::is_stale(uint32_t sequence)
+{
+	auto now = std::chrono::steady_clock::now();
+	int32_t distance = (int32_t) (sequence - newestSequence);
+	bool restarted = (distance < -REORDER_WINDOW && sequence <= (uint32_t) REORDER_WINDOW)
+		|| now - newestReceived >= RESTART_SILENCE;
+	if(sequenceSeen && distance <= 0 && !restarted) {
+		return true;
+	}
+	newestSequence = sequence;
+	newestReceived = now;
+	sequenceSeen = true;
+	return false;
+}
+
+// Drops stale or malformed datagrams whole, as well as those there is no
+// memory left for, a datagram is never half used.
+void DatagramChannel::decode(const char* datagram, size_t size, std::vector<PooledFrame>& frames)
+{
+	if(size < SEQUENCE_SIZE) {
+		count(stats.droppedDatagrams);
+		return;
+	}
+	count(stats.datagramsIn);
+	count(stats.bytesIn, size);
+
+	size_t sequence = 0;
+	U32BECodec().decode((const unsigned char*) datagram, size, sequence);
+	if(is_stale((uint32_t) sequence)) {
+		count(stats.staleDatagrams);
+		SOCKET_TRACE_EVENT(trace, TRACE_DATAGRAMS_IN, -1, sequence);
+		return;
+	}
+
+	spans.clear();
+	size_t pending = 0;
+	const char* body = datagram + SEQUENCE_SIZE;
+	size_t available = size - SEQUENCE_SIZE;
+	size_t used = scan_frames(frameFormat, fixedFrameSize, body, available, available + 1,
+		frame_size_limit(frameFormat, fixedFrameSize, maxMessageSize), spans, pending);
+	if(used != available) {
+		count(stats.droppedDatagrams);
+		SOCKET_TRACE_EVENT(trace, TRACE_MALFORMED_FRAME, available, (int) frameFormat);
+		return;
+	}
+
+	size_t first = frames.size();
+	for(const FrameSpan& span : spans) {
+		PooledFrame frame = framePool.acquire(span.size);
+		if(!frame.data()) {
+			frames.erase(frames.begin() + first, frames.end());
+			count(stats.droppedDatagrams);
+			SOCKET_TRACE_EVENT(trace, TRACE_DATAGRAMS_IN, -1, sequence);
+			return;
+		}
+		memcpy(frame.data(), body + span.offset, span.size);
+		frames.push_back(std::move(frame));
+	}
+	for(const FrameSpan& span : spans) {
+		count(stats.messagesIn);
+		stats.messageSizeIn.record(span.size);
+	}
+	SOCKET_TRACE_EVENT(trace, TRACE_DATAGRAMS_IN, spans.size(), sequence);
+}
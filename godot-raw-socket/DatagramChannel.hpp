@@ -0,0 +1,100 @@
+#ifndef DATAGRAM_CHANNEL_H
+#define DATAGRAM_CHANNEL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "FrameCodec.hpp"
+#include "FramePool.hpp"
+#include "SocketStats.hpp"
+#include "TraceLog.hpp"
+
+/*
+ * Unreliable, unordered messages over UDP, next to the TCP connection of
+ * a SocketWrapper. Meant for state that is worthless once a newer copy
+ * exists, where waiting for a lost segment to be resent only adds lag.
+ *
+ * Each datagram is a 4 byte big endian sequence number followed by one or
+ * more messages in the same framing as the stream. Staged messages are
+ * packed into as few datagrams as fit maxDatagramSize, and flush sends all
+ * of them. Datagrams with a sequence number not newer than the newest one
+ * received are stale and dropped before their messages are decoded,
+ * unless they look like a peer that started over, see is_stale.
+ *
+ * On Linux a flush or receive moves a whole batch of datagrams with one
+ * sendmmsg or recvmmsg call, elsewhere they are moved one call each.
+ * The socket never blocks: a full send buffer drops the rest of a flush,
+ * an empty receive buffer ends a receive.
+ */
+class DatagramChannel {
+public:
+	// Datagrams moved per sendmmsg or recvmmsg call.
+	static const int BATCH_SIZE = 32;
+	static const size_t SEQUENCE_SIZE = 4;
+	// Payload of an unfragmented datagram on a 1500 byte MTU over IPv4.
+	static const size_t DEFAULT_DATAGRAM_SIZE = 1472;
+private:
+	boost::asio::ip::udp::socket socket;
+	SocketStats& stats;
+	TraceLog& trace;
+	FramePool& framePool;
+
+	FrameFormat frameFormat = FrameFormat::U16BE;
+	size_t fixedFrameSize = 0;
+	size_t maxMessageSize = 16 * 1024 * 1024;
+	size_t maxDatagramSize = DEFAULT_DATAGRAM_SIZE;
+
+	uint32_t nextSequence = 1;
+	uint32_t newestSequence = 0;
+	bool sequenceSeen = false;
+	std::chrono::steady_clock::time_point newestReceived;
+
+	// Staged datagrams back to back, each ending at stagedEnds.
+	std::vector<char> staged;
+	std::vector<size_t> stagedEnds;
+	std::vector<char> receiveSlots;
+	std::vector<size_t> receivedSizes;
+	std::vector<FrameSpan> spans;
+
+	size_t send_batch(size_t first, size_t datagrams, boost::system::error_code& error);
+	int receive_batch(boost::system::error_code& error);
+	bool is_stale(uint32_t sequence);
+	void decode(const char* datagram, size_t size, std::vector<PooledFrame>& frames);
+public:
+	DatagramChannel(boost::asio::io_context& ioContext, SocketStats& socketStats,
+		TraceLog& traceLog, FramePool& pool);
+
+	DatagramChannel(const DatagramChannel&) = delete;
+	DatagramChannel& operator=(const DatagramChannel&) = delete;
+
+	// Binds localPort, 0 picks any, and only talks to remote:remotePort.
+	int open(const boost::asio::ip::address& remote, int remotePort, int localPort,
+		boost::system::error_code& error);
+	void close();
+	bool is_open() const;
+	int local_port() const;
+
+	void set_framing(FrameFormat format, size_t fixedSize, size_t maxSize);
+	// Largest datagram sent and received, longer ones are dropped.
+	void set_max_datagram_size(size_t size);
+	size_t max_message_size() const;
+
+	// Returns -1 if the message does not fit in a datagram.
+	int stage(const char* bytes, size_t numBytes);
+	// Returns the number of datagrams sent, or -1 on a socket error.
+	int flush(boost::system::error_code& error);
+	size_t staged_datagrams() const;
+
+	// Appends the messages of everything received so far, reading until
+	// at least maxCount messages are collected or nothing is left. Waits
+	// up to waitMs for the first datagram, 0 only looks.
+	// Returns the number of messages appended, or -1 on a socket error.
+	int receive(std::vector<PooledFrame>& frames, size_t maxCount, int waitMs,
+		boost::system::error_code& error);
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include "FrameCapture.hpp"
+
+#include <cstring>
+
+#include "FrameCodec.hpp"
+#include "FrameTimestamps.hpp"
+
+static const char CAPTURE_MAGIC[6] = { 'G', 'W', 'S', 'C', 'A', 'P' };
+
+static void put_le(unsigned char* out, uint64_t value, size_t size)
+{
+	for(size_t i = 0; i < size; i++) {
+		out[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_le(const unsigned char* in, size_t size)
+{
+	uint64_t value = 0;
+	for(size_t i = 0; i < size; i++) {
+		value |= (uint64_t) in[i] << (8 * i);
+	}
+	return value;
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	close();
+}
+
+int CaptureWriter::open(const char* path)
+{
+	close();
+	std::lock_guard<std::mutex> lock(mutex);
+	file = fopen(path, "wb");
+	if(file == nullptr) {
+		return -1;
+	}
+
+	unsigned char header[CAPTURE_HEADER_SIZE];
+	lastUsec = timestamp_usec();
+	memcpy(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	put_le(header + 6, CAPTURE_VERSION, 2);
+	put_le(header + 8, lastUsec, 8);
+	failed = fwrite(header, 1, sizeof(header), file) != sizeof(header);
+	buffer.clear();
+	buffer.reserve(BUFFER_SIZE);
+	return failed ? -1 : 0;
+}
+
+void CaptureWriter::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(file == nullptr) {
+		return;
+	}
+	flush_buffer();
+	fclose(file);
+	file = nullptr;
+}
+
+void CaptureWriter::append(CaptureKind kind, const char* bytes, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(file == nullptr || failed) {
+		return;
+	}
+
+	// Deltas are clamped to what a varint header holds, only the pacing
+	// of a replay after a pause of over an hour would notice.
+	uint64_t now = timestamp_usec();
+	uint64_t delta = now > lastUsec ? now - lastUsec : 0;
+	VarintCodec varint;
+	if(delta > varint.max_body_size()) {
+		delta = varint.max_body_size();
+	}
+	lastUsec = now;
+
+	unsigned char header[1 + 2 * MAX_FRAME_HEADER_SIZE];
+	size_t headerSize = 0;
+	header[headerSize++] = (unsigned char) kind;
+	headerSize += varint.encode((size_t) delta, header + headerSize);
+	headerSize += varint.encode(size, header + headerSize);
+
+	if(buffer.empty()) {
+		bufferedSince = std::chrono::steady_clock::now();
+	}
+	buffer.insert(buffer.end(), header, header + headerSize);
+	buffer.insert(buffer.end(), bytes, bytes + size);
+
+	if(buffer.size() >= BUFFER_SIZE ||
+		std::chrono::steady_clock::now() - bufferedSince >= std::chrono::seconds(1)) {
+		flush_buffer();
+	}
+}
+
+void CaptureWriter::flush_if_due()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if(file != nullptr && !buffer.empty() &&
+		std::chrono::steady_clock::now() - bufferedSince >= std::chrono::seconds(1)) {
+		flush_buffer();
+	}
+}
+
+void CaptureWriter::flush_buffer()
+{
+	if(buffer.empty() || failed) {
+		return;
+	}
+	failed = fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size() || fflush(file) != 0;
+	buffer.clear();
+}
+
+CaptureReader::~CaptureReader()
+{
+	close();
+}
+
+int CaptureReader::open(const char* path)
+{
+	close();
+	file = fopen(path, "rb");
+	if(file == nullptr) {
+		return -1;
+	}
+	setvbuf(file, nullptr, _IOFBF, CaptureWriter::BUFFER_SIZE);
+
+	unsigned char header[CAPTURE_HEADER_SIZE];
+	if(fread(header, 1, sizeof(header), file) != sizeof(header) ||
+		memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+		get_le(header + 6, 2) != CAPTURE_VERSION) {
+		close();
+		return -1;
+	}
+	startUsec = get_le(header + 8, 8);
+	currentUsec = startUsec;
+	return 0;
+}
+
+void CaptureReader::close()
+{
+	if(file != nullptr) {
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+bool CaptureReader::read_varint(size_t& value)
+{
+	unsigned char bytes[MAX_FRAME_HEADER_SIZE];
+	for(size_t i = 0; i < MAX_FRAME_HEADER_SIZE; i++) {
+		int byte = fgetc(file);
+		if(byte == EOF) {
+			return false;
+		}
+		bytes[i] = (unsigned char) byte;
+		if((byte & 0x80) == 0) {
+			return VarintCodec().decode(bytes, i + 1, value) > 0;
+		}
+	}
+	return false;
+}
+
+int CaptureReader::next(CaptureKind& kind, uint64_t& timestampUsec, std::vector<char>& message)
+{
+	if(file == nullptr) {
+		return -1;
+	}
+	int first = fgetc(file);
+	if(first == EOF) {
+		return 0;
+	}
+	if(first > (int) CaptureKind::DatagramOut) {
+		return -1;
+	}
+
+	size_t delta = 0;
+	size_t size = 0;
+	if(!read_varint(delta) || !read_varint(size) || size > maxMessageSize) {
+		return -1;
+	}
+	message.resize(size);
+	if(size > 0 && fread(message.data(), 1, size, file) != size) {
+		return -1;
+	}
+
+	kind = (CaptureKind) first;
+	currentUsec += delta;
+	timestampUsec = currentUsec;
+	return 1;
+}
@@ -0,0 +1,105 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+/*
+ * Append only recording of the messages a connection sent and received,
+ * for reproducing issues and replaying a match without a server.
+ *
+ * A capture file starts with a 16 byte header: the magic "GWSCAP", a
+ * 2 byte version and the start time in microseconds since the Unix epoch,
+ * both little endian. Then one record per message:
+ *
+ *   1 byte    kind, see CaptureKind
+ *   varint    microseconds since the previous record, or since the start
+ *   varint    message size
+ *   bytes     the message, decompressed, without its frame header
+ *
+ * Messages are recorded as handed to the game or passed in by it, so a
+ * replay needs neither the framing nor the compression of the capture.
+ */
+enum class CaptureKind : unsigned char {
+	StreamIn = 0,
+	StreamOut = 1,
+	DatagramIn = 2,
+	DatagramOut = 3
+};
+
+const size_t CAPTURE_HEADER_SIZE = 16;
+const uint16_t CAPTURE_VERSION = 1;
+
+/*
+ * Writes records through a buffer of its own, which goes to the file when
+ * full, and at the latest a second after the oldest record in it, so a
+ * crash loses at most the last second. append checks that age, an idle
+ * connection appends nothing, so flush_if_due has to be called every now
+ * and then as well. Safe to use from several threads.
+ */
+class CaptureWriter {
+public:
+	static const size_t BUFFER_SIZE = 64 * 1024;
+private:
+	std::mutex mutex;
+	FILE* file = nullptr;
+	std::vector<char> buffer;
+	uint64_t lastUsec = 0;
+	std::chrono::steady_clock::time_point bufferedSince;
+	bool failed = false;
+
+	void flush_buffer();
+public:
+	CaptureWriter() {}
+	~CaptureWriter();
+
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+	// Truncates the file. Returns -1 if it can not be created.
+	int open(const char* path);
+	void close();
+	bool is_open() const { return file != nullptr; }
+	// Set once a write failed, the capture stops there.
+	bool has_failed() const { return failed; }
+
+	void append(CaptureKind kind, const char* bytes, size_t size);
+	// Writes the buffer out when its oldest record is a second old.
+	void flush_if_due();
+};
+
+/*
+ * Reads the records of a capture file in order through a buffered stream.
+ */
+class CaptureReader {
+private:
+	FILE* file = nullptr;
+	uint64_t startUsec = 0;
+	uint64_t currentUsec = 0;
+	size_t maxMessageSize;
+
+	bool read_varint(size_t& value);
+public:
+	explicit CaptureReader(size_t maxSize = 16 * 1024 * 1024) : maxMessageSize(maxSize) {}
+	~CaptureReader();
+
+	CaptureReader(const CaptureReader&) = delete;
+	CaptureReader& operator=(const CaptureReader&) = delete;
+
+	// Returns -1 if the file can not be opened or is not a capture.
+	int open(const char* path);
+	void close();
+	uint64_t start_usec() const { return startUsec; }
+
+	/*
+	 * Reads the next record into message. Returns 1 for a record, 0 at
+	 * the end of the file and -1 for a corrupt or truncated record.
+	 */
+	int next(CaptureKind& kind, uint64_t& timestampUsec, std::vector<char>& message);
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * Message framing. Each codec knows how to read and write the header in
+ * front of a message body:
+ *
+ *   U16BE/U16LE  2 byte length, big or little endian (the default U16BE
+ *                is what set_message_header_size(2) has always meant).
+ *   U32BE/U32LE  4 byte length, messages up to 4 GiB.
+ *   Varint       unsigned LEB128 length, 1 to 5 bytes.
+ *   Fixed        no header, every message has the same size.
+ *   Delimited    no header, every message ends with a delimiter, see
+ *                FrameDelimiter.hpp for its scanning.
+ *
+ * The format is picked at runtime, but the scanning loop is a template
+ * instantiated per codec, so it is dispatched once per batch instead of
+ * branching on the format for every header.
+ */
+enum class FrameFormat {
+	U16BE,
+	U16LE,
+	U32BE,
+	U32LE,
+	Varint,
+	Fixed,
+	Delimited
+};
+
+// Returned by decode when the header is not complete yet or invalid.
+const int FRAME_INCOMPLETE = -1;
+const int FRAME_MALFORMED = -2;
+
+// Longest header any codec writes.
+const size_t MAX_FRAME_HEADER_SIZE = 5;
+
+// Position of a received message body within the read ahead buffer.
+struct FrameSpan {
+	size_t offset;
+	size_t size;
+};
+
+template<size_t Bytes, bool BigEndian>
+struct FixedWidthCodec {
+	static const size_t maxBodySize = (Bytes == 2) ? 0xFFFF : 0xFFFFFFFF;
+
+	// Returns the header length and sets bodySize, or FRAME_INCOMPLETE.
+	int decode(const unsigned char* data, size_t available, size_t& bodySize) const
+	{
+		if(available < Bytes) {
+			return FRAME_INCOMPLETE;
+		}
+		size_t value = 0;
+		for(size_t i = 0; i < Bytes; i++) {
+			size_t shift = BigEndian ? 8 * (Bytes - 1 - i) : 8 * i;
+			value |= (size_t) data[i] << shift;
+		}
+		bodySize = value;
+		return (int) Bytes;
+	}
+
+	size_t encode(size_t bodySize, unsigned char* header) const
+	{
+		for(size_t i = 0; i < Bytes; i++) {
+			size_t shift = BigEndian ? 8 * (Bytes - 1 - i) : 8 * i;
+			header[i] = (unsigned char) (bodySize >> shift);
+		}
+		return Bytes;
+	}
+
+	size_t max_body_size() const { return maxBodySize; }
+};
+
+typedef FixedWidthCodec<2, true> U16BECodec;
+typedef FixedWidthCodec<2, false> U16LECodec;
+typedef FixedWidthCodec<4, true> U32BECodec;
+typedef FixedWidthCodec<4, false> U32LECodec;
+
+struct VarintCodec {
+	int decode(const unsigned char* data, size_t available, size_t& bodySize) const
+	{
+		size_t value = 0;
+		for(size_t i = 0; i < MAX_FRAME_HEADER_SIZE; i++) {
+			if(i == available) {
+				return FRAME_INCOMPLETE;
+			}
+			value |= (size_t) (data[i] & 0x7F) << (7 * i);
+			if((data[i] & 0x80) == 0) {
+				bodySize = value;
+				return (int) i + 1;
+			}
+		}
+		return FRAME_MALFORMED;
+	}
+
+	size_t encode(size_t bodySize, unsigned char* header) const
+	{
+		size_t length = 0;
+		do {
+			unsigned char byte = bodySize & 0x7F;
+			bodySize >>= 7;
+			header[length++] = bodySize ? (byte | 0x80) : byte;
+		} while(bodySize);
+		return length;
+	}
+
+	size_t max_body_size() const { return 0xFFFFFFFF; }
+};
+
+struct FixedSizeCodec {
+	size_t size;
+
+	int decode(const unsigned char*, size_t, size_t& bodySize) const
+	{
+		bodySize = size;
+		return 0;
+	}
+
+	size_t encode(size_t, unsigned char*) const
+	{
+		return 0;
+	}
+
+	size_t max_body_size() const { return size; }
+};
+
+/*
+ * Collects complete frames from data, up to maxCount. Returns the number
+ * of bytes the collected frames span. pending is set to the number of
+ * bytes the next, incomplete, frame needs counted from the returned
+ * position, or to 0 if the header was malformed.
+ * Empty messages are consumed but not collected.
+ */
+template<typename Codec>
+size_t scan_frames(const Codec& codec, const char* data, size_t available, size_t maxCount,
+	size_t maxBodySize, std::vector<FrameSpan>& frames, size_t& pending)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	size_t position = 0;
+	pending = MAX_FRAME_HEADER_SIZE;
+
+	while(frames.size() < maxCount) {
+		size_t bodySize = 0;
+		int headerSize = codec.decode(bytes + position, available - position, bodySize);
+		if(headerSize == FRAME_INCOMPLETE) {
+			pending = MAX_FRAME_HEADER_SIZE;
+			break;
+		}
+		if(headerSize == FRAME_MALFORMED || bodySize > maxBodySize) {
+			pending = 0;
+			break;
+		}
+		if(available - position - headerSize < bodySize) {
+			pending = headerSize + bodySize;
+			break;
+		}
+		if(bodySize > 0) {
+			frames.push_back(FrameSpan{position + headerSize, bodySize});
+		}
+		position += headerSize + bodySize;
+	}
+	return position;
+}
+
+/*
+ * Runtime dispatch to the codec of a format, for callers that keep the
+ * format as a setting. The switch runs once per call, the loops inside
+ * are still specialized per codec.
+ */
+inline size_t scan_frames(FrameFormat format, size_t fixedSize, const char* data, size_t available,
+	size_t maxCount, size_t maxBodySize, std::vector<FrameSpan>& frames, size_t& pending)
+{
+	switch(format) {
+	case FrameFormat::U16BE:
+		return scan_frames(U16BECodec(), data, available, maxCount, maxBodySize, frames, pending);
+	case FrameFormat::U16LE:
+		return scan_frames(U16LECodec(), data, available, maxCount, maxBodySize, frames, pending);
+	case FrameFormat::U32BE:
+		return scan_frames(U32BECodec(), data, available, maxCount, maxBodySize, frames, pending);
+	case FrameFormat::U32LE:
+		return scan_frames(U32LECodec(), data, available, maxCount, maxBodySize, frames, pending);
+	case FrameFormat::Varint:
+		return scan_frames(VarintCodec(), data, available, maxCount, maxBodySize, frames, pending);
+	case FrameFormat::Fixed:
+		return scan_frames(FixedSizeCodec{fixedSize}, data, available, maxCount, maxBodySize, frames, pending);
+	case FrameFormat::Delimited:
+		// Needs the delimiter, callers use scan_delimited instead.
+		break;
+	}
+	pending = 0;
+	return 0;
+}
+
+// Writes the header for bodySize and returns its length.
+inline size_t encode_frame_header(FrameFormat format, size_t bodySize, unsigned char* header)
+{
+	switch(format) {
+	case FrameFormat::U16BE:
+		return U16BECodec().encode(bodySize, header);
+	case FrameFormat::U16LE:
+		return U16LECodec().encode(bodySize, header);
+	case FrameFormat::U32BE:
+		return U32BECodec().encode(bodySize, header);
+	case FrameFormat::U32LE:
+		return U32LECodec().encode(bodySize, header);
+	case FrameFormat::Varint:
+		return VarintCodec().encode(bodySize, header);
+	case FrameFormat::Fixed:
+	case FrameFormat::Delimited:
+		return 0;
+	}
+	return 0;
+}
+
+// Largest body a format can carry, limited further by maxMessageSize.
+inline size_t frame_size_limit(FrameFormat format, size_t fixedSize, size_t maxMessageSize)
+{
+	switch(format) {
+	case FrameFormat::U16BE:
+	case FrameFormat::U16LE:
+		return maxMessageSize < U16BECodec().max_body_size() ? maxMessageSize : U16BECodec().max_body_size();
+	case FrameFormat::Fixed:
+		return fixedSize;
+	default:
+		return maxMessageSize;
+	}
+}
+
+/*
+ * Format names as used by set_message_framing: "u16" or "u16be", "u16le",
+ * "u32" or "u32be", "u32le" and "varint". Returns false for anything else.
+ */
+inline bool parse_frame_format(const char* name, FrameFormat& format)
+{
+	if(strcmp(name, "u16") == 0 || strcmp(name, "u16be") == 0) {
+		format = FrameFormat::U16BE;
+	} else if(strcmp(name, "u16le") == 0) {
+		format = FrameFormat::U16LE;
+	} else if(strcmp(name, "u32") == 0 || strcmp(name, "u32be") == 0) {
+		format = FrameFormat::U32BE;
+	} else if(strcmp(name, "u32le") == 0) {
+		format = FrameFormat::U32LE;
+	} else if(strcmp(name, "varint") == 0) {
+		format = FrameFormat::Varint;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+#endif
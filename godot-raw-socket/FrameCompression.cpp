@@ -0,0 +1,228 @@
+#include "FrameCompression.hpp"
+
+#include <cstring>
+
+#include "FrameCodec.hpp"
+
+#ifdef SOCKET_LZ4
+#include <lz4.h>
+#endif
+#ifdef SOCKET_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Codec contexts, kept for the life of the connection so compressing a
+ * frame allocates nothing. Encoding and decoding use separate contexts,
+ * the sending and the receiving thread never share one.
+ */
+struct FrameCompressorState {
+#ifdef SOCKET_ZSTD
+	ZSTD_CCtx* compressContext = ZSTD_createCCtx();
+	ZSTD_DCtx* decompressContext = ZSTD_createDCtx();
+	ZSTD_CDict* compressDictionary = nullptr;
+	ZSTD_DDict* decompressDictionary = nullptr;
+
+	void free_dictionaries()
+	{
+		ZSTD_freeCDict(compressDictionary);
+		ZSTD_freeDDict(decompressDictionary);
+		compressDictionary = nullptr;
+		decompressDictionary = nullptr;
+	}
+
+	~FrameCompressorState()
+	{
+		free_dictionaries();
+		ZSTD_freeCCtx(compressContext);
+		ZSTD_freeDCtx(decompressContext);
+	}
+#endif
+};
+
+FrameCompressor::FrameCompressor() : state(new FrameCompressorState())
+{
+}
+
+FrameCompressor::~FrameCompressor()
+{
+}
+
+bool FrameCompressor::available(CompressionCodec codec)
+{
+	switch(codec) {
+	case CompressionCodec::None:
+		return true;
+	case CompressionCodec::LZ4:
+#ifdef SOCKET_LZ4
+		return true;
+#else
+		return false;
+#endif
+	case CompressionCodec::Zstd:
+#ifdef SOCKET_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+int FrameCompressor::set_codec(CompressionCodec newCodec, int newLevel, size_t newThreshold)
+{
+	if(!available(newCodec)) {
+		return -1;
+	}
+	codec = newCodec;
+	level = newLevel;
+	threshold = newThreshold;
+#ifdef SOCKET_ZSTD
+	// The compression dictionary is digested for one level.
+	if(!dictionary.empty()) {
+		std::vector<char> trained(dictionary);
+		set_dictionary(trained.data(), trained.size());
+	}
+#endif
+	return 0;
+}
+
+int FrameCompressor::set_dictionary(const char* bytes, size_t size)
+{
+#ifdef SOCKET_ZSTD
+	dictionary.assign(bytes, bytes + size);
+	state->free_dictionaries();
+	if(size > 0) {
+		state->compressDictionary = ZSTD_createCDict(bytes, size, level);
+		state->decompressDictionary = ZSTD_createDDict(bytes, size);
+		if(state->compressDictionary == nullptr || state->decompressDictionary == nullptr) {
+			state->free_dictionaries();
+			dictionary.clear();
+			return -1;
+		}
+	}
+	return 0;
+#else
+	(void) bytes;
+	(void) size;
+	return -1;
+#endif
+}
+
+bool FrameCompressor::encode(const char* message, size_t size, std::vector<char>& out)
+{
+	size_t start = out.size();
+	if(codec == CompressionCodec::None || size < threshold) {
+		out.push_back((char) FRAME_RAW);
+		out.insert(out.end(), message, message + size);
+		return false;
+	}
+
+	unsigned char prefix[1 + MAX_FRAME_HEADER_SIZE];
+	size_t prefixSize = 1 + VarintCodec().encode(size, prefix + 1);
+	size_t compressedSize = 0;
+
+#ifdef SOCKET_LZ4
+	if(codec == CompressionCodec::LZ4) {
+		prefix[0] = FRAME_LZ4;
+		int bound = LZ4_compressBound((int) size);
+		out.resize(start + prefixSize + bound);
+		int result = LZ4_compress_fast(message, &out[start + prefixSize], (int) size, bound, level > 0 ? level : 1);
+		compressedSize = result > 0 ? (size_t) result : 0;
+	}
+#endif
+#ifdef SOCKET_ZSTD
+	if(codec == CompressionCodec::Zstd) {
+		prefix[0] = FRAME_ZSTD;
+		size_t bound = ZSTD_compressBound(size);
+		out.resize(start + prefixSize + bound);
+		size_t result = state->compressDictionary ?
+			ZSTD_compress_usingCDict(state->compressContext, &out[start + prefixSize], bound,
+				message, size, state->compressDictionary) :
+			ZSTD_compressCCtx(state->compressContext, &out[start + prefixSize], bound,
+				message, size, level);
+		compressedSize = ZSTD_isError(result) ? 0 : result;
+	}
+#endif
+
+	// Incompressible data goes out as is rather than growing.
+	if(compressedSize == 0 || prefixSize + compressedSize >= 1 + size) {
+		out.resize(start);
+		out.push_back((char) FRAME_RAW);
+		out.insert(out.end(), message, message + size);
+		return false;
+	}
+	memcpy(&out[start], prefix, prefixSize);
+	out.resize(start + prefixSize + compressedSize);
+	return true;
+}
+
+int64_t FrameCompressor::decoded_size(const char* body, size_t size) const
+{
+	if(size == 0) {
+		return -1;
+	}
+	unsigned char flag = (unsigned char) body[0];
+	if(flag == FRAME_RAW) {
+		return (int64_t) size - 1;
+	}
+	if(flag != FRAME_LZ4 && flag != FRAME_ZSTD) {
+		return -1;
+	}
+	size_t messageSize = 0;
+	if(VarintCodec().decode((const unsigned char*) body + 1, size - 1, messageSize) < 0) {
+		return -1;
+	}
+	return (int64_t) messageSize;
+}
+
+int FrameCompressor::decode(const char* body, size_t size, char* destination, size_t decodedSize)
+{
+	unsigned char flag = (unsigned char) body[0];
+	if(flag == FRAME_RAW) {
+		memcpy(destination, body + 1, decodedSize);
+		return 0;
+	}
+
+	size_t messageSize = 0;
+	int sizeLength = VarintCodec().decode((const unsigned char*) body + 1, size - 1, messageSize);
+	if(sizeLength < 0 || messageSize != decodedSize) {
+		return -1;
+	}
+	const char* compressed = body + 1 + sizeLength;
+	size_t compressedSize = size - 1 - sizeLength;
+
+#ifdef SOCKET_LZ4
+	if(flag == FRAME_LZ4) {
+		int result = LZ4_decompress_safe(compressed, destination, (int) compressedSize, (int) decodedSize);
+		return result == (int) decodedSize ? 0 : -1;
+	}
+#endif
+#ifdef SOCKET_ZSTD
+	if(flag == FRAME_ZSTD) {
+		size_t result = state->decompressDictionary ?
+			ZSTD_decompress_usingDDict(state->decompressContext, destination, decodedSize,
+				compressed, compressedSize, state->decompressDictionary) :
+			ZSTD_decompressDCtx(state->decompressContext, destination, decodedSize,
+				compressed, compressedSize);
+		return !ZSTD_isError(result) && result == decodedSize ? 0 : -1;
+	}
+#endif
+	(void) compressed;
+	(void) compressedSize;
+	return -1;
+}
+
+bool parse_compression_codec(const char* name, CompressionCodec& codec)
+{
+	if(strcmp(name, "none") == 0) {
+		codec = CompressionCodec::None;
+	} else if(strcmp(name, "lz4") == 0) {
+		codec = CompressionCodec::LZ4;
+	} else if(strcmp(name, "zstd") == 0) {
+		codec = CompressionCodec::Zstd;
+	} else {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,77 @@
+#ifndef FRAME_COMPRESSION_H
+#define FRAME_COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * Optional per frame compression. LZ4 is compiled in with SOCKET_LZ4 and
+ * zstd with SOCKET_ZSTD, SConstruct sets them for lz4=yes and zstd=yes.
+ *
+ * With compression on, every framed message body starts with a flag byte
+ * telling how the rest is encoded:
+ *
+ *   0x00  the message as is
+ *   0x01  varint message size, then the message as an LZ4 block
+ *   0x02  varint message size, then the message as a zstd frame
+ *
+ * Messages below the threshold, and messages that would not get smaller,
+ * are sent as is. The receiver goes by the flag byte only, so it decodes
+ * whatever codec the sender picked as long as it is compiled in.
+ * Both ends have to agree on turning compression on, and on the zstd
+ * dictionary if one is used.
+ */
+enum class CompressionCodec {
+	None,
+	LZ4,
+	Zstd
+};
+
+const unsigned char FRAME_RAW = 0x00;
+const unsigned char FRAME_LZ4 = 0x01;
+const unsigned char FRAME_ZSTD = 0x02;
+
+struct FrameCompressorState;
+
+class FrameCompressor {
+private:
+	CompressionCodec codec = CompressionCodec::None;
+	int level = 0;
+	size_t threshold = 512;
+	std::unique_ptr<FrameCompressorState> state;
+	std::vector<char> dictionary;
+public:
+	FrameCompressor();
+	~FrameCompressor();
+
+	FrameCompressor(const FrameCompressor&) = delete;
+	FrameCompressor& operator=(const FrameCompressor&) = delete;
+
+	static bool available(CompressionCodec codec);
+
+	// Level is the LZ4 acceleration or the zstd level, 0 for the default.
+	// Returns -1 if the codec is not compiled in.
+	int set_codec(CompressionCodec codec, int level, size_t threshold);
+	// Trained zstd dictionary, shared with the peer. Empty to go without.
+	int set_dictionary(const char* bytes, size_t size);
+	bool enabled() const { return codec != CompressionCodec::None; }
+
+	/*
+	 * Appends the flag byte and the encoded message to out. Returns true
+	 * if the message was compressed, false if it went in as is.
+	 */
+	bool encode(const char* message, size_t size, std::vector<char>& out);
+
+	// Size the body decodes to, or -1 if the flag byte or size is bad.
+	int64_t decoded_size(const char* body, size_t size) const;
+	// Decodes into destination, which has room for decoded_size bytes.
+	// Returns -1 if the body is corrupt or its codec is not compiled in.
+	int decode(const char* body, size_t size, char* destination, size_t decodedSize);
+};
+
+// Parses "none", "lz4" or "zstd", returns false for anything else.
+bool parse_compression_codec(const char* name, CompressionCodec& codec);
+
+#endif
@@ -0,0 +1,188 @@
+#include "FrameDelimiter.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DELIMITER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DELIMITER_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+bool FrameDelimiter::assign(const char* data, size_t numBytes)
+{
+	if(numBytes == 0 || numBytes > MAX_FRAME_DELIMITER_SIZE) {
+		return false;
+	}
+	memcpy(bytes, data, numBytes);
+	size = numBytes;
+	return true;
+}
+
+const char* delimiter_search_isa()
+{
+#if defined(DELIMITER_AVX2)
+	return "avx2";
+#elif defined(DELIMITER_SSE2)
+	return "sse2";
+#else
+	return "scalar";
+#endif
+}
+
+#if defined(DELIMITER_AVX2) || defined(DELIMITER_SSE2)
+static inline unsigned lowest_bit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned) index;
+#else
+	return (unsigned) __builtin_ctz(mask);
+#endif
+}
+
+/*
+ * Checks the candidates in mask, bit n standing for a delimiter starting
+ * at start + n whose first and last byte already matched.
+ */
+static inline bool match_candidates(const unsigned char* start, uint32_t mask,
+	const FrameDelimiter& delimiter, size_t& offset)
+{
+	while(mask != 0) {
+		unsigned bit = lowest_bit(mask);
+		if(delimiter.size <= 2 || memcmp(start + bit + 1, delimiter.bytes + 1, delimiter.size - 2) == 0) {
+			offset = bit;
+			return true;
+		}
+		mask &= mask - 1;
+	}
+	return false;
+}
+#endif
+
+size_t find_delimiter(const char* data, size_t size, const FrameDelimiter& delimiter)
+{
+	size_t length = delimiter.size;
+	if(size < length) {
+		return size;
+	}
+	const unsigned char* bytes = (const unsigned char*) data;
+	const unsigned char first = delimiter.bytes[0];
+	const unsigned char last = delimiter.bytes[length - 1];
+	// Number of positions a delimiter can start at.
+	const size_t starts = size - length + 1;
+	size_t i = 0;
+#if defined(DELIMITER_AVX2) || defined(DELIMITER_SSE2)
+	// Where match_candidates found the delimiter in a block.
+	size_t offset = 0;
+#endif
+
+#if defined(DELIMITER_AVX2)
+	const __m256i firstBytes = _mm256_set1_epi8((char) first);
+	const __m256i lastBytes = _mm256_set1_epi8((char) last);
+	for(; i + 32 <= starts; i += 32) {
+		__m256i head = _mm256_loadu_si256((const __m256i*) (bytes + i));
+		__m256i tail = _mm256_loadu_si256((const __m256i*) (bytes + i + length - 1));
+		__m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(head, firstBytes), _mm256_cmpeq_epi8(tail, lastBytes));
+		uint32_t mask = (uint32_t) _mm256_movemask_epi8(both);
+		if(mask != 0 && match_candidates(bytes + i, mask, delimiter, offset)) {
+			return i + offset;
+		}
+	}
+#endif
+#if defined(DELIMITER_AVX2) || defined(DELIMITER_SSE2)
+	const __m128i firstBytes16 = _mm_set1_epi8((char) first);
+	const __m128i lastBytes16 = _mm_set1_epi8((char) last);
+	for(; i + 16 <= starts; i += 16) {
+		__m128i head = _mm_loadu_si128((const __m128i*) (bytes + i));
+		__m128i tail = _mm_loadu_si128((const __m128i*) (bytes + i + length - 1));
+		__m128i both = _mm_and_si128(_mm_cmpeq_epi8(head, firstBytes16), _mm_cmpeq_epi8(tail, lastBytes16));
+		uint32_t mask = (uint32_t) _mm_movemask_epi8(both);
+		if(mask != 0 && match_candidates(bytes + i, mask, delimiter, offset)) {
+			return i + offset;
+		}
+	}
+#endif
+
+	// The tail, and everything on platforms without SSE2. memchr is
+	// vectorized by most C libraries already.
+	while(i < starts) {
+		const void* found = memchr(bytes + i, first, starts - i);
+		if(found == nullptr) {
+			break;
+		}
+		i = (const unsigned char*) found - bytes;
+		if(bytes[i + length - 1] == last && memcmp(bytes + i, delimiter.bytes, length) == 0) {
+			return i;
+		}
+		i++;
+	}
+	return size;
+}
+
+int decode_delimited(const FrameDelimiter& delimiter, const char* data, size_t available,
+	size_t maxBodySize, size_t& bodySize, size_t& searched)
+{
+	size_t from = searched < available ? searched : available;
+	size_t found = from + find_delimiter(data + from, available - from, delimiter);
+	if(found < available) {
+		if(found > maxBodySize) {
+			return FRAME_MALFORMED;
+		}
+		bodySize = found;
+		searched = 0;
+		return 0;
+	}
+
+	// The last bytes may be the start of a delimiter, they are searched
+	// again once more data arrived.
+	searched = available >= delimiter.size ? available - delimiter.size + 1 : 0;
+	if(searched > maxBodySize) {
+		return FRAME_MALFORMED;
+	}
+	return FRAME_INCOMPLETE;
+}
+
+size_t delimited_room(const FrameDelimiter& delimiter, size_t buffered, size_t maxBodySize)
+{
+	size_t limit = maxBodySize + delimiter.size;
+	size_t room = 2 * buffered + 1;
+	if(room > limit) {
+		room = limit > buffered ? limit : buffered + 1;
+	}
+	return room;
+}
+
+size_t scan_delimited(const FrameDelimiter& delimiter, const char* data, size_t available,
+	size_t maxCount, size_t maxBodySize, std::vector<FrameSpan>& frames, size_t& pending,
+	size_t& searched)
+{
+	size_t position = 0;
+	pending = delimited_room(delimiter, 0, maxBodySize);
+
+	while(frames.size() < maxCount) {
+		size_t bodySize = 0;
+		int result = decode_delimited(delimiter, data + position, available - position,
+			maxBodySize, bodySize, searched);
+		if(result == FRAME_INCOMPLETE) {
+			pending = delimited_room(delimiter, available - position, maxBodySize);
+			break;
+		}
+		if(result == FRAME_MALFORMED) {
+			pending = 0;
+			break;
+		}
+		if(bodySize > 0) {
+			frames.push_back(FrameSpan{position, bodySize});
+		}
+		position += bodySize + delimiter.size;
+	}
+	return position;
+}
@@ -0,0 +1,73 @@
+#ifndef FRAME_DELIMITER_H
+#define FRAME_DELIMITER_H
+
+#include <cstddef>
+#include <vector>
+
+#include "FrameCodec.hpp"
+
+/*
+ * Delimiter framing, for text protocols where every message ends with
+ * a fixed byte sequence, like "\n" or "\r\n", instead of starting with a
+ * length header. Messages must not contain the delimiter, the received
+ * spans leave it out and sending appends it.
+ *
+ * Finding the end of a message means looking at every byte, so the
+ * search is vectorized: candidates are positions where both the first
+ * and the last delimiter byte match, tested 32 bytes at a time with
+ * AVX2 when the core is built with avx2=yes, 16 at a time with SSE2 on
+ * any other x86-64 build, and one at a time elsewhere. Only candidates
+ * are compared in full.
+ */
+const size_t MAX_FRAME_DELIMITER_SIZE = 8;
+
+struct FrameDelimiter {
+	unsigned char bytes[MAX_FRAME_DELIMITER_SIZE] = { '\n' };
+	size_t size = 1;
+
+	// Returns false for an empty delimiter or one that is too long.
+	bool assign(const char* data, size_t numBytes);
+};
+
+// Name of the vector instructions find_delimiter was built with.
+const char* delimiter_search_isa();
+
+/*
+ * Returns the offset of the first delimiter in data, or size when there
+ * is none. Also the offset of a delimiter whose first bytes are within
+ * data but whose last are not yet is size.
+ */
+size_t find_delimiter(const char* data, size_t size, const FrameDelimiter& delimiter);
+
+/*
+ * Decodes the message at the start of data the way the length codecs
+ * decode a header: returns the header size, always 0, and sets bodySize
+ * to the bytes before the delimiter, or returns FRAME_INCOMPLETE while
+ * there is no delimiter yet and FRAME_MALFORMED once the message is
+ * already longer than maxBodySize without one.
+ * searched holds how many bytes at the start of data are known to not
+ * start a delimiter, a search resumes there and updates it when none is
+ * found, so a long message arriving in many reads is scanned only once.
+ */
+int decode_delimited(const FrameDelimiter& delimiter, const char* data, size_t available,
+	size_t maxBodySize, size_t& bodySize, size_t& searched);
+
+/*
+ * Room to make for a message of which buffered bytes arrived without a
+ * delimiter. The length is unknown, so it is twice what is buffered, up
+ * to the longest message allowed, which keeps reads of long messages
+ * large instead of one byte more each time.
+ */
+size_t delimited_room(const FrameDelimiter& delimiter, size_t buffered, size_t maxBodySize);
+
+/*
+ * scan_frames for delimited messages, see there. The spans leave out the
+ * delimiter, pending is the delimited_room of the incomplete message or
+ * 0 when it is too long. searched is as for decode_delimited and counts
+ * from the returned position.
+ */
+size_t scan_delimited(const FrameDelimiter& delimiter, const char* data, size_t available,
+	size_t maxCount, size_t maxBodySize, std::vector<FrameSpan>& frames, size_t& pending,
+	size_t& searched);
+
+#endif
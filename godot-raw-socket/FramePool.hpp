@@ -0,0 +1,194 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include "FrameTimestamps.hpp"
+
+class FramePool;
+
+/*
+ * A received message body in memory borrowed from a FramePool. Moving
+ * hands the memory over, destroying or resetting gives it back to the
+ * pool, so the receive thread and the consumer never free directly.
+ */
+class PooledFrame {
+private:
+	FramePool* pool = nullptr;
+	char* memory = nullptr;
+	size_t length = 0;
+	size_t capacity = 0;
+
+	friend class FramePool;
+	PooledFrame(FramePool* owner, char* data, size_t size, size_t reserved) :
+		pool(owner), memory(data), length(size), capacity(reserved) {}
+public:
+	// Stages the message went through, see SocketWrapper::set_timestamps.
+	FrameTimestamps timestamps;
+
+	PooledFrame() {}
+	~PooledFrame() { reset(); }
+
+	PooledFrame(const PooledFrame&) = delete;
+	PooledFrame& operator=(const PooledFrame&) = delete;
+
+	PooledFrame(PooledFrame&& other) { *this = std::move(other); }
+
+	PooledFrame& operator=(PooledFrame&& other)
+	{
+		if(this != &other) {
+			reset();
+			pool = other.pool;
+			memory = other.memory;
+			length = other.length;
+			capacity = other.capacity;
+			timestamps = other.timestamps;
+			other.pool = nullptr;
+			other.memory = nullptr;
+			other.length = 0;
+			other.capacity = 0;
+		}
+		return *this;
+	}
+
+	char* data() { return memory; }
+	const char* data() const { return memory; }
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+
+	inline void reset();
+};
+
+/*
+ * Size classed free lists of message buffers, from 64 bytes up to
+ * 64 KiB in powers of two. Buffers released by the consumer are kept for
+ * the next message of the same class, so receiving in a steady state does
+ * no heap allocations. At most maxCachedBytes are kept, anything beyond
+ * that, and messages larger than the largest class, go back to the heap.
+ */
+class FramePool {
+public:
+	static const int MIN_CLASS_BITS = 6;
+	static const int MAX_CLASS_BITS = 16;
+	static const int CLASS_COUNT = MAX_CLASS_BITS - MIN_CLASS_BITS + 1;
+private:
+	struct SizeClass {
+		std::mutex mutex;
+		std::vector<char*> free;
+	};
+
+	SizeClass classes[CLASS_COUNT];
+	std::atomic<size_t> cachedBytes{0};
+	std::atomic<size_t> maxCachedBytes;
+	std::atomic<uint64_t> heapAllocations{0};
+	std::atomic<uint64_t> reuses{0};
+
+	static int class_of(size_t size)
+	{
+		int bits = MIN_CLASS_BITS;
+		while(bits <= MAX_CLASS_BITS && ((size_t) 1 << bits) < size) {
+			bits++;
+		}
+		return bits - MIN_CLASS_BITS;
+	}
+public:
+	explicit FramePool(size_t maxCached = 4 * 1024 * 1024) : maxCachedBytes(maxCached) {}
+
+	FramePool(const FramePool&) = delete;
+	FramePool& operator=(const FramePool&) = delete;
+
+	~FramePool()
+	{
+		trim(0);
+	}
+
+	// A frame without data() when the heap is out of memory, a message can
+	// be as large as the maximum message size.
+	PooledFrame acquire(size_t size)
+	{
+		int sizeClass = class_of(size);
+		if(sizeClass >= CLASS_COUNT) {
+			char* memory = (char*) malloc(size);
+			if(!memory) {
+				return PooledFrame();
+			}
+			heapAllocations.fetch_add(1, std::memory_order_relaxed);
+			return PooledFrame(this, memory, size, size);
+		}
+
+		size_t reserved = (size_t) 1 << (sizeClass + MIN_CLASS_BITS);
+		SizeClass& entry = classes[sizeClass];
+		{
+			std::lock_guard<std::mutex> lock(entry.mutex);
+			if(!entry.free.empty()) {
+				char* memory = entry.free.back();
+				entry.free.pop_back();
+				cachedBytes.fetch_sub(reserved, std::memory_order_relaxed);
+				reuses.fetch_add(1, std::memory_order_relaxed);
+				return PooledFrame(this, memory, size, reserved);
+			}
+		}
+		char* memory = (char*) malloc(reserved);
+		if(!memory) {
+			return PooledFrame();
+		}
+		heapAllocations.fetch_add(1, std::memory_order_relaxed);
+		return PooledFrame(this, memory, size, reserved);
+	}
+
+	void release(char* memory, size_t reserved)
+	{
+		int sizeClass = class_of(reserved);
+		if(sizeClass < CLASS_COUNT &&
+			cachedBytes.load(std::memory_order_relaxed) + reserved <= maxCachedBytes.load(std::memory_order_relaxed)) {
+			SizeClass& entry = classes[sizeClass];
+			std::lock_guard<std::mutex> lock(entry.mutex);
+			entry.free.push_back(memory);
+			cachedBytes.fetch_add(reserved, std::memory_order_relaxed);
+			return;
+		}
+		free(memory);
+	}
+
+	// Frees cached buffers until at most maxCached bytes are left.
+	void trim(size_t maxCached)
+	{
+		for(int i = CLASS_COUNT - 1; i >= 0; i--) {
+			size_t reserved = (size_t) 1 << (i + MIN_CLASS_BITS);
+			std::lock_guard<std::mutex> lock(classes[i].mutex);
+			while(!classes[i].free.empty() && cachedBytes.load(std::memory_order_relaxed) > maxCached) {
+				free(classes[i].free.back());
+				classes[i].free.pop_back();
+				cachedBytes.fetch_sub(reserved, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void set_max_cached_bytes(size_t maxCached)
+	{
+		maxCachedBytes = maxCached;
+		trim(maxCached);
+	}
+
+	size_t cached_bytes() const { return cachedBytes.load(std::memory_order_relaxed); }
+	uint64_t heap_allocations() const { return heapAllocations.load(std::memory_order_relaxed); }
+	uint64_t reused() const { return reuses.load(std::memory_order_relaxed); }
+};
+
+inline void PooledFrame::reset()
+{
+	if(memory != nullptr) {
+		pool->release(memory, capacity);
+	}
+	pool = nullptr;
+	memory = nullptr;
+	length = 0;
+	capacity = 0;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/*
+ * Bounded lock free single producer, single consumer queue.
+ *
+ * The io thread is the only producer and the Godot main thread the
+ * only consumer, so a ring with one atomic index per side is enough.
+ * The indices are kept on separate cache lines so the two threads do
+ * not fight over the same line on every push and pop.
+ */
+template<typename T>
+class FrameQueue {
+private:
+	std::vector<T> slots;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+
+	static size_t round_up_pow2(size_t value)
+	{
+		size_t result = 2;
+		while(result < value) {
+			result <<= 1;
+		}
+		return result;
+	}
+public:
+	explicit FrameQueue(size_t capacity) :
+		slots(round_up_pow2(capacity)),
+		mask(round_up_pow2(capacity) - 1),
+		head(0),
+		tail(0) {}
+
+	FrameQueue(const FrameQueue&) = delete;
+	FrameQueue& operator=(const FrameQueue&) = delete;
+
+	// Producer side. Returns false when the queue is full, in which case
+	// item is left untouched.
+	bool try_push(T&& item)
+	{
+		size_t currentTail = tail.load(std::memory_order_relaxed);
+		if(currentTail - head.load(std::memory_order_acquire) > mask) {
+			return false;
+		}
+		slots[currentTail & mask] = std::move(item);
+		tail.store(currentTail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side. Returns false when the queue is empty.
+	bool try_pop(T& item)
+	{
+		size_t currentHead = head.load(std::memory_order_relaxed);
+		if(currentHead == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = std::move(slots[currentHead & mask]);
+		head.store(currentHead + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Only exact when called from the producer or the consumer thread
+	// while the other side is idle, good enough for statistics.
+	size_t size() const
+	{
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+};
+
+#endif
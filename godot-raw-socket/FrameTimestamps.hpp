@@ -0,0 +1,41 @@
+#ifndef FRAME_TIMESTAMPS_H
+#define FRAME_TIMESTAMPS_H
+
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Where a received message was at each stage on its way to the game, in
+ * microseconds of the system clock, or 0 for stages that were not
+ * stamped. Only filled in when SocketWrapper::set_timestamps is on.
+ *
+ *   kernelUsec     the kernel received the bytes, SO_TIMESTAMPING on
+ *                  Linux, 0 on other platforms
+ *   readUsec       the read returned them, decrypted when ssl is on
+ *   decodedUsec    the message was cut out of the stream
+ *   deliveredUsec  the message was handed to Godot
+ *
+ * The system clock is used throughout since kernel timestamps are on
+ * it, which also makes them comparable with send times of the server
+ * when both clocks are synchronized.
+ */
+struct FrameTimestamps {
+	uint64_t kernelUsec = 0;
+	uint64_t readUsec = 0;
+	uint64_t decodedUsec = 0;
+	uint64_t deliveredUsec = 0;
+};
+
+inline uint64_t timestamp_usec()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Time between two stamps, 0 if either is missing or the clock stepped back.
+inline uint64_t stamp_distance(uint64_t from, uint64_t to)
+{
+	return from != 0 && to > from ? to - from : 0;
+}
+
+#endif
@@ -0,0 +1,514 @@
+/*************************************************************************/
+/*  MessageLayout.cpp                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                       GODOT WINSOCK PLUGIN                            */
+/*             https://github.com/flodihn/GodotWinSocket                 */
+/*************************************************************************/
+/* Copyright (c) 2021 Christian Flodihn.                                 */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include <cstring>
+#include <sstream>
+
+#include <Vector3.hpp>
+
+#include "MessageLayout.hpp"
+
+/*
+ * Bounds checked reads from a received message. A read past the end
+ * clears ok and returns zeros, which is checked once per message rather
+ * than after every field.
+ */
+struct LayoutReader {
+	const unsigned char* data;
+	size_t left;
+	bool bigEndian;
+	bool ok = true;
+
+	uint64_t read_uint(int bytes)
+	{
+		if(left < (size_t) bytes) {
+			ok = false;
+			left = 0;
+			return 0;
+		}
+		uint64_t value = 0;
+		for(int i = 0; i < bytes; i++) {
+			int shift = bigEndian ? 8 * (bytes - 1 - i) : 8 * i;
+			value |= (uint64_t) data[i] << shift;
+		}
+		data += bytes;
+		left -= bytes;
+		return value;
+	}
+
+	float read_f32()
+	{
+		uint32_t bits = (uint32_t) read_uint(4);
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	double read_f64()
+	{
+		uint64_t bits = read_uint(8);
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	const char* read_bytes(size_t size)
+	{
+		if(left < size) {
+			ok = false;
+			left = 0;
+			return nullptr;
+		}
+		const char* bytes = (const char*) data;
+		data += size;
+		left -= size;
+		return bytes;
+	}
+};
+
+struct LayoutWriter {
+	std::vector<char>& out;
+	bool bigEndian;
+
+	void write_uint(uint64_t value, int bytes)
+	{
+		for(int i = 0; i < bytes; i++) {
+			int shift = bigEndian ? 8 * (bytes - 1 - i) : 8 * i;
+			out.push_back((char) (value >> shift));
+		}
+	}
+
+	void write_f32(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		write_uint(bits, 4);
+	}
+
+	void write_f64(double value)
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		write_uint(bits, 8);
+	}
+
+	// False when size does not fit in a length or count of lengthSize bytes.
+	bool write_length(size_t size, int lengthSize)
+	{
+		if(lengthSize < 8 && size >> (8 * lengthSize) != 0) {
+			return false;
+		}
+		write_uint(size, lengthSize);
+		return true;
+	}
+};
+
+static int integer_size(const std::string& name)
+{
+	if(name == "u8" || name == "i8") {
+		return 1;
+	}
+	if(name == "u16" || name == "i16") {
+		return 2;
+	}
+	if(name == "u32" || name == "i32") {
+		return 4;
+	}
+	return 0;
+}
+
+bool MessageLayouts::parse_type(const std::string& name, Field& field)
+{
+	std::string type = name;
+	field.countSize = 0;
+	size_t bracket = type.find('[');
+	if(bracket != std::string::npos) {
+		if(type.back() != ']') {
+			return false;
+		}
+		std::string count = type.substr(bracket + 1, type.size() - bracket - 2);
+		if(count != "u8" && count != "u16" && count != "u32") {
+			return false;
+		}
+		field.countSize = integer_size(count);
+		type = type.substr(0, bracket);
+	}
+
+	static const struct { const char* name; LayoutFieldType type; int lengthSize; } types[] = {
+		{ "u8", LayoutFieldType::U8, 0 }, { "i8", LayoutFieldType::I8, 0 },
+		{ "u16", LayoutFieldType::U16, 0 }, { "i16", LayoutFieldType::I16, 0 },
+		{ "u32", LayoutFieldType::U32, 0 }, { "i32", LayoutFieldType::I32, 0 },
+		{ "i64", LayoutFieldType::I64, 0 }, { "f32", LayoutFieldType::F32, 0 },
+		{ "f64", LayoutFieldType::F64, 0 }, { "vec3", LayoutFieldType::Vec3, 0 },
+		{ "str8", LayoutFieldType::Str, 1 }, { "str16", LayoutFieldType::Str, 2 },
+		{ "str32", LayoutFieldType::Str, 4 }, { "bytes8", LayoutFieldType::Bytes, 1 },
+		{ "bytes16", LayoutFieldType::Bytes, 2 }, { "bytes32", LayoutFieldType::Bytes, 4 }
+	};
+	for(const auto& known : types) {
+		if(type == known.name) {
+			field.type = known.type;
+			field.lengthSize = known.lengthSize;
+			return !(field.type == LayoutFieldType::Bytes && field.countSize > 0);
+		}
+	}
+	return false;
+}
+
+bool MessageLayouts::register_layout(int opcode, const char* spec, std::string& error)
+{
+	if(opcode < 0 || opcode > 255) {
+		error = "Opcode must be between 0 and 255.";
+		return false;
+	}
+
+	Layout layout;
+	layout.registered = true;
+	std::istringstream tokens(spec);
+	std::string token;
+	bool first = true;
+	while(tokens >> token) {
+		if(first && (token == "<" || token == ">")) {
+			layout.bigEndian = token == ">";
+			first = false;
+			continue;
+		}
+		first = false;
+
+		size_t colon = token.find(':');
+		Field field;
+		if(colon == 0 || colon == std::string::npos || !parse_type(token.substr(colon + 1), field)) {
+			error = "Bad field '" + token + "', expected name:type.";
+			return false;
+		}
+		field.name = godot::String(token.substr(0, colon).c_str());
+		layout.fields.push_back(field);
+	}
+
+	layouts[opcode] = layout;
+	return true;
+}
+
+void MessageLayouts::unregister_layout(int opcode)
+{
+	if(opcode >= 0 && opcode <= 255) {
+		layouts[opcode] = Layout();
+	}
+}
+
+bool MessageLayouts::has_layout(int opcode) const
+{
+	return opcode >= 0 && opcode <= 255 && layouts[opcode].registered;
+}
+
+static int64_t read_integer(LayoutReader& reader, LayoutFieldType type)
+{
+	switch(type) {
+	case LayoutFieldType::U8:
+		return (int64_t) reader.read_uint(1);
+	case LayoutFieldType::I8:
+		return (int8_t) reader.read_uint(1);
+	case LayoutFieldType::U16:
+		return (int64_t) reader.read_uint(2);
+	case LayoutFieldType::I16:
+		return (int16_t) reader.read_uint(2);
+	case LayoutFieldType::U32:
+		return (int64_t) reader.read_uint(4);
+	case LayoutFieldType::I32:
+		return (int32_t) reader.read_uint(4);
+	default:
+		return (int64_t) reader.read_uint(8);
+	}
+}
+
+static godot::String read_string(LayoutReader& reader, int lengthSize)
+{
+	size_t length = (size_t) reader.read_uint(lengthSize);
+	const char* bytes = reader.read_bytes(length);
+	if(bytes == nullptr) {
+		return godot::String();
+	}
+	return godot::String(std::string(bytes, length).c_str());
+}
+
+bool MessageLayouts::decode(const char* data, size_t size, godot::Dictionary& fields) const
+{
+	if(size == 0 || !layouts[(unsigned char) data[0]].registered) {
+		return false;
+	}
+	const Layout& layout = layouts[(unsigned char) data[0]];
+	LayoutReader reader{(const unsigned char*) data + 1, size - 1, layout.bigEndian};
+	fields[opcodeKey] = (int) (unsigned char) data[0];
+
+	for(const Field& field : layout.fields) {
+		if(field.countSize == 0) {
+			switch(field.type) {
+			case LayoutFieldType::F32:
+				fields[field.name] = reader.read_f32();
+				break;
+			case LayoutFieldType::F64:
+				fields[field.name] = reader.read_f64();
+				break;
+			case LayoutFieldType::Vec3: {
+				float x = reader.read_f32();
+				float y = reader.read_f32();
+				float z = reader.read_f32();
+				fields[field.name] = godot::Vector3(x, y, z);
+				break;
+			}
+			case LayoutFieldType::Str:
+				fields[field.name] = read_string(reader, field.lengthSize);
+				break;
+			case LayoutFieldType::Bytes: {
+				size_t length = (size_t) reader.read_uint(field.lengthSize);
+				const char* bytes = reader.read_bytes(length);
+				godot::PoolByteArray array;
+				if(bytes != nullptr) {
+					array.resize((int) length);
+					memcpy(array.write().ptr(), bytes, length);
+				}
+				fields[field.name] = array;
+				break;
+			}
+			default:
+				fields[field.name] = read_integer(reader, field.type);
+				break;
+			}
+		} else {
+			size_t count = (size_t) reader.read_uint(field.countSize);
+			// Every element takes at least a byte, a count beyond what is
+			// left is a corrupt message, not something to allocate for.
+			if(count > reader.left) {
+				return false;
+			}
+			switch(field.type) {
+			case LayoutFieldType::U8: {
+				godot::PoolByteArray array;
+				array.resize((int) count);
+				const char* bytes = reader.read_bytes(count);
+				if(bytes != nullptr) {
+					memcpy(array.write().ptr(), bytes, count);
+				}
+				fields[field.name] = array;
+				break;
+			}
+			case LayoutFieldType::F32:
+			case LayoutFieldType::F64: {
+				godot::PoolRealArray array;
+				array.resize((int) count);
+				godot::PoolRealArray::Write write = array.write();
+				for(size_t i = 0; i < count; i++) {
+					write[(int) i] = field.type == LayoutFieldType::F32 ? reader.read_f32() : (float) reader.read_f64();
+				}
+				fields[field.name] = array;
+				break;
+			}
+			case LayoutFieldType::Vec3: {
+				godot::PoolVector3Array array;
+				array.resize((int) count);
+				godot::PoolVector3Array::Write write = array.write();
+				for(size_t i = 0; i < count; i++) {
+					float x = reader.read_f32();
+					float y = reader.read_f32();
+					float z = reader.read_f32();
+					write[(int) i] = godot::Vector3(x, y, z);
+				}
+				fields[field.name] = array;
+				break;
+			}
+			case LayoutFieldType::Str: {
+				godot::PoolStringArray array;
+				for(size_t i = 0; i < count && reader.ok; i++) {
+					array.append(read_string(reader, field.lengthSize));
+				}
+				fields[field.name] = array;
+				break;
+			}
+			default: {
+				godot::PoolIntArray array;
+				array.resize((int) count);
+				godot::PoolIntArray::Write write = array.write();
+				for(size_t i = 0; i < count; i++) {
+					write[(int) i] = (int) read_integer(reader, field.type);
+				}
+				fields[field.name] = array;
+				break;
+			}
+			}
+		}
+		if(!reader.ok) {
+			return false;
+		}
+	}
+	// Trailing bytes mean the layout does not match what was sent.
+	return reader.left == 0;
+}
+
+static int integer_bytes(LayoutFieldType type)
+{
+	switch(type) {
+	case LayoutFieldType::U8:
+	case LayoutFieldType::I8:
+		return 1;
+	case LayoutFieldType::U16:
+	case LayoutFieldType::I16:
+		return 2;
+	case LayoutFieldType::U32:
+	case LayoutFieldType::I32:
+		return 4;
+	default:
+		return 8;
+	}
+}
+
+static bool write_string(LayoutWriter& writer, const godot::String& value, int lengthSize)
+{
+	godot::CharString utf8 = value.utf8();
+	if(!writer.write_length((size_t) utf8.length(), lengthSize)) {
+		return false;
+	}
+	writer.out.insert(writer.out.end(), utf8.get_data(), utf8.get_data() + utf8.length());
+	return true;
+}
+
+bool MessageLayouts::encode(int opcode, const godot::Dictionary& fields, std::vector<char>& out) const
+{
+	if(!has_layout(opcode)) {
+		return false;
+	}
+	const Layout& layout = layouts[opcode];
+	LayoutWriter writer{out, layout.bigEndian};
+	out.push_back((char) opcode);
+
+	for(const Field& field : layout.fields) {
+		godot::Variant value = fields.has(field.name) ? fields[field.name] : godot::Variant();
+		if(field.countSize == 0) {
+			switch(field.type) {
+			case LayoutFieldType::F32:
+				writer.write_f32((float) (double) value);
+				break;
+			case LayoutFieldType::F64:
+				writer.write_f64((double) value);
+				break;
+			case LayoutFieldType::Vec3: {
+				godot::Vector3 vector = value;
+				writer.write_f32(vector.x);
+				writer.write_f32(vector.y);
+				writer.write_f32(vector.z);
+				break;
+			}
+			case LayoutFieldType::Str:
+				if(!write_string(writer, value, field.lengthSize)) {
+					return false;
+				}
+				break;
+			case LayoutFieldType::Bytes: {
+				godot::PoolByteArray array = value;
+				if(!writer.write_length((size_t) array.size(), field.lengthSize)) {
+					return false;
+				}
+				godot::PoolByteArray::Read read = array.read();
+				const char* bytes = (const char*) read.ptr();
+				out.insert(out.end(), bytes, bytes + array.size());
+				break;
+			}
+			default:
+				writer.write_uint((uint64_t) (int64_t) value, integer_bytes(field.type));
+				break;
+			}
+			continue;
+		}
+
+		switch(field.type) {
+		case LayoutFieldType::F32:
+		case LayoutFieldType::F64: {
+			godot::PoolRealArray array = value;
+			if(!writer.write_length((size_t) array.size(), field.countSize)) {
+				return false;
+			}
+			godot::PoolRealArray::Read read = array.read();
+			for(int i = 0; i < array.size(); i++) {
+				if(field.type == LayoutFieldType::F32) {
+					writer.write_f32(read[i]);
+				} else {
+					writer.write_f64(read[i]);
+				}
+			}
+			break;
+		}
+		case LayoutFieldType::Vec3: {
+			godot::PoolVector3Array array = value;
+			if(!writer.write_length((size_t) array.size(), field.countSize)) {
+				return false;
+			}
+			godot::PoolVector3Array::Read read = array.read();
+			for(int i = 0; i < array.size(); i++) {
+				writer.write_f32(read[i].x);
+				writer.write_f32(read[i].y);
+				writer.write_f32(read[i].z);
+			}
+			break;
+		}
+		case LayoutFieldType::Str: {
+			godot::PoolStringArray array = value;
+			if(!writer.write_length((size_t) array.size(), field.countSize)) {
+				return false;
+			}
+			godot::PoolStringArray::Read read = array.read();
+			for(int i = 0; i < array.size(); i++) {
+				if(!write_string(writer, read[i], field.lengthSize)) {
+					return false;
+				}
+			}
+			break;
+		}
+		case LayoutFieldType::U8: {
+			godot::PoolByteArray array = value;
+			if(!writer.write_length((size_t) array.size(), field.countSize)) {
+				return false;
+			}
+			godot::PoolByteArray::Read read = array.read();
+			const char* bytes = (const char*) read.ptr();
+			out.insert(out.end(), bytes, bytes + array.size());
+			break;
+		}
+		default: {
+			godot::PoolIntArray array = value;
+			if(!writer.write_length((size_t) array.size(), field.countSize)) {
+				return false;
+			}
+			godot::PoolIntArray::Read read = array.read();
+			for(int i = 0; i < array.size(); i++) {
+				writer.write_uint((uint64_t) (int64_t) read[i], integer_bytes(field.type));
+			}
+			break;
+		}
+		}
+	}
+	return true;
+}
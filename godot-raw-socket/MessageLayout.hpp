@@ -0,0 +1,105 @@
+/*************************************************************************/
+/*  MessageLayout.hpp                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                       GODOT WINSOCK PLUGIN                            */
+/*             https://github.com/flodihn/GodotWinSocket                 */
+/*************************************************************************/
+/* Copyright (c) 2021 Christian Flodihn.                                 */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef MESSAGE_LAYOUT_H
+#define MESSAGE_LAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Godot.hpp>
+#include <Dictionary.hpp>
+#include <PoolArrays.hpp>
+#include <String.hpp>
+
+/*
+ * Fixed binary message layouts, registered per opcode from GDScript and
+ * decoded or encoded natively in one call instead of a get_u8 or
+ * get_string per field.
+ *
+ * A message is an opcode byte followed by the fields of its layout. The
+ * spec lists the fields as name:type, separated by spaces, optionally
+ * starting with < for little endian, big endian is the default:
+ *
+ *   "email:str8 password:str8"
+ *   "< tick:u32 ids:u16[u16] positions:vec3[u16]"
+ *
+ *   u8 i8 u16 i16 u32 i32 i64  integers
+ *   f32 f64                    floats
+ *   vec3                       three f32, a Vector3
+ *   str8 str16 str32           UTF-8 string after a 1, 2 or 4 byte length
+ *   bytes8 bytes16 bytes32     PoolByteArray after a 1, 2 or 4 byte length
+ *
+ * Any type but bytes can be repeated as type[u8], type[u16] or type[u32],
+ * a count of that size followed by the elements, which decode into the
+ * matching packed array: u8 into PoolByteArray, the other integers into
+ * PoolIntArray, floats into PoolRealArray, vec3 into PoolVector3Array and
+ * strings into PoolStringArray.
+ */
+enum class LayoutFieldType { U8, I8, U16, I16, U32, I32, I64, F32, F64, Vec3, Str, Bytes };
+
+class MessageLayouts {
+private:
+	struct Field {
+		godot::String name;
+		LayoutFieldType type;
+		// Size of the length in front of a string or bytes.
+		int lengthSize;
+		// Size of the count in front of an array, 0 for a single value.
+		int countSize;
+	};
+
+	struct Layout {
+		bool registered = false;
+		bool bigEndian = true;
+		std::vector<Field> fields;
+	};
+
+	Layout layouts[256];
+	godot::String opcodeKey = "opcode";
+
+	static bool parse_type(const std::string& name, Field& field);
+public:
+	// Returns false and why in error if the spec can not be parsed.
+	bool register_layout(int opcode, const char* spec, std::string& error);
+	void unregister_layout(int opcode);
+	bool has_layout(int opcode) const;
+
+	// Decodes a whole message into fields, with the opcode under "opcode".
+	// Returns false for unknown opcodes and truncated or oversized messages.
+	bool decode(const char* data, size_t size, godot::Dictionary& fields) const;
+	// Appends the opcode and the fields, missing fields are written as 0
+	// or empty. Returns false for unknown opcodes or values too long for
+	// their length or count.
+	bool encode(int opcode, const godot::Dictionary& fields, std::vector<char>& out) const;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef READ_AHEAD_BUFFER_H
+#define READ_AHEAD_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * Buffer the socket is read into in large chunks, so that a burst of
+ * small messages costs one read instead of two per message.
+ *
+ * Bytes are appended at the end and consumed from the front. Unread
+ * bytes are moved back to the start only when the free space at the
+ * end is too small, which keeps every buffered message contiguous in
+ * memory so it can be parsed and copied out in place.
+ */
+class ReadAheadBuffer {
+private:
+	std::vector<char> storage;
+	size_t start = 0;
+	size_t end = 0;
+	uint64_t consumed = 0;
+public:
+	explicit ReadAheadBuffer(size_t capacity) : storage(capacity) {}
+
+	const char* data() const { return storage.data() + start; }
+	size_t size() const { return end - start; }
+	size_t capacity() const { return storage.size(); }
+	// Offset of data() within the stream, it does not change when the
+	// buffer is compacted.
+	uint64_t stream_position() const { return consumed; }
+
+	char* write_ptr() { return storage.data() + end; }
+	size_t write_space() const { return storage.size() - end; }
+	void commit(size_t numBytes) { end += numBytes; }
+
+	void consume(size_t numBytes)
+	{
+		start += numBytes;
+		consumed += numBytes;
+		if(start == end) {
+			start = end = 0;
+		}
+	}
+
+	// Copies up to numBytes of buffered data into destination and
+	// consumes it, returns the number of bytes copied.
+	size_t take(char* destination, size_t numBytes)
+	{
+		if(numBytes > size()) {
+			numBytes = size();
+		}
+		memcpy(destination, data(), numBytes);
+		consume(numBytes);
+		return numBytes;
+	}
+
+	// Makes sure numBytes fit after the current start, compacting and,
+	// for messages larger than the buffer, growing it.
+	void make_room(size_t numBytes)
+	{
+		if(storage.size() - start >= numBytes && write_space() > 0) {
+			return;
+		}
+		if(start > 0) {
+			memmove(storage.data(), data(), size());
+			end -= start;
+			start = 0;
+		}
+		if(storage.size() < numBytes) {
+			storage.resize(numBytes);
+		}
+	}
+
+	void resize(size_t capacity)
+	{
+		if(start > 0) {
+			memmove(storage.data(), data(), size());
+			end -= start;
+			start = 0;
+		}
+		if(capacity >= size()) {
+			storage.resize(capacity);
+			storage.shrink_to_fit();
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include "SendQueue.hpp"
+
+#include <cstdint>
+
+SendQueue::SendQueue(SocketStats& socketStats, size_t highWater) :
+	stats(socketStats),
+	highWaterMark(highWater)
+{
+}
+
+int SendQueue::push(SendLane lane, const char* frame, size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t limit = lane == SendLane::Bulk ? highWaterMark / 2 : highWaterMark;
+		if(queued > 0 && queued + size > limit) {
+			count(stats.refusedMessages);
+			return 0;
+		}
+
+		Lane& entry = lanes[(int) lane];
+		entry.bytes.insert(entry.bytes.end(), frame, frame + size);
+		entry.frames.push_back({ entry.bytes.size(), std::chrono::steady_clock::now() });
+		queued += size;
+		stats.sendQueueBytes.store(queued, std::memory_order_relaxed);
+	}
+	changed.notify_one();
+	return 1;
+}
+
+bool SendQueue::take(std::vector<char>& out)
+{
+	out.clear();
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [this] { return stopping || queued > 0; });
+	if(stopping) {
+		return false;
+	}
+
+	take_lane(lanes[(int) SendLane::Input], SIZE_MAX, out, stats.inputQueueUsec);
+	take_lane(lanes[(int) SendLane::Gameplay], SIZE_MAX, out, stats.gameplayQueueUsec);
+	take_lane(lanes[(int) SendLane::Bulk], bulkChunkSize, out, stats.bulkQueueUsec);
+	queued -= out.size();
+	stats.sendQueueBytes.store(queued, std::memory_order_relaxed);
+	writing = true;
+	return true;
+}
+
+/*
+ * Moves whole messages from the front of a lane into out, at least one
+ * and then as many as fit maxBytes, recording how long each waited.
+ */
+void SendQueue::take_lane(Lane& lane, size_t maxBytes, std::vector<char>& out, Histogram& waited)
+{
+	auto now = std::chrono::steady_clock::now();
+	size_t end = lane.start;
+	while(!lane.frames.empty()) {
+		const QueuedFrame& frame = lane.frames.front();
+		if(end > lane.start && frame.end - lane.start > maxBytes) {
+			break;
+		}
+		waited.record(std::chrono::duration_cast<std::chrono::microseconds>(now - frame.queued).count());
+		end = frame.end;
+		lane.frames.pop_front();
+	}
+
+	out.insert(out.end(), lane.bytes.begin() + lane.start, lane.bytes.begin() + end);
+	lane.start = end;
+	if(lane.frames.empty()) {
+		lane.bytes.clear();
+		lane.start = 0;
+	} else if(lane.start > lane.bytes.size() / 2) {
+		// Bulk left behind a chunk, the sent part is dropped once it is
+		// the larger half so the buffer does not grow without end.
+		lane.bytes.erase(lane.bytes.begin(), lane.bytes.begin() + lane.start);
+		for(QueuedFrame& frame : lane.frames) {
+			frame.end -= lane.start;
+		}
+		lane.start = 0;
+	}
+}
+
+void SendQueue::write_done()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		writing = false;
+	}
+	changed.notify_all();
+}
+
+bool SendQueue::stop(std::chrono::milliseconds grace)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	stopping = true;
+	changed.notify_all();
+	return !changed.wait_for(lock, grace, [this] { return !writing; });
+}
+
+void SendQueue::restart()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	stopping = false;
+}
+
+void SendQueue::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for(Lane& lane : lanes) {
+		lane.bytes.clear();
+		lane.start = 0;
+		lane.frames.clear();
+	}
+	queued = 0;
+	stats.sendQueueBytes.store(0, std::memory_order_relaxed);
+}
+
+void SendQueue::set_high_water_mark(size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	highWaterMark = size;
+}
+
+size_t SendQueue::high_water_mark() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return highWaterMark;
+}
+
+size_t SendQueue::queued_bytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return queued;
+}
@@ -0,0 +1,94 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "SocketStats.hpp"
+
+/*
+ * Lanes of the send queue, most urgent first. Input is what the player
+ * just did, gameplay the regular traffic, and bulk anything large that
+ * can wait, like uploads or chat history.
+ */
+enum class SendLane {
+	Input,
+	Gameplay,
+	Bulk
+};
+
+const int SEND_LANE_COUNT = 3;
+
+/*
+ * Outbound messages waiting for the send thread of a SocketWrapper, one
+ * buffer of framed messages per lane. Producers never block: a message
+ * that would take the queue past the high water mark is refused, so the
+ * game learns about backpressure instead of stalling in a write. Bulk
+ * messages are refused from half the mark on, which keeps the other
+ * half for input and gameplay. A message is always taken into an empty
+ * queue, so messages larger than the mark still go out.
+ *
+ * Every write of the send thread takes all queued input, then all
+ * gameplay, then at most bulkChunkSize bytes of bulk, cut at message
+ * boundaries. Urgent messages queued while bulk data is being written
+ * therefore wait for at most one chunk.
+ */
+class SendQueue {
+public:
+	static const size_t DEFAULT_BULK_CHUNK_SIZE = 16 * 1024;
+private:
+	struct QueuedFrame {
+		size_t end;
+		std::chrono::steady_clock::time_point queued;
+	};
+
+	struct Lane {
+		std::vector<char> bytes;
+		size_t start = 0;
+		std::deque<QueuedFrame> frames;
+	};
+
+	SocketStats& stats;
+	mutable std::mutex mutex;
+	std::condition_variable changed;
+	Lane lanes[SEND_LANE_COUNT];
+	size_t queued = 0;
+	size_t highWaterMark;
+	size_t bulkChunkSize = DEFAULT_BULK_CHUNK_SIZE;
+	bool stopping = false;
+	bool writing = false;
+
+	void take_lane(Lane& lane, size_t maxBytes, std::vector<char>& out, Histogram& waited);
+public:
+	SendQueue(SocketStats& socketStats, size_t highWater);
+
+	SendQueue(const SendQueue&) = delete;
+	SendQueue& operator=(const SendQueue&) = delete;
+
+	// Returns 1 if the framed message was queued, 0 if it was refused.
+	int push(SendLane lane, const char* frame, size_t size);
+
+	/*
+	 * Waits until something is queued and moves the next write into out.
+	 * Returns false once stop was called. write_done has to follow every
+	 * take that returned true.
+	 */
+	bool take(std::vector<char>& out);
+	void write_done();
+
+	// Makes take return false. Waits up to grace for a write in progress,
+	// returns true if it is still going after that.
+	bool stop(std::chrono::milliseconds grace);
+	void restart();
+	void clear();
+
+	void set_high_water_mark(size_t size);
+	size_t high_water_mark() const;
+	size_t queued_bytes() const;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "SharedRing.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+static const char RING_MAGIC[8] = { 'G', 'W', 'S', 'R', 'I', 'N', 'G', '\0' };
+static const char RING_HELLO[8] = { 'G', 'W', 'S', 'R', 'I', 'N', 'G', '1' };
+
+// How often a wait checks its condition before sleeping. On a single
+// core the peer can not run while this side spins, so it sleeps at once.
+static const int SPIN_ITERATIONS = 1000;
+
+static int spin_iterations()
+{
+	static const int iterations = std::thread::hardware_concurrency() > 1 ? SPIN_ITERATIONS : 0;
+	return iterations;
+}
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The rings need lock free 64 bit atomics.");
+static_assert(offsetof(SharedRingHeader, closed) == 16, "Segment layout changed.");
+static_assert(offsetof(SharedRingHeader, rings) == 64, "Segment layout changed.");
+static_assert(sizeof(RingControl) == 256, "Segment layout changed.");
+static_assert(sizeof(SharedRingHeader) <= SHARED_RING_DATA_OFFSET, "Segment layout changed.");
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+#if defined(__linux__)
+// Not FUTEX_PRIVATE_FLAG, the words are shared with another process.
+static void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, int timeoutMs)
+{
+	timespec timeout;
+	timeout.tv_sec = timeoutMs / 1000;
+	timeout.tv_nsec = (long) (timeoutMs % 1000) * 1000000;
+	syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>& word)
+{
+	syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+#else
+static void futex_wait(std::atomic<uint32_t>&, uint32_t, int) {}
+static void futex_wake(std::atomic<uint32_t>&) {}
+#endif
+
+static void notify(std::atomic<uint32_t>& word)
+{
+	word.fetch_add(1);
+	futex_wake(word);
+}
+
+SharedRing::~SharedRing()
+{
+	unmap();
+}
+
+bool SharedRing::supported()
+{
+#if defined(__linux__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+int SharedRing::map(int segmentFd, size_t size, bool create)
+{
+#if defined(__linux__)
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, segmentFd, 0);
+	if(memory == MAP_FAILED) {
+		return -1;
+	}
+	segment = (char*) memory;
+	segmentSize = size;
+
+	SharedRingHeader* header = (SharedRingHeader*) segment;
+	if(create) {
+		// A fresh segment is all zeroes, which is an empty ring.
+		memcpy(header->magic, RING_MAGIC, sizeof(RING_MAGIC));
+		header->version = SHARED_RING_VERSION;
+		header->ringSize = (uint32_t) ringSize;
+	} else if(memcmp(header->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 ||
+		header->version != SHARED_RING_VERSION ||
+		header->ringSize < MIN_SHARED_RING_SIZE || header->ringSize > MAX_SHARED_RING_SIZE ||
+		(header->ringSize & (header->ringSize - 1)) != 0 ||
+		SHARED_RING_DATA_OFFSET + 2 * (size_t) header->ringSize > size) {
+		unmap();
+		errno = EPROTO;
+		return -1;
+	} else {
+		ringSize = header->ringSize;
+	}
+
+	incoming = &header->rings[1 - side];
+	outgoing = &header->rings[side];
+	incomingBytes = segment + SHARED_RING_DATA_OFFSET + (1 - side) * ringSize;
+	outgoingBytes = segment + SHARED_RING_DATA_OFFSET + side * ringSize;
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void SharedRing::unmap()
+{
+#if defined(__linux__)
+	if(segment != nullptr) {
+		munmap(segment, segmentSize);
+	}
+#endif
+	segment = nullptr;
+	incoming = outgoing = nullptr;
+	unpublished = 0;
+}
+
+int SharedRing::create(int socketFd, size_t size)
+{
+#if defined(__linux__)
+	unmap();
+	side = 0;
+	ringSize = MIN_SHARED_RING_SIZE;
+	while(ringSize < size && ringSize < MAX_SHARED_RING_SIZE) {
+		ringSize *= 2;
+	}
+	size_t total = SHARED_RING_DATA_OFFSET + 2 * ringSize;
+
+	int segmentFd = (int) syscall(SYS_memfd_create, "GodotRawSocket", 1 /* MFD_CLOEXEC */);
+	if(segmentFd == -1) {
+		return -1;
+	}
+	if(ftruncate(segmentFd, (off_t) total) == -1 || map(segmentFd, total, true) == -1) {
+		int error = errno;
+		::close(segmentFd);
+		errno = error;
+		return -1;
+	}
+
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	iovec vector = { (void*) RING_HELLO, sizeof(RING_HELLO) };
+	msghdr message = {};
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	cmsghdr* rights = CMSG_FIRSTHDR(&message);
+	rights->cmsg_level = SOL_SOCKET;
+	rights->cmsg_type = SCM_RIGHTS;
+	rights->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(rights), &segmentFd, sizeof(int));
+
+	ssize_t sent = sendmsg(socketFd, &message, MSG_NOSIGNAL);
+	int error = errno;
+	// The mapping and the server's copy keep the segment alive.
+	::close(segmentFd);
+	char answer = 0;
+	if(sent != (ssize_t) sizeof(RING_HELLO) || recv(socketFd, &answer, 1, MSG_WAITALL) != 1 || answer != 1) {
+		if(sent == (ssize_t) sizeof(RING_HELLO)) {
+			error = errno != 0 ? errno : ECONNREFUSED;
+		}
+		unmap();
+		errno = error;
+		return -1;
+	}
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int SharedRing::accept(int socketFd)
+{
+#if defined(__linux__)
+	unmap();
+	side = 1;
+	char hello[sizeof(RING_HELLO)];
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	iovec vector = { hello, sizeof(hello) };
+	msghdr message = {};
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received = recvmsg(socketFd, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	cmsghdr* rights = received > 0 ? CMSG_FIRSTHDR(&message) : nullptr;
+	if(rights == nullptr || rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS) {
+		errno = received == -1 ? errno : EPROTO;
+		return -1;
+	}
+	int segmentFd;
+	memcpy(&segmentFd, CMSG_DATA(rights), sizeof(int));
+
+	struct stat status;
+	int result = -1;
+	if(received != (ssize_t) sizeof(hello) || memcmp(hello, RING_HELLO, sizeof(hello)) != 0) {
+		errno = EPROTO;
+	} else if(fstat(segmentFd, &status) == 0) {
+		result = map(segmentFd, (size_t) status.st_size, false);
+	}
+	int error = errno;
+	::close(segmentFd);
+	char answer = 1;
+	if(result == 0 && send(socketFd, &answer, 1, MSG_NOSIGNAL) != 1) {
+		error = errno;
+		unmap();
+		result = -1;
+	}
+	errno = error;
+	return result;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+size_t SharedRing::readable() const
+{
+	return (size_t) (incoming->written.load(std::memory_order_acquire) - incoming->read.load(std::memory_order_relaxed));
+}
+
+size_t SharedRing::writable() const
+{
+	uint64_t position = outgoing->written.load(std::memory_order_relaxed) + unpublished;
+	return ringSize - (size_t) (position - outgoing->read.load(std::memory_order_acquire));
+}
+
+size_t SharedRing::read(char* destination, size_t maxBytes)
+{
+	uint64_t position = incoming->read.load(std::memory_order_relaxed);
+	size_t available = (size_t) (incoming->written.load(std::memory_order_acquire) - position);
+	size_t numBytes = available < maxBytes ? available : maxBytes;
+	// A peer can not make this read past the ring, whatever it writes.
+	if(numBytes > ringSize) {
+		numBytes = ringSize;
+	}
+	if(numBytes == 0) {
+		return 0;
+	}
+
+	size_t offset = (size_t) position & (ringSize - 1);
+	size_t first = numBytes < ringSize - offset ? numBytes : ringSize - offset;
+	memcpy(destination, incomingBytes + offset, first);
+	memcpy(destination + first, incomingBytes, numBytes - first);
+
+	// Sequentially consistent with the load of writerWaiting, so either
+	// the writer sees the room or this side sees it waiting.
+	incoming->read.store(position + numBytes);
+	if(incoming->writerWaiting.load() != 0) {
+		notify(incoming->spaceSignal);
+	}
+	return numBytes;
+}
+
+size_t SharedRing::write(const char* source, size_t numBytes)
+{
+	size_t staged = stage(source, numBytes);
+	commit();
+	return staged;
+}
+
+size_t SharedRing::stage(const char* source, size_t numBytes)
+{
+	uint64_t position = outgoing->written.load(std::memory_order_relaxed) + unpublished;
+	size_t room = ringSize - (size_t) (position - outgoing->read.load(std::memory_order_acquire));
+	if(numBytes > room) {
+		numBytes = room;
+	}
+	if(numBytes > ringSize) {
+		numBytes = ringSize;
+	}
+	if(numBytes == 0) {
+		return 0;
+	}
+
+	size_t offset = (size_t) position & (ringSize - 1);
+	size_t first = numBytes < ringSize - offset ? numBytes : ringSize - offset;
+	memcpy(outgoingBytes + offset, source, first);
+	memcpy(outgoingBytes, source + first, numBytes - first);
+	unpublished += numBytes;
+	return numBytes;
+}
+
+void SharedRing::commit()
+{
+	if(unpublished == 0) {
+		return;
+	}
+	outgoing->written.store(outgoing->written.load(std::memory_order_relaxed) + unpublished);
+	unpublished = 0;
+	if(outgoing->readerWaiting.load() != 0) {
+		notify(outgoing->dataSignal);
+	}
+}
+
+void SharedRing::wait_readable(int timeoutMs)
+{
+	for(int i = spin_iterations(); i > 0; i--) {
+		if(readable() > 0 || peer_closed()) {
+			return;
+		}
+		cpu_relax();
+	}
+
+	// Armed before the last check, see read.
+	incoming->readerWaiting.store(1);
+	uint32_t expected = incoming->dataSignal.load();
+	if(readable() == 0 && !peer_closed()) {
+		futex_wait(incoming->dataSignal, expected, timeoutMs);
+	}
+	incoming->readerWaiting.store(0, std::memory_order_relaxed);
+}
+
+void SharedRing::wait_writable(int timeoutMs)
+{
+	for(int i = spin_iterations(); i > 0; i--) {
+		if(writable() > 0 || peer_closed()) {
+			return;
+		}
+		cpu_relax();
+	}
+
+	outgoing->writerWaiting.store(1);
+	uint32_t expected = outgoing->spaceSignal.load();
+	if(writable() == 0 && !peer_closed()) {
+		futex_wait(outgoing->spaceSignal, expected, timeoutMs);
+	}
+	outgoing->writerWaiting.store(0, std::memory_order_relaxed);
+}
+
+void SharedRing::interrupt()
+{
+	if(segment == nullptr) {
+		return;
+	}
+	notify(incoming->dataSignal);
+	notify(outgoing->spaceSignal);
+}
+
+void SharedRing::close()
+{
+	if(segment == nullptr) {
+		return;
+	}
+	SharedRingHeader* header = (SharedRingHeader*) segment;
+	header->closed[side].store(1);
+	notify(outgoing->dataSignal);
+	notify(incoming->spaceSignal);
+}
+
+bool SharedRing::peer_closed() const
+{
+	return ((SharedRingHeader*) segment)->closed[1 - side].load() != 0;
+}
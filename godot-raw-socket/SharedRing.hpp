@@ -0,0 +1,131 @@
+#ifndef SHARED_RING_H
+#define SHARED_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Shared memory transport for a client and a server on the same host.
+ * The client of a unix socket connection creates a memory segment with
+ * one ring of bytes per direction and passes it to the server over the
+ * socket. From then on the framed stream goes through the rings instead
+ * of the socket: as long as the reader keeps up, handing a message over
+ * is a copy into the ring and a copy out, without a system call. The
+ * socket stays connected only to tell when the peer is gone.
+ *
+ * Handing over the segment, on a connected unix stream socket:
+ *
+ *   client  sends the 8 bytes "GWSRING1" with the segment file descriptor
+ *           attached as SCM_RIGHTS
+ *   server  maps the segment, checks its header and answers 1 byte, 1
+ *
+ * The segment, all integers in host byte order:
+ *
+ *   0       8 bytes magic "GWSRING\0"
+ *   8       u32 version, SHARED_RING_VERSION
+ *   12      u32 size of each ring in bytes, a power of two
+ *   16      u32 set once the client closed, u32 the same for the server
+ *   64      control of the ring from client to server, see RingControl
+ *   320     control of the ring from server to client
+ *   4096    the bytes of the ring from client to server, then the ring
+ *           from server to client
+ *
+ * Each ring has a single writer and a single reader. written and read
+ * count the bytes that went through the ring since it was created, the
+ * bytes between them are unread, at offset written modulo the size. A
+ * reader finding the ring empty sets readerWaiting and sleeps on the
+ * futex dataSignal, which the writer increments and wakes after writing
+ * when it sees readerWaiting. A writer finding it full does the same with
+ * writerWaiting and spaceSignal. Waiting and waking is only needed once
+ * one side outpaces the other.
+ *
+ * Only available on Linux, it needs memfd and futexes.
+ */
+const uint32_t SHARED_RING_VERSION = 1;
+const size_t SHARED_RING_DATA_OFFSET = 4096;
+const size_t MIN_SHARED_RING_SIZE = 4096;
+const size_t MAX_SHARED_RING_SIZE = (size_t) 1 << 30;
+
+struct RingControl {
+	alignas(64) std::atomic<uint64_t> written;
+	alignas(64) std::atomic<uint64_t> read;
+	alignas(64) std::atomic<uint32_t> dataSignal;
+	std::atomic<uint32_t> readerWaiting;
+	alignas(64) std::atomic<uint32_t> spaceSignal;
+	std::atomic<uint32_t> writerWaiting;
+};
+
+struct SharedRingHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t ringSize;
+	std::atomic<uint32_t> closed[2];
+	alignas(64) RingControl rings[2];
+};
+
+class SharedRing {
+private:
+	char* segment = nullptr;
+	size_t segmentSize = 0;
+	size_t ringSize = 0;
+	// 0 for the client, 1 for the server, also the ring this side reads.
+	int side = 0;
+	RingControl* incoming = nullptr;
+	RingControl* outgoing = nullptr;
+	char* incomingBytes = nullptr;
+	char* outgoingBytes = nullptr;
+	// Staged bytes not yet visible to the reader.
+	size_t unpublished = 0;
+
+	int map(int segmentFd, size_t size, bool create);
+	void unmap();
+public:
+	SharedRing() {}
+	~SharedRing();
+
+	SharedRing(const SharedRing&) = delete;
+	SharedRing& operator=(const SharedRing&) = delete;
+
+	static bool supported();
+
+	/*
+	 * Client side: creates a segment with rings of size bytes, rounded up
+	 * to a power of two, and hands it to the server over the connected
+	 * socket. Server side: takes the segment the client hands over and
+	 * answers. Both block on the socket and return -1 with errno set on
+	 * failure.
+	 */
+	int create(int socketFd, size_t size);
+	int accept(int socketFd);
+	bool is_open() const { return segment != nullptr; }
+	size_t ring_size() const { return ringSize; }
+
+	// Copy as much as there is, or as fits, and return how much that
+	// was. Never block.
+	size_t read(char* destination, size_t maxBytes);
+	size_t write(const char* source, size_t numBytes);
+	// Writing in parts: stage copies without handing the bytes to the
+	// reader, commit hands over all staged bytes, so a message and its
+	// header wake the reader once.
+	size_t stage(const char* source, size_t numBytes);
+	void commit();
+	size_t readable() const;
+	size_t writable() const;
+
+	/*
+	 * Wait until there is something to read or room to write, the peer
+	 * closed, interrupt was called or timeoutMs passed. Spin for a moment
+	 * first, a peer in the middle of sending usually is not far behind.
+	 */
+	void wait_readable(int timeoutMs);
+	void wait_writable(int timeoutMs);
+	// Wakes the waits of this side.
+	void interrupt();
+
+	// Tells the peer this side is done and wakes its waits.
+	void close();
+	bool peer_closed() const;
+};
+
+#endif
@@ -34,6 +34,7 @@
 
 #include <GodotGlobal.hpp>
 #include <PoolArrays.hpp>
+#include <ProjectSettings.hpp>
 
 #include "Socket.hpp"
 
@@ -55,7 +56,9 @@
  * before the receive_message function.
  * set_header_size must provide a size of either 2 or 4 bytes.
  * When receiving the message, the first amount of bytes is expected 
- * to contain the size of the message in bytes.
+ * to contain the size of the message in bytes. Other framings, little
+ * endian and varint length headers or fixed size messages, are picked
+ * with set_message_framing and set_fixed_message_size.
  * set_message_buffer expects the user to provide a StreamPeerBuffer
  * which will be used to write the received packet.
 
@@ -66,15 +69,17 @@
  * In non blocking mode, the receive and receive_message will always
  * immediately, but might return that 0 bytes was received, then it is
  * up to the user to call the method until a message size, a value
- * larger than 0 is returned.
+ * larger than 0 is returned. Partly received messages are kept between
+ * calls, see poll.
+
+ * receive_message_data works like receive_message but returns the
+ * message as a PoolByteArray, without going through a StreamPeerBuffer.
+ * Either way the message is read from the socket directly into the
+ * memory that is handed to Godot.
 
  * Future improvements:
- * For every message a new buffer is created on the	heap by calling 
- * malloc. It would probably be more efficient by giving the option to 
- * set and use a constant buffer.
- * Also, a platform independent alternative of the plugin by using boost
+ * A platform independent alternative of the plugin by using boost
  * or maybe SDL would be a good idea.
- * Use varargs for debug_print method.
  */
 
 #define RECEIVE_FLAGS 0
@@ -107,31 +112,177 @@ bool verify_certificate(boost::asio::ssl::verify_context& ctx)
 void Socket::_register_methods()
 {
 	godot::register_method("_init", &Socket::_init);
+	godot::register_method("_process", &Socket::_process);
 
 	godot::register_method("connect_to_host", &Socket::connect_to_host);
+	godot::register_method("connect_to_host_async", &Socket::connect_to_host_async);
+	godot::register_method("set_connect_timeouts", &Socket::set_connect_timeouts);
 	godot::register_method("close", &Socket::close);
+	godot::register_method("reconnect", &Socket::reconnect);
+	godot::register_method("set_reconnect_backoff", &Socket::set_reconnect_backoff);
+	godot::register_method("is_session_resumed", &Socket::is_session_resumed);
+	godot::register_method("set_kernel_tls", &Socket::set_kernel_tls);
+	godot::register_method("get_tls_path", &Socket::get_tls_path);
+	godot::register_method("set_shared_memory_ring", &Socket::set_shared_memory_ring);
+	godot::register_method("get_transport", &Socket::get_transport);
 
 	godot::register_method("set_message_header_size", &Socket::set_message_header_size);
+	godot::register_method("set_message_framing", &Socket::set_message_framing);
+	godot::register_method("set_fixed_message_size", &Socket::set_fixed_message_size);
+	godot::register_method("set_message_delimiter", &Socket::set_message_delimiter);
+	godot::register_method("set_max_message_size", &Socket::set_max_message_size);
 	godot::register_method("set_message_buffer", &Socket::set_message_buffer);
 	godot::register_method("set_ssl", &Socket::set_ssl);
 	godot::register_method("set_blocking", &Socket::set_blocking);
 	godot::register_method("set_debug", &Socket::set_debug);
+	godot::register_method("set_trace_enabled", &Socket::set_trace_enabled);
+	godot::register_method("dump_trace", &Socket::dump_trace);
+	godot::register_method("get_last_error", &Socket::get_last_error);
+	godot::register_method("get_stats", &Socket::get_stats);
+	godot::register_method("reset_stats", &Socket::reset_stats);
 
 	godot::register_method("receive_message", &Socket::blocking_receive_message);
+	godot::register_method("receive_message_data", &Socket::receive_message_data);
+	godot::register_method("receive_messages", &Socket::receive_messages);
 	godot::register_method("receive", &Socket::blocking_receive);
+	godot::register_method("poll", &Socket::poll);
+	godot::register_method("set_read_ahead_size", &Socket::set_read_ahead_size);
+
+	godot::register_method("start_receive_thread", &Socket::start_receive_thread);
+	godot::register_method("take_messages", &Socket::take_messages);
+	godot::register_method("set_receive_queue_size", &Socket::set_receive_queue_size);
+	godot::register_method("set_emit_messages", &Socket::set_emit_messages);
+	godot::register_method("set_frame_pool_size", &Socket::set_frame_pool_size);
+
+	godot::register_method("register_layout", &Socket::register_layout);
+	godot::register_method("unregister_layout", &Socket::unregister_layout);
+	godot::register_method("decode_message", &Socket::decode_message);
+	godot::register_method("encode_message", &Socket::encode_message);
+	godot::register_method("send_layout", &Socket::send_layout);
+	godot::register_method("set_decode_messages", &Socket::set_decode_messages);
+	godot::register_method("take_decoded_messages", &Socket::take_decoded_messages);
+
+	godot::register_method("set_timestamps", &Socket::set_timestamps);
+	godot::register_method("get_message_timestamps", &Socket::get_message_timestamps);
+
+	godot::register_method("start_capture", &Socket::start_capture);
+	godot::register_method("stop_capture", &Socket::stop_capture);
+	godot::register_method("start_replay", &Socket::start_replay);
 
 	godot::register_method("send_message", &Socket::send_message);
+	godot::register_method("send_messages", &Socket::send_messages);
+	godot::register_method("flush", &Socket::flush);
+	godot::register_method("set_send_staging", &Socket::set_send_staging);
+	godot::register_method("start_send_thread", &Socket::start_send_thread);
+	godot::register_method("queue_message", &Socket::queue_message);
+	godot::register_method("get_send_queue_bytes", &Socket::get_send_queue_bytes);
+	godot::register_method("set_no_delay", &Socket::set_no_delay);
+	godot::register_method("set_compression", &Socket::set_compression);
+	godot::register_method("set_compression_dictionary", &Socket::set_compression_dictionary);
+	godot::register_method("is_compression_available", &Socket::is_compression_available);
+
+	godot::register_method("open_datagrams", &Socket::open_datagrams);
+	godot::register_method("close_datagrams", &Socket::close_datagrams);
+	godot::register_method("get_datagram_port", &Socket::get_datagram_port);
+	godot::register_method("set_max_datagram_size", &Socket::set_max_datagram_size);
+	godot::register_method("send_datagram", &Socket::send_datagram);
+	godot::register_method("flush_datagrams", &Socket::flush_datagrams);
+	godot::register_method("receive_datagrams", &Socket::receive_datagrams);
 	
 	godot::register_method("ntohs", &Socket::ntohs);
 	godot::register_method("htonl", &Socket::htonl);
 	
 	godot::register_property<Socket, bool>("debug", &Socket::debug, false);
+
+	godot::register_signal<Socket>("message_received", "message", GODOT_VARIANT_TYPE_POOL_BYTE_ARRAY);
+	godot::register_signal<Socket>("message_decoded", "fields", GODOT_VARIANT_TYPE_DICTIONARY);
+	godot::register_signal<Socket>("disconnected", godot::Dictionary());
+	godot::register_signal<Socket>("send_queue_drained", godot::Dictionary());
+	godot::register_signal<Socket>("connected", "timings", GODOT_VARIANT_TYPE_DICTIONARY);
+	godot::register_signal<Socket>("connect_failed", "timings", GODOT_VARIANT_TYPE_DICTIONARY);
 }
 
 void Socket::_init()
 {
 }
 
+/*
+ * Emits connected or connect_failed once a connect_to_host_async is done
+ * and does nothing else while it is not. Then flushes messages staged by
+ * send_message when set_send_staging is on, and datagrams staged by
+ * send_datagram, writes out capture records buffered for a second, emits
+ * send_queue_drained once the send queue has room again after refusing a
+ * message, then drains the frames the receive thread has queued since
+ * the last frame.
+ * Each one is emitted as message_received unless set_emit_messages(false)
+ * was called, in which case they stay queued for take_messages. With
+ * set_decode_messages(true), messages with a registered layout are
+ * emitted decoded as message_decoded instead. With set_timestamps(true)
+ * get_message_timestamps returns the stamps of the message being emitted.
+ */
+void Socket::_process(float delta)
+{
+	if(socketWrapper.is_connecting()) {
+		emit_connect_result();
+		// Nothing runs on the connection before it is done.
+		if(socketWrapper.is_connecting()) {
+			return;
+		}
+	}
+	if(stageSends) {
+		flush();
+	}
+	if(socketWrapper.staged_datagrams() > 0) {
+		flush_datagrams();
+	}
+	socketWrapper.flush_capture();
+
+	if(sendThreadStarted) {
+		if(sendBackpressure && socketWrapper.queued_send_bytes() <= socketWrapper.send_high_water_mark() / 2) {
+			sendBackpressure = false;
+			emit_signal("send_queue_drained");
+		}
+		if(!socketWrapper.is_send_thread_running()) {
+			sendThreadStarted = false;
+			debug_print("_process: Send thread stopped.");
+			if(!receiveThreadStarted) {
+				emit_signal("disconnected");
+			}
+		}
+	}
+
+	if(!receiveThreadStarted) {
+		return;
+	}
+
+	if(emitMessages) {
+		PooledFrame frame;
+		while(socketWrapper.pop_frame(frame)) {
+			deliveredTimestamps.clear();
+			stamp_delivery(frame.timestamps);
+			if(decodeMessages && !frame.empty() && layouts.has_layout((unsigned char) frame.data()[0])) {
+				emit_signal("message_decoded", to_fields(frame));
+			} else {
+				emit_signal("message_received", to_pool_byte_array(frame));
+			}
+		}
+	}
+
+	if(!socketWrapper.is_receive_thread_running() && socketWrapper.queued_frames() == 0) {
+		// get_last_error tells why in the disconnected handler.
+		socketWrapper.join_finished_receive_thread();
+		receiveThreadStarted = false;
+		debug_print("_process: Receive thread stopped.");
+		emit_signal("disconnected");
+	}
+}
+
+/*
+ * Connects to hostname and port over TCP, or with a hostname like
+ * "unix:/run/game.sock" to a server on the same host over an AF_UNIX
+ * socket, see set_shared_memory_ring. Returns 0 when connected, 1 on
+ * failure.
+ */
 int Socket::connect_to_host(godot::String hostname, int port)
 {
 	debug_print("Connecting to host...");
@@ -141,17 +292,177 @@ int Socket::connect_to_host(godot::String hostname, int port)
 		debug_print("Failed to connect.");
 	} else {
 		debug_print("Connected successfully.");
+		// connect stopped the threads of the previous connection.
+		receiveThreadStarted = false;
+		sendThreadStarted = false;
+		sendBackpressure = false;
+		pollDisconnected = false;
 	}
 
 	return error;
 }
 
+/*
+ * Connects without blocking the frame: resolving, connecting and the
+ * handshake run on a thread, and _process emits connected or
+ * connect_failed when they are done. Both pass the timings of the
+ * phases, see connect_timings. The addresses of a host are raced, an
+ * unreachable IPv6 address costs a quarter second instead of a connect
+ * timeout. Sending and receiving have to wait for connected.
+ * Returns 0 when the connect started, 1 on failure.
+ */
+int Socket::connect_to_host_async(godot::String hostname, int port)
+{
+	debug_print("Connecting to host in the background...");
+	if(socketWrapper.connect_async(hostname.ascii().get_data(), port) != 0) {
+		debug_print("Failed to start connecting.");
+		return 1;
+	}
+	// connect_async stopped the threads of the previous connection.
+	receiveThreadStarted = false;
+	sendThreadStarted = false;
+	sendBackpressure = false;
+	pollDisconnected = false;
+	return 0;
+}
+
+/*
+ * Limits of the resolve, connect and handshake of connect_to_host_async
+ * in milliseconds, 5000 each by default.
+ */
+void Socket::set_connect_timeouts(int resolveMs, int connectMs, int handshakeMs)
+{
+	if(resolveMs < 1 || connectMs < 1 || handshakeMs < 1) {
+		debug_print("set_connect_timeouts error: Timeouts must be at least 1 ms.");
+		return;
+	}
+	socketWrapper.connectTimeouts.resolveMs = resolveMs;
+	socketWrapper.connectTimeouts.connectMs = connectMs;
+	socketWrapper.connectTimeouts.handshakeMs = handshakeMs;
+}
+
+void Socket::emit_connect_result()
+{
+	ConnectReport report;
+	if(!socketWrapper.poll_connect(report)) {
+		return;
+	}
+	if(report.result == 0) {
+		debug_printf("Connected to %s in %d usec.", report.address.c_str(), (int) report.totalUsec);
+		// A reconnect started the threads that ran on the old connection.
+		receiveThreadStarted = socketWrapper.is_receive_thread_running();
+		sendThreadStarted = socketWrapper.is_send_thread_running();
+		pollDisconnected = false;
+		emit_signal("connected", connect_timings(report));
+	} else {
+		debug_printf("Failed to connect in phase %s: %s", report.phase, report.error.message().c_str());
+		emit_signal("connect_failed", connect_timings(report));
+	}
+}
+
+/*
+ * The phase that failed or ran last, the error message, empty when
+ * connected, the address that answered, how many addresses were tried,
+ * the microseconds each phase and the whole connect took, and for ssl the
+ * tls path and whether the session was resumed.
+ */
+godot::Dictionary Socket::connect_timings(const ConnectReport& report)
+{
+	godot::Dictionary result;
+	result["phase"] = godot::String(report.phase);
+	result["error"] = godot::String(report.error ? report.error.message().c_str() : "");
+	result["address"] = godot::String(report.address.c_str());
+	result["attempts"] = report.attempts;
+	result["resolve_usec"] = (int64_t) report.resolveUsec;
+	result["connect_usec"] = (int64_t) report.connectUsec;
+	result["handshake_usec"] = (int64_t) report.handshakeUsec;
+	result["total_usec"] = (int64_t) report.totalUsec;
+	result["tls_path"] = get_tls_path();
+	result["session_resumed"] = socketWrapper.session_resumed();
+	return result;
+}
+
 void Socket::close()
 {
-	::free(byte_buffer);
 	socketWrapper.close();
 }
 
+/*
+ * Connects again to the host of the last connect, resuming the TLS
+ * session when ssl is on. Like connect_to_host_async the attempts run in
+ * the background, as does the backoff between failed ones, see
+ * set_reconnect_backoff, and _process emits connected or connect_failed
+ * when they are done. Receive and send threads that ran before are
+ * started again on the new connection, whole messages still queued for
+ * sending go out on it. Returns 0 when the reconnect started, 1 on
+ * failure.
+ */
+int Socket::reconnect(int maxAttempts)
+{
+	debug_print("Reconnecting in the background...");
+	if(socketWrapper.reconnect_async(maxAttempts < 1 ? 1 : maxAttempts) != 0) {
+		debug_print("Failed to start reconnecting.");
+		return 1;
+	}
+	// The threads are stopped until the new connection starts them again.
+	receiveThreadStarted = false;
+	sendThreadStarted = false;
+	sendBackpressure = false;
+	return 0;
+}
+
+void Socket::set_reconnect_backoff(int initialMs, int maxMs)
+{
+	if(initialMs < 1 || maxMs < initialMs) {
+		debug_print("set_reconnect_backoff error: Delays must be at least 1 ms and max not below initial.");
+		return;
+	}
+	socketWrapper.reconnectDelayMs = initialMs;
+	socketWrapper.maxReconnectDelayMs = maxMs;
+}
+
+bool Socket::is_session_resumed()
+{
+	return socketWrapper.session_resumed();
+}
+
+/*
+ * Asks for kernel tls on the next ssl connect. get_tls_path then tells
+ * what the connection got: "kernel", "kernel_send" when only sending is
+ * offloaded, "userspace" when the kernel can not take the keys, "stream"
+ * without kernel tls and "none" without ssl.
+ */
+void Socket::set_kernel_tls(bool trueOrFalse)
+{
+	socketWrapper.kernelTls = trueOrFalse;
+}
+
+godot::String Socket::get_tls_path()
+{
+	return godot::String(tls_path_name(socketWrapper.tls_path()));
+}
+
+/*
+ * With a size in bytes, connects to unix: addresses hand messages through
+ * a ring of shared memory of that size each way instead of the socket,
+ * which needs a server that accepts the ring, see SharedRing.hpp. 0, the
+ * default, turns it off. Only on Linux and without ssl.
+ */
+void Socket::set_shared_memory_ring(int size)
+{
+	if(size < 0) {
+		debug_print("set_shared_memory_ring error: Size can not be negative.");
+		return;
+	}
+	socketWrapper.sharedRingSize = (size_t) size;
+}
+
+// "tcp", "unix" or "shared_memory".
+godot::String Socket::get_transport()
+{
+	return godot::String(socketWrapper.transport());
+}
+
 void Socket::set_ssl(bool trueOrFalse)
 {
 	socketWrapper.sslEnabled = trueOrFalse;
@@ -162,24 +473,240 @@ void Socket::set_blocking(bool trueOrFalse)
 	socketWrapper.blocking = trueOrFalse;
 }
 
+void Socket::set_receive_queue_size(int size)
+{
+	if(size < 1) {
+		debug_print("set_receive_queue_size error: Size must be at least 1.");
+		return;
+	}
+	receiveQueueSize = size;
+}
+
+void Socket::set_emit_messages(bool trueOrFalse)
+{
+	emitMessages = trueOrFalse;
+}
+
+/*
+ * Caps how many bytes of recycled message buffers the receive thread
+ * keeps around, 0 disables pooling. Defaults to 4 MiB.
+ */
+void Socket::set_frame_pool_size(int maxBytes)
+{
+	if(maxBytes < 0) {
+		debug_print("set_frame_pool_size error: Size must not be negative.");
+		return;
+	}
+	socketWrapper.set_frame_pool_size(maxBytes);
+}
+
 void Socket::set_debug(bool trueOrFalse)
 {
 	debug = trueOrFalse;
 }
 
+/*
+ * Turns on recording of io events into a ring of the given number of
+ * entries, read back with dump_trace. Only available in builds with
+ * SOCKET_TRACE defined (debug builds or scons trace=yes), otherwise the
+ * events are compiled out and dump_trace stays empty. The ring keeps the
+ * size it was first given while a thread of the connection runs,
+ * another capacity applies once they are stopped.
+ */
+void Socket::set_trace_enabled(bool trueOrFalse, int capacity)
+{
+#ifndef SOCKET_TRACE
+	debug_print("set_trace_enabled: Tracing is not compiled into this build.");
+#endif
+	if(trueOrFalse) {
+		if(socketWrapper.enable_trace(capacity > 0 ? capacity : 4096) == -1) {
+			debug_print("set_trace_enabled: Threads are running, the trace keeps its capacity.");
+		}
+	} else {
+		socketWrapper.trace.disable();
+	}
+}
+
+/*
+ * Returns the recorded events, oldest first, as an Array of Dictionary
+ * with "time_usec", "event", "a" and "b". The meaning of a and b depends
+ * on the event, for reads and writes a is the number of bytes.
+ */
+godot::Array Socket::dump_trace()
+{
+	std::vector<TraceRecord> records;
+	socketWrapper.trace.dump(records);
+
+	godot::Array result;
+	for(const TraceRecord& record : records) {
+		godot::Dictionary entry;
+		entry["time_usec"] = (int64_t) (record.timestamp / 1000);
+		entry["event"] = godot::String(trace_event_name(record.event));
+		entry["a"] = record.a;
+		entry["b"] = record.b;
+		result.append(entry);
+	}
+	return result;
+}
+
+godot::Dictionary histogram_to_dictionary(const Histogram& histogram)
+{
+	godot::Dictionary result;
+	result["count"] = (int64_t) histogram.count();
+	result["mean"] = histogram.mean();
+	result["max"] = (int64_t) histogram.max();
+	result["p50"] = (int64_t) histogram.percentile(0.5);
+	result["p90"] = (int64_t) histogram.percentile(0.9);
+	result["p99"] = (int64_t) histogram.percentile(0.99);
+	result["p999"] = (int64_t) histogram.percentile(0.999);
+	return result;
+}
+
+/*
+ * Returns the connection counters as a Dictionary. Counters are totals
+ * since the Socket was created or reset_stats was called. Histograms are
+ * Dictionaries with "count", "mean", "max", "p50", "p90", "p99" and
+ * "p999", sizes are in bytes and durations in microseconds.
+ */
+godot::Dictionary Socket::get_stats()
+{
+	const SocketStats& stats = socketWrapper.stats;
+	godot::Dictionary result;
+
+	result["bytes_in"] = (int64_t) stats.bytesIn.load();
+	result["bytes_out"] = (int64_t) stats.bytesOut.load();
+	result["messages_in"] = (int64_t) stats.messagesIn.load();
+	result["messages_out"] = (int64_t) stats.messagesOut.load();
+	result["read_calls"] = (int64_t) stats.readCalls.load();
+	result["write_calls"] = (int64_t) stats.writeCalls.load();
+	result["tls_records_in"] = (int64_t) stats.tlsRecordsIn.load();
+	result["tls_records_out"] = (int64_t) stats.tlsRecordsOut.load();
+	result["reconnects"] = (int64_t) stats.reconnects.load();
+	result["resumed_sessions"] = (int64_t) stats.resumedSessions.load();
+	result["datagrams_in"] = (int64_t) stats.datagramsIn.load();
+	result["datagrams_out"] = (int64_t) stats.datagramsOut.load();
+	result["stale_datagrams"] = (int64_t) stats.staleDatagrams.load();
+	result["dropped_datagrams"] = (int64_t) stats.droppedDatagrams.load();
+	result["datagram_receive_calls"] = (int64_t) stats.datagramReceiveCalls.load();
+	result["datagram_send_calls"] = (int64_t) stats.datagramSendCalls.load();
+	result["compressed_messages_out"] = (int64_t) stats.compressedMessagesOut.load();
+	result["compressed_messages_in"] = (int64_t) stats.compressedMessagesIn.load();
+	result["compression_ratio_out"] = stats.compressedBytesOut.load() ?
+		(double) stats.uncompressedBytesOut.load() / stats.compressedBytesOut.load() : 1.0;
+	result["compression_ratio_in"] = stats.compressedBytesIn.load() ?
+		(double) stats.uncompressedBytesIn.load() / stats.compressedBytesIn.load() : 1.0;
+
+	result["refused_messages"] = (int64_t) stats.refusedMessages.load();
+	result["send_queue_bytes"] = (int64_t) stats.sendQueueBytes.load();
+
+	result["read_ahead_bytes"] = (int64_t) socketWrapper.buffered_bytes();
+	result["staged_bytes"] = (int64_t) socketWrapper.staged_bytes();
+	result["receive_queue_depth"] = (int64_t) socketWrapper.queued_frames();
+	result["frame_pool_bytes"] = (int64_t) socketWrapper.frame_pool().cached_bytes();
+	result["frame_pool_allocations"] = (int64_t) socketWrapper.frame_pool().heap_allocations();
+	result["frame_pool_reuses"] = (int64_t) socketWrapper.frame_pool().reused();
+
+	result["message_size_in"] = histogram_to_dictionary(stats.messageSizeIn);
+	result["message_size_out"] = histogram_to_dictionary(stats.messageSizeOut);
+	result["receive_blocked_usec"] = histogram_to_dictionary(stats.receiveBlockedUsec);
+	result["send_blocked_usec"] = histogram_to_dictionary(stats.sendBlockedUsec);
+	result["connect_usec"] = histogram_to_dictionary(stats.connectUsec);
+	result["handshake_usec"] = histogram_to_dictionary(stats.handshakeUsec);
+	result["reconnect_usec"] = histogram_to_dictionary(stats.reconnectUsec);
+	result["compress_nsec"] = histogram_to_dictionary(stats.compressNsec);
+	result["decompress_nsec"] = histogram_to_dictionary(stats.decompressNsec);
+	result["kernel_to_read_usec"] = histogram_to_dictionary(stats.kernelToReadUsec);
+	result["read_to_decode_usec"] = histogram_to_dictionary(stats.readToDecodeUsec);
+	result["decode_to_deliver_usec"] = histogram_to_dictionary(stats.decodeToDeliverUsec);
+	result["kernel_to_deliver_usec"] = histogram_to_dictionary(stats.kernelToDeliverUsec);
+	result["input_queue_usec"] = histogram_to_dictionary(stats.inputQueueUsec);
+	result["gameplay_queue_usec"] = histogram_to_dictionary(stats.gameplayQueueUsec);
+	result["bulk_queue_usec"] = histogram_to_dictionary(stats.bulkQueueUsec);
+	return result;
+}
+
+void Socket::reset_stats()
+{
+	socketWrapper.stats.reset();
+}
+
+godot::String Socket::get_last_error()
+{
+	return godot::String(socketWrapper.lastError.message().c_str());
+}
+
 void Socket::set_message_header_size(int size)
 {
 	if (!(size == 2 || size == 4)) {
 		debug_print("RawSocket.set_header error: Size must be 2 or 4 bytes.\n");
 		return;
 	}
-	headerSize = size;
+	socketWrapper.set_framing(size == 2 ? FrameFormat::U16BE : FrameFormat::U32BE);
+	framed = true;
+}
+
+/*
+ * Selects how messages are framed, one of:
+ *   "u16" or "u16be", "u16le": 2 byte length header,
+ *   "u32" or "u32be", "u32le": 4 byte length header,
+ *   "varint": LEB128 length header of 1 to 5 bytes.
+ * Messages without any header but with a fixed size are selected with
+ * set_fixed_message_size, messages ending with a delimiter with
+ * set_message_delimiter instead.
+ */
+void Socket::set_message_framing(godot::String format)
+{
+	FrameFormat frameFormat;
+	if(!parse_frame_format(format.ascii().get_data(), frameFormat)) {
+		debug_print("set_message_framing error: Unknown format, expected u16, u16le, u32, u32le or varint.");
+		return;
+	}
+	socketWrapper.set_framing(frameFormat);
+	framed = true;
+}
+
+void Socket::set_fixed_message_size(int size)
+{
+	if(size < 1) {
+		debug_print("set_fixed_message_size error: Size must be at least 1 byte.");
+		return;
+	}
+	socketWrapper.set_framing(FrameFormat::Fixed, size);
+	framed = true;
+}
+
+/*
+ * Frames messages by a delimiter of 1 to 8 bytes, such as "\n".to_utf8()
+ * for line based text protocols or a NUL byte for binary ones. Received
+ * messages leave the delimiter out and sent messages get it appended,
+ * messages holding it are not sent. set_max_message_size limits how long
+ * a line may get.
+ */
+void Socket::set_message_delimiter(godot::PoolByteArray delimiter)
+{
+	if(delimiter.size() < 1 || delimiter.size() > (int) MAX_FRAME_DELIMITER_SIZE) {
+		debug_printf("set_message_delimiter error: Delimiter must be 1 to %i bytes.", (int) MAX_FRAME_DELIMITER_SIZE);
+		return;
+	}
+	godot::PoolByteArray::Read read = delimiter.read();
+	socketWrapper.set_delimiter((const char*) read.ptr(), (size_t) delimiter.size());
+	framed = true;
+}
+
+// Upper limit for received message sizes, larger headers are treated as
+// a protocol error instead of allocating whatever the header claims.
+void Socket::set_max_message_size(int size)
+{
+	if(size < 1) {
+		debug_print("set_max_message_size error: Size must be at least 1 byte.");
+		return;
+	}
+	socketWrapper.set_max_message_size(size);
 }
 
 void Socket::set_message_buffer(godot::Ref<godot::StreamPeerBuffer> messageBufferRef)
 {
 	messageBuffer = messageBufferRef.ptr();
-	byte_buffer = (char*) malloc(messageBuffer->get_size());
 }
 
 void Socket::debug_print(const char* output)
@@ -188,69 +715,801 @@ void Socket::debug_print(const char* output)
 	godot::Godot::print(output);
 }
 
-int Socket::blocking_receive_message()
+// Formats only when debug output is on, so the message paths do not pay
+// for building strings nobody reads.
+void Socket::debug_printf(const char* format, ...)
 {
-	debug_print("blocking_receive_message: Waiting for header...");
+	if (!debug) return;
+	char debug_msg[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(debug_msg, sizeof(debug_msg), format, args);
+	va_end(args);
+	godot::Godot::print(debug_msg);
+}
+
+/*
+ * Reads one header framed message straight into data, which is sized to
+ * the message and written through a single lock of its memory.
+ */
+int Socket::receive_frame(godot::PoolByteArray& data)
+{
+	debug_print("receive_frame: Waiting for header...");
 	
-	unsigned short rawHeader = 0;
-	while(rawHeader == 0) {
-		int result = socketWrapper.receive_ushort(rawHeader);
+	size_t messageSize = 0;
+	while(messageSize == 0) {
+		int result = socketWrapper.receive_header(messageSize);
 		if(result == -1) {
-			char debug_msg[128];
-			sprintf(debug_msg, "blocking_receive_message: Warning, received header size %i.", rawHeader);
-			debug_print(debug_msg);
+			debug_print("receive_frame: Error receiving header!");
 			return -1;
 		}
 	}
 	
-	int messageSize = ntohs(rawHeader);
-	char debug_msg[128];
-	sprintf(debug_msg, "blocking_receive_message: Header with size %i received, waiting for message...", messageSize);
-	debug_print(debug_msg);
-	int result = blocking_receive(messageSize);
-
-	sprintf(debug_msg, "blocking_receive_message: Message received, returning %i.", result);
-	debug_print(debug_msg);
+	debug_printf("receive_frame: Header with size %i received, waiting for message...", (int) messageSize);
+	deliveredTimestamps.clear();
+	if(!socketWrapper.compression_enabled()) {
+		int result = receive_into(data, (int) messageSize);
+		if(result != -1) {
+			socketWrapper.capture_frame(CaptureKind::StreamIn, (const char*) data.read().ptr(), messageSize);
+			stamp_delivery(socketWrapper.frame_timestamps());
+		}
+		return result;
+	}
+
+	// Compressed bodies are read aside and decompressed into data.
+	receivedBody.resize(messageSize);
+	if(socketWrapper.receive_bytes((int) messageSize, receivedBody.data()) == -1) {
+		debug_print("receive_frame: Error receiving message!");
+		return -1;
+	}
+	int result = decode_into(data, receivedBody.data(), messageSize);
+	if(result != -1) {
+		stamp_delivery(socketWrapper.frame_timestamps());
+	}
+	return result;
+}
+
+/*
+ * Sizes data to the message in a received body and writes it there,
+ * decompressing when the connection uses compression.
+ * Returns the message size or -1 for a corrupt body.
+ */
+int Socket::decode_into(godot::PoolByteArray& data, const char* body, size_t size)
+{
+	int64_t messageSize = socketWrapper.decoded_size(body, size);
+	if(messageSize == -1) {
+		debug_print("decode_into: Corrupt message!");
+		return -1;
+	}
+	data.resize((int) messageSize);
+	if(socketWrapper.decode_frame(body, size, (char*) data.write().ptr(), (size_t) messageSize) == -1) {
+		debug_print("decode_into: Corrupt message!");
+		return -1;
+	}
+	return (int) messageSize;
+}
+
+int Socket::receive_into(godot::PoolByteArray& data, int numBytes)
+{
+	data.resize(numBytes);
+	godot::PoolByteArray::Write write = data.write();
+	int result = socketWrapper.receive_bytes(numBytes, (char*) write.ptr());
+
+	if(result == -1) {
+		debug_print("receive_into: Error receiving message!");
+	}
 	return result;
 }
 
+/*
+ * Copies the next complete message into data without waiting, returns
+ * the message size, 0 when no message is complete yet or -1 on error.
+ */
+int Socket::poll_frame(godot::PoolByteArray& data)
+{
+	FrameSpan frame;
+	int result = socketWrapper.poll(frame);
+	if(result == -1) {
+		debug_print("poll_frame: Error receiving message!");
+		// Refused until a connect_to_host_async is done, not disconnected.
+		if(!socketWrapper.is_connecting()) {
+			emit_poll_disconnected();
+		}
+		return -1;
+	}
+	if(result == 0) {
+		return 0;
+	}
+
+	result = decode_into(data, socketWrapper.frame_data(frame), frame.size);
+	socketWrapper.release_frames();
+	if(result == -1) {
+		emit_poll_disconnected();
+		return -1;
+	}
+	deliveredTimestamps.clear();
+	stamp_delivery(socketWrapper.frame_timestamps());
+	return result;
+}
+
+// A game polling every frame would otherwise get disconnected each time.
+void Socket::emit_poll_disconnected()
+{
+	if(!pollDisconnected) {
+		pollDisconnected = true;
+		emit_signal("disconnected");
+	}
+}
+
+int Socket::blocking_receive_message()
+{
+	godot::PoolByteArray data;
+	int result = socketWrapper.blocking ? receive_frame(data) : poll_frame(data);
+	if(result == 0) {
+		return 0;
+	}
+
+	if(result != -1) {
+		fill_message_buffer(data);
+	}
+
+	debug_printf("blocking_receive_message: Message received, returning %i.", result);
+	return result;
+}
+
+/*
+ * Same as receive_message but hands back the message itself, skipping
+ * the StreamPeerBuffer. Returns an empty array on failure.
+ */
+godot::PoolByteArray Socket::receive_message_data()
+{
+	godot::PoolByteArray data;
+	int result = socketWrapper.blocking ? receive_frame(data) : poll_frame(data);
+	if(result < 1) {
+		data.resize(0);
+	}
+	return data;
+}
+
+/*
+ * Never blocks, whatever set_blocking says. Reads what has arrived and
+ * returns the next complete message, or an empty array when there is
+ * none yet. Meant to be called from _process until it returns an empty
+ * array, for games that can not use threads. A failed connection emits
+ * disconnected.
+ */
+godot::PoolByteArray Socket::poll()
+{
+	godot::PoolByteArray data;
+	if(receiveThreadStarted) {
+		debug_print("poll error: The receive thread is running.");
+		return data;
+	}
+	if(poll_frame(data) < 1) {
+		data.resize(0);
+	}
+	return data;
+}
+
+/*
+ * Blocks until at least one message is available, then returns every
+ * complete message already received, up to maxCount, in one call.
+ * The bodies are packed back to back into a single PoolByteArray:
+ *   "data": PoolByteArray with all message bodies,
+ *   "offsets": PoolIntArray with count + 1 entries, message i spans
+ *              offsets[i] until offsets[i + 1] in data,
+ *   "count": number of messages, or -1 if receiving failed.
+ * In non blocking mode the count is 0 instead of waiting.
+ */
+godot::Dictionary Socket::receive_messages(int maxCount)
+{
+	godot::Dictionary result;
+	godot::PoolByteArray data;
+	godot::PoolIntArray offsets;
+
+	if(maxCount < 1 || receiveThreadStarted) {
+		debug_print("receive_messages error: max_count must be at least 1 and the receive thread not running.");
+		result["count"] = -1;
+		return result;
+	}
+
+	std::vector<FrameSpan>& frames = receivedFrames;
+	int count = socketWrapper.receive_frames(frames, maxCount);
+
+	if(count > 0) {
+		// Message sizes are only the frame sizes when compression is off,
+		// so the offsets are worked out before anything is decoded.
+		offsets.resize(count + 1);
+		godot::PoolIntArray::Write offsetsWrite = offsets.write();
+		size_t totalSize = 0;
+		for(int i = 0; i < count; i++) {
+			int64_t messageSize = socketWrapper.decoded_size(socketWrapper.frame_data(frames[i]), frames[i].size);
+			if(messageSize == -1) {
+				count = -1;
+				break;
+			}
+			offsetsWrite[i] = (int) totalSize;
+			totalSize += (size_t) messageSize;
+		}
+
+		if(count > 0) {
+			offsetsWrite[count] = (int) totalSize;
+			data.resize((int) totalSize);
+			godot::PoolByteArray::Write dataWrite = data.write();
+			for(int i = 0; i < count; i++) {
+				size_t offset = offsetsWrite[i];
+				if(socketWrapper.decode_frame(socketWrapper.frame_data(frames[i]), frames[i].size,
+					(char*) dataWrite.ptr() + offset, offsetsWrite[i + 1] - offset) == -1) {
+					count = -1;
+					break;
+				}
+			}
+		}
+		socketWrapper.release_frames();
+	}
+	deliveredTimestamps.clear();
+	for(int i = 0; i < count; i++) {
+		stamp_delivery(socketWrapper.frame_timestamps());
+	}
+	if(count == -1) {
+		debug_print("receive_messages: Error receiving messages!");
+		data.resize(0);
+		offsets.resize(0);
+	}
+
+	result["data"] = data;
+	result["offsets"] = offsets;
+	result["count"] = count;
+	return result;
+}
+
+void Socket::set_read_ahead_size(int size)
+{
+	if(size < 16) {
+		debug_print("set_read_ahead_size error: Size must be at least 16 bytes.");
+		return;
+	}
+	socketWrapper.set_read_ahead_size(size);
+}
+
 int Socket::blocking_receive(int numBytes)
 {
-	int result = socketWrapper.receive_bytes(numBytes, byte_buffer);
+	godot::PoolByteArray data;
+	int result = 0;
+	if(socketWrapper.blocking) {
+		result = receive_into(data, numBytes);
+	} else {
+		data.resize(numBytes);
+		result = socketWrapper.poll_bytes(numBytes, (char*) data.write().ptr());
+	}
 	
-	if(result != -1)
+	if(result > 0)
 	{
-		fill_message_buffer(byte_buffer, numBytes);
-		char debug_msg[128];
-		sprintf(debug_msg, "blocking_receive: Filled godot message buffer with %i bytes.", numBytes);
-		debug_print(debug_msg);
-	} else {
-		debug_print("blocking_receive: Error receiving message!");
+		fill_message_buffer(data);
+		debug_printf("blocking_receive: Filled godot message buffer with %i bytes.", numBytes);
+	}
+
+	return result;
+}
+
+/*
+ * Starts a native thread reading 2 byte header framed messages into a
+ * bounded queue, replacing the GDScript Thread spinning on
+ * receive_message. Messages are then delivered once per frame from
+ * _process, or fetched in one batch with take_messages.
+ */
+int Socket::start_receive_thread()
+{
+	if(receiveThreadStarted) {
+		debug_print("start_receive_thread: Already running.");
+		return 1;
 	}
 
+	int result = socketWrapper.start_receive_thread(receiveQueueSize);
+	receiveThreadStarted = (result == 0);
 	return result;
 }
 
+godot::Array Socket::take_messages()
+{
+	godot::Array messages;
+	PooledFrame frame;
+	deliveredTimestamps.clear();
+	while(socketWrapper.pop_frame(frame)) {
+		stamp_delivery(frame.timestamps);
+		messages.append(to_pool_byte_array(frame));
+	}
+	return messages;
+}
+
+/*
+ * Registers the layout of messages starting with opcode, see
+ * MessageLayout.hpp for the spec. Replaces an earlier layout of the
+ * opcode. Returns 0 on success, 1 if the spec can not be parsed.
+ */
+int Socket::register_layout(int opcode, godot::String spec)
+{
+	std::string error;
+	if(!layouts.register_layout(opcode, spec.utf8().get_data(), error)) {
+		debug_printf("register_layout error: %s", error.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+void Socket::unregister_layout(int opcode)
+{
+	layouts.unregister_layout(opcode);
+}
+
+/*
+ * Decodes a message by the layout of its opcode into a Dictionary of
+ * its fields plus "opcode". Returns an empty Dictionary for opcodes
+ * without a layout and messages that do not match their layout.
+ */
+godot::Dictionary Socket::decode_message(godot::PoolByteArray message)
+{
+	godot::Dictionary fields;
+	godot::PoolByteArray::Read read = message.read();
+	if(!layouts.decode((const char*) read.ptr(), message.size(), fields)) {
+		debug_print("decode_message: Unknown opcode or message does not match its layout.");
+		return godot::Dictionary();
+	}
+	return fields;
+}
+
+// Returns the encoded message, or an empty array if it could not be encoded.
+godot::PoolByteArray Socket::encode_message(int opcode, godot::Dictionary fields)
+{
+	godot::PoolByteArray data;
+	encodedMessage.clear();
+	if(!layouts.encode(opcode, fields, encodedMessage)) {
+		debug_print("encode_message: Unknown opcode or a value too long for its field.");
+		return data;
+	}
+	data.resize((int) encodedMessage.size());
+	memcpy(data.write().ptr(), encodedMessage.data(), encodedMessage.size());
+	return data;
+}
+
+// Encodes and sends like send_message, without a PoolByteArray in between.
+int Socket::send_layout(int opcode, godot::Dictionary fields)
+{
+	encodedMessage.clear();
+	if(!layouts.encode(opcode, fields, encodedMessage)) {
+		debug_print("send_layout: Unknown opcode or a value too long for its field.");
+		return -1;
+	}
+	return send_encoded(encodedMessage.data(), (int) encodedMessage.size());
+}
+
+void Socket::set_decode_messages(bool trueOrFalse)
+{
+	decodeMessages = trueOrFalse;
+}
+
+/*
+ * Like take_messages, but every message is decoded natively straight
+ * from the receive thread's buffer. Messages without a layout, or that
+ * do not match it, come as a Dictionary with "opcode" and "data".
+ */
+godot::Array Socket::take_decoded_messages()
+{
+	godot::Array messages;
+	PooledFrame frame;
+	deliveredTimestamps.clear();
+	while(socketWrapper.pop_frame(frame)) {
+		stamp_delivery(frame.timestamps);
+		messages.append(to_fields(frame));
+	}
+	return messages;
+}
+
+/*
+ * Stamps every received message with the time the kernel received it
+ * (Linux only, 0 elsewhere), the time it was read and decrypted, the
+ * time it was cut out of the stream and the time it was handed to the
+ * script. The time between stages goes into the latency histograms of
+ * get_stats, to tell network delay from time spent queued in the plugin.
+ * Must be called before start_receive_thread.
+ */
+void Socket::set_timestamps(bool trueOrFalse)
+{
+	if(socketWrapper.set_timestamps(trueOrFalse) == -1) {
+		debug_print("set_timestamps error: The receive thread is running.");
+		return;
+	}
+	if(trueOrFalse && !SocketWrapper::kernel_timestamps_supported()) {
+		debug_print("set_timestamps: Kernel timestamps are not available on this platform.");
+	}
+	deliveredTimestamps.clear();
+}
+
+/*
+ * Returns the timestamps of the messages handed over by the last
+ * receive_message, receive_messages, poll, take_messages or
+ * take_decoded_messages call, or of the message being emitted inside a
+ * message_received handler. One Dictionary per message, in order, with
+ * "kernel_usec", "read_usec", "decoded_usec" and "delivered_usec" in
+ * microseconds since the Unix epoch, 0 for stages not stamped.
+ */
+godot::Array Socket::get_message_timestamps()
+{
+	godot::Array result;
+	for(const FrameTimestamps& stamps : deliveredTimestamps) {
+		godot::Dictionary entry;
+		entry["kernel_usec"] = (int64_t) stamps.kernelUsec;
+		entry["read_usec"] = (int64_t) stamps.readUsec;
+		entry["decoded_usec"] = (int64_t) stamps.decodedUsec;
+		entry["delivered_usec"] = (int64_t) stamps.deliveredUsec;
+		result.append(entry);
+	}
+	return result;
+}
+
+/*
+ * Records every message sent and received from now on into the file at
+ * path, which may be a user:// or res:// path, replacing what was there.
+ * Messages are recorded as the game sees them, decompressed and without
+ * frame headers, with the time and whether they were sent or received,
+ * over the stream or as datagrams. Returns 0 on success, 1 if the file
+ * can not be created.
+ */
+int Socket::start_capture(godot::String path)
+{
+	godot::String filePath = godot::ProjectSettings::get_singleton()->globalize_path(path);
+	if(socketWrapper.start_capture(filePath.utf8().get_data()) != 0) {
+		debug_printf("start_capture error: Can not create %s.", filePath.utf8().get_data());
+		return 1;
+	}
+	return 0;
+}
+
+void Socket::stop_capture()
+{
+	socketWrapper.stop_capture();
+}
+
+/*
+ * Plays back the messages received over the stream in a capture file
+ * instead of connecting, delivered like the receive thread delivers them:
+ * as message_received or message_decoded from _process, or through
+ * take_messages. Paced replays keep the time between messages of the
+ * capture, otherwise messages come as fast as they are taken, to measure
+ * how quickly the game handles a recorded match. disconnected is emitted
+ * at the end of the file. Returns 0 when the replay started, 1 if the
+ * file is not a capture or the receive thread is running.
+ */
+int Socket::start_replay(godot::String path, bool paced)
+{
+	if(receiveThreadStarted) {
+		debug_print("start_replay error: The receive thread is running.");
+		return 1;
+	}
+	godot::String filePath = godot::ProjectSettings::get_singleton()->globalize_path(path);
+	if(socketWrapper.start_replay(filePath.utf8().get_data(), paced, receiveQueueSize) != 0) {
+		debug_printf("start_replay error: Can not read %s as a capture.", filePath.utf8().get_data());
+		return 1;
+	}
+	receiveThreadStarted = true;
+	return 0;
+}
+
+void Socket::stamp_delivery(FrameTimestamps stamps)
+{
+	if(!socketWrapper.timestamps_enabled()) {
+		return;
+	}
+	socketWrapper.record_delivery(stamps);
+	deliveredTimestamps.push_back(stamps);
+}
+
+godot::Dictionary Socket::to_fields(PooledFrame& frame)
+{
+	godot::Dictionary fields;
+	if(!layouts.decode(frame.data(), frame.size(), fields)) {
+		fields = godot::Dictionary();
+		fields["opcode"] = frame.empty() ? -1 : (int) (unsigned char) frame.data()[0];
+		fields["data"] = to_pool_byte_array(frame);
+	}
+	frame.reset();
+	return fields;
+}
+
+/*
+ * Sends the header and the message in a single write. With send staging
+ * on, the message is only appended to the outbound buffer which is
+ * written once per frame from _process, or by calling flush.
+ * Returns 1 on success and -1 on failure.
+ */
 int Socket::send_message(godot::PoolByteArray sendBuffer)
 {
-	int numBytes = sendBuffer.size();
-	if(headerSize == 2 || headerSize == 4) {
-		unsigned short header = numBytes;
-		socketWrapper.send_ushort(numBytes);
+	godot::PoolByteArray::Read read = sendBuffer.read();
+	return send_encoded((const char*) read.ptr(), sendBuffer.size());
+}
+
+int Socket::send_encoded(const char* bytes, int numBytes)
+{
+	if(sendThreadStarted) {
+		return queue_encoded(bytes, numBytes, SendLane::Gameplay);
+	}
+	if(stageSends) {
+		return socketWrapper.stage_frame(bytes, numBytes, framed) == -1 ? -1 : 1;
+	}
+
+	if(socketWrapper.send_frame(bytes, numBytes, framed) == -1) {
+		debug_print("send_message: Error sending message!");
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Sends every PoolByteArray in messages, each with its own header, in a
+ * single write. Returns the number of messages sent or -1 on failure.
+ * With the send thread running, it returns how many were queued before
+ * the queue refused one.
+ */
+int Socket::send_messages(godot::Array messages)
+{
+	std::vector<godot::PoolByteArray> arrays;
+	std::vector<godot::PoolByteArray::Read> reads;
+	std::vector<boost::asio::const_buffer> buffers;
+	arrays.reserve(messages.size());
+	reads.reserve(messages.size());
+	buffers.reserve(messages.size());
+
+	for(int i = 0; i < messages.size(); i++) {
+		arrays.push_back(messages[i]);
+		reads.push_back(arrays.back().read());
+		const char* bytes = (const char*) reads.back().ptr();
+		int numBytes = arrays.back().size();
+
+		if(sendThreadStarted) {
+			int result = queue_encoded(bytes, numBytes, SendLane::Gameplay);
+			if(result != 1) {
+				return result == -1 ? -1 : i;
+			}
+		} else if(stageSends) {
+			if(socketWrapper.stage_frame(bytes, numBytes, framed) == -1) {
+				return -1;
+			}
+		} else {
+			buffers.push_back(boost::asio::buffer(bytes, numBytes));
+		}
 	}
 
-	const char* bytes = (const char*) sendBuffer.read().ptr();
-	socketWrapper.send_bytes(bytes, numBytes);
+	if(!stageSends && !sendThreadStarted && socketWrapper.send_frames(buffers, framed) == -1) {
+		debug_print("send_messages: Error sending messages!");
+		return -1;
+	}
+	return messages.size();
+}
+
+int Socket::flush()
+{
+	if(socketWrapper.flush_staged() == -1) {
+		debug_print("flush: Error sending staged messages!");
+		return -1;
+	}
 	return 1;
 }
 
-void Socket::fill_message_buffer(char* sourceBuffer, int numBytes)
+void Socket::set_send_staging(bool trueOrFalse)
+{
+	stageSends = trueOrFalse;
+	if(!stageSends) {
+		flush();
+	}
+}
+
+/*
+ * Starts a native thread writing queued messages, so send_message never
+ * blocks the game on a full socket buffer. From then on send_message
+ * queues in the gameplay lane and returns 0 instead of blocking when the
+ * queue holds more than highWaterMark bytes, see queue_message. Returns
+ * 0 when started, 1 if already running or not connected.
+ */
+int Socket::start_send_thread(int highWaterMark)
+{
+	if(sendThreadStarted || highWaterMark < 1) {
+		debug_print("start_send_thread: Already running or high water mark below 1.");
+		return 1;
+	}
+
+	int result = socketWrapper.start_send_thread(highWaterMark);
+	sendThreadStarted = (result == 0);
+	sendBackpressure = false;
+	return result;
+}
+
+/*
+ * Queues a message in a lane of the send thread: 0 for input, 1 for
+ * gameplay and 2 for bulk. Each write takes all queued input first, then
+ * gameplay, then a slice of bulk cut at message boundaries, so bulk data
+ * never holds up input for long. Bulk is refused from half the high water
+ * mark on. Returns 1 when queued, 0 when refused, in which case
+ * send_queue_drained is emitted once there is room again, and -1 on error.
+ */
+int Socket::queue_message(godot::PoolByteArray message, int lane)
+{
+	if(!sendThreadStarted || lane < 0 || lane >= SEND_LANE_COUNT) {
+		debug_print("queue_message error: Send thread not running or lane not 0, 1 or 2.");
+		return -1;
+	}
+	godot::PoolByteArray::Read read = message.read();
+	return queue_encoded((const char*) read.ptr(), message.size(), (SendLane) lane);
+}
+
+int Socket::queue_encoded(const char* bytes, int numBytes, SendLane lane)
+{
+	int result = socketWrapper.queue_frame(bytes, numBytes, framed, lane);
+	if(result == 0) {
+		sendBackpressure = true;
+	} else if(result == -1) {
+		debug_print("queue_message: Error framing message!");
+	}
+	return result;
+}
+
+int Socket::get_send_queue_bytes()
+{
+	return (int) socketWrapper.queued_send_bytes();
+}
+
+void Socket::set_no_delay(bool trueOrFalse)
 {
+	socketWrapper.noDelay = trueOrFalse;
+}
+
+/*
+ * Compresses sent messages of at least threshold bytes with "lz4", fast
+ * enough to always leave on, or "zstd", smaller, best with a dictionary
+ * trained on typical messages. "none" turns it off. Level is the LZ4
+ * acceleration or the zstd level, 0 picks the default. Both ends must
+ * turn it on, each message body then starts with a flag byte telling
+ * whether the rest is compressed. Not available with fixed size framing,
+ * and only changed while no receive or send thread runs.
+ */
+void Socket::set_compression(godot::String codec, int level, int threshold)
+{
+	CompressionCodec parsed;
+	if(!parse_compression_codec(codec.ascii().get_data(), parsed) || threshold < 0) {
+		debug_print("set_compression error: Codec must be none, lz4 or zstd and threshold not negative.");
+		return;
+	}
+	if(socketWrapper.set_compression(parsed, level, threshold) == -1) {
+		debug_printf("set_compression error: %s", socketWrapper.lastError.message().c_str());
+	}
+}
+
+// A zstd dictionary, the peer has to use the same one. Like the codec it
+// is only changed while no receive or send thread runs.
+void Socket::set_compression_dictionary(godot::PoolByteArray dictionary)
+{
+	godot::PoolByteArray::Read read = dictionary.read();
+	if(socketWrapper.set_compression_dictionary((const char*) read.ptr(), dictionary.size()) == -1) {
+		debug_printf("set_compression_dictionary error: %s", socketWrapper.lastError.message().c_str());
+	}
+}
+
+// Whether the plugin was built with the codec, see SConstruct.
+bool Socket::is_compression_available(godot::String codec)
+{
+	CompressionCodec parsed;
+	return parse_compression_codec(codec.ascii().get_data(), parsed) && FrameCompressor::available(parsed);
+}
+
+/*
+ * Opens a UDP channel to the connected host, for messages that are only
+ * worth anything while they are fresh. The server listens on remotePort,
+ * localPort 0 binds any free port, see get_datagram_port.
+ * Datagram messages always carry a header of the current framing.
+ * Returns 0 when open, 1 on failure.
+ */
+int Socket::open_datagrams(int remotePort, int localPort)
+{
+	if(socketWrapper.open_datagrams(remotePort, localPort) == -1) {
+		debug_printf("open_datagrams: %s", socketWrapper.lastError.message().c_str());
+		return 1;
+	}
+	return 0;
+}
+
+void Socket::close_datagrams()
+{
+	socketWrapper.close_datagrams();
+}
+
+int Socket::get_datagram_port()
+{
+	return socketWrapper.datagram_port();
+}
+
+// Largest datagram sent or accepted, 1472 by default so nothing fragments
+// on a 1500 byte MTU. Both ends should agree on it.
+void Socket::set_max_datagram_size(int size)
+{
+	if(size < 64 || size > 65507) {
+		debug_print("set_max_datagram_size error: Size must be between 64 and 65507 bytes.");
+		return;
+	}
+	socketWrapper.set_max_datagram_size(size);
+}
+
+/*
+ * Stages a message for the next datagram, messages staged during a frame
+ * are packed into as few datagrams as possible and sent from _process, or
+ * by calling flush_datagrams. Delivery and order are not guaranteed.
+ * Returns 1 on success and -1 if the message does not fit in a datagram.
+ */
+int Socket::send_datagram(godot::PoolByteArray message)
+{
+	godot::PoolByteArray::Read read = message.read();
+	if(socketWrapper.stage_datagram((const char*) read.ptr(), message.size()) == -1) {
+		debug_print("send_datagram: Message does not fit in a datagram.");
+		return -1;
+	}
+	return 1;
+}
+
+// Returns the number of datagrams sent, or -1 on failure.
+int Socket::flush_datagrams()
+{
+	int sent = socketWrapper.flush_datagrams();
+	if(sent == -1) {
+		debug_printf("flush_datagrams: %s", socketWrapper.lastError.message().c_str());
+	}
+	return sent;
+}
+
+/*
+ * Returns the messages of all datagrams received since the last call,
+ * oldest first, as an Array of PoolByteArray. Never blocks. Datagrams
+ * older than one already received were dropped on arrival.
+ */
+godot::Array Socket::receive_datagrams(int maxCount)
+{
+	godot::Array messages;
+	receivedDatagrams.clear();
+	if(socketWrapper.receive_datagrams(receivedDatagrams, maxCount < 1 ? 1 : maxCount) == -1) {
+		debug_printf("receive_datagrams: %s", socketWrapper.lastError.message().c_str());
+	}
+	for(PooledFrame& frame : receivedDatagrams) {
+		messages.append(to_pool_byte_array(frame));
+	}
+	receivedDatagrams.clear();
+	return messages;
+}
+
+/*
+ * Hands the received bytes to the StreamPeerBuffer. PoolByteArray is
+ * reference counted, so this shares the memory the socket was read into
+ * instead of copying it, and the buffer is resized to the message.
+ */
+void Socket::fill_message_buffer(const godot::PoolByteArray& data)
+{
+	if(messageBuffer == nullptr) {
+		debug_print("fill_message_buffer: No message buffer set, call set_message_buffer first.");
+		return;
+	}
+	messageBuffer->set_data_array(data);
 	messageBuffer->seek(0);
-	godot::PoolByteArray* poolByteArray = &messageBuffer->get_data_array();
-	for (int i = 0; i < numBytes; i++) {
-		poolByteArray->set(i, sourceBuffer[i]);
+}
+
+/*
+ * Copies a queued frame into a new PoolByteArray and hands the frame's
+ * memory straight back to the pool for the receive thread to reuse.
+ */
+godot::PoolByteArray Socket::to_pool_byte_array(PooledFrame& frame)
+{
+	godot::PoolByteArray data;
+	data.resize((int) frame.size());
+	if(!frame.empty()) {
+		memcpy(data.write().ptr(), frame.data(), frame.size());
 	}
+	frame.reset();
+	return data;
 }
 
 short Socket::ntohs(short var)
@@ -38,6 +38,7 @@
 
 typedef char byte;
 
+#include "MessageLayout.hpp"
 #include "SocketWrapper.hpp"
 
 class Socket : public godot::Node {
@@ -47,41 +48,149 @@ private:
 	SocketWrapper socketWrapper;
 
 	bool debug = false;
-	unsigned int headerSize = 0;
-
-	// Internal buffer for receiving bytes from the socket,
-	// will allocated same number of bytes as the godot stream peer buffer.
-	char* byte_buffer;
+	// Set once a framing is chosen, sent messages get a header from then on.
+	bool framed = false;
 
 	// External buffer used to send back bytes to Godot when receiving full
-	// message with 2 or 4 byte header.
-	godot::StreamPeerBuffer* messageBuffer;
+	// header framed messages.
+	godot::StreamPeerBuffer* messageBuffer = nullptr;
+
+	// Background receiving, see start_receive_thread.
+	bool receiveThreadStarted = false;
+	bool emitMessages = true;
+	int receiveQueueSize = 256;
+
+	// Reused by receive_messages so bursts do not allocate a span list.
+	std::vector<FrameSpan> receivedFrames;
+	// Set once poll_frame has emitted disconnected, until the next connect.
+	bool pollDisconnected = false;
+	void emit_poll_disconnected();
+
+	// When set, send_message only stages messages, see set_send_staging.
+	bool stageSends = false;
+
+	// Background sending, see start_send_thread. Set when a message was
+	// refused until the queue has drained to half the high water mark.
+	bool sendThreadStarted = false;
+	bool sendBackpressure = false;
+	int queue_encoded(const char* bytes, int numBytes, SendLane lane);
+
+	// Reused by receive_datagrams.
+	std::vector<PooledFrame> receivedDatagrams;
+	// Compressed bodies read by receive_message before decompressing.
+	std::vector<char> receivedBody;
+
+	// Native message decoding, see register_layout.
+	MessageLayouts layouts;
+	bool decodeMessages = false;
+	std::vector<char> encodedMessage;
+
+	// Timestamps of the messages handed over by the last receive call,
+	// see set_timestamps.
+	std::vector<FrameTimestamps> deliveredTimestamps;
+	void stamp_delivery(FrameTimestamps stamps);
+
+	// Reports the outcome of connect_to_host_async from _process.
+	void emit_connect_result();
+	godot::Dictionary connect_timings(const ConnectReport& report);
 
 	void debug_print(const char * output);
-	void fill_message_buffer(char*, int messageSize);
+	void debug_printf(const char * format, ...);
+	void fill_message_buffer(const godot::PoolByteArray& data);
+	int receive_frame(godot::PoolByteArray& data);
+	int poll_frame(godot::PoolByteArray& data);
+	int receive_into(godot::PoolByteArray& data, int numBytes);
+	int decode_into(godot::PoolByteArray& data, const char* body, size_t size);
+	godot::PoolByteArray to_pool_byte_array(PooledFrame& frame);
+	godot::Dictionary to_fields(PooledFrame& frame);
+	int send_encoded(const char* bytes, int numBytes);
 public:
 	static void _register_methods();
 	void _init();
 	void _process(float delta);
 	
 	int connect_to_host(godot::String hostname, int port);
+	int connect_to_host_async(godot::String hostname, int port);
+	void set_connect_timeouts(int resolveMs, int connectMs, int handshakeMs);
 	void close();
+	int reconnect(int maxAttempts);
+	void set_reconnect_backoff(int initialMs, int maxMs);
+	bool is_session_resumed();
+	void set_kernel_tls(bool trueOrFalse);
+	godot::String get_tls_path();
+	void set_shared_memory_ring(int size);
+	godot::String get_transport();
 
 	void set_message_header_size(int size);
+	void set_message_framing(godot::String format);
+	void set_fixed_message_size(int size);
+	void set_message_delimiter(godot::PoolByteArray delimiter);
+	void set_max_message_size(int size);
 	void set_message_buffer(godot::Ref<godot::StreamPeerBuffer> messageBufferRef);
 	void set_ssl(bool trueOrFalse);
 	void set_blocking(bool trueOrFalse);
 	void set_debug(bool trueOrFalse);
+	void set_trace_enabled(bool trueOrFalse, int capacity);
+	godot::Array dump_trace();
+	godot::String get_last_error();
+	godot::Dictionary get_stats();
+	void reset_stats();
 	void set_receive_buffer(unsigned size);
+	void set_receive_queue_size(int size);
+	void set_emit_messages(bool trueOrFalse);
+	void set_frame_pool_size(int maxBytes);
+
+	int register_layout(int opcode, godot::String spec);
+	void unregister_layout(int opcode);
+	godot::Dictionary decode_message(godot::PoolByteArray message);
+	godot::PoolByteArray encode_message(int opcode, godot::Dictionary fields);
+	int send_layout(int opcode, godot::Dictionary fields);
+	void set_decode_messages(bool trueOrFalse);
+	godot::Array take_decoded_messages();
+
+	void set_timestamps(bool trueOrFalse);
+	godot::Array get_message_timestamps();
+
+	int start_capture(godot::String path);
+	void stop_capture();
+	int start_replay(godot::String path, bool paced);
 
 	int blocking_receive_message();
+	godot::PoolByteArray receive_message_data();
+	godot::Dictionary receive_messages(int maxCount);
+	godot::PoolByteArray poll();
+	void set_read_ahead_size(int size);
 	int blocking_receive(int numBytes);
 
+	int start_receive_thread();
+	godot::Array take_messages();
+
 	int send_message(godot::PoolByteArray sendBuffer);
+	int send_messages(godot::Array messages);
+	int flush();
+	void set_send_staging(bool trueOrFalse);
+	int start_send_thread(int highWaterMark);
+	int queue_message(godot::PoolByteArray message, int lane);
+	int get_send_queue_bytes();
+	void set_no_delay(bool trueOrFalse);
+	void set_compression(godot::String codec, int level, int threshold);
+	void set_compression_dictionary(godot::PoolByteArray dictionary);
+	bool is_compression_available(godot::String codec);
+
+	int open_datagrams(int remotePort, int localPort);
+	void close_datagrams();
+	int get_datagram_port();
+	void set_max_datagram_size(int size);
+	int send_datagram(godot::PoolByteArray message);
+	int flush_datagrams();
+	godot::Array receive_datagrams(int maxCount);
 	//int send_bytes(const char* bytes);
 
 	short ntohs(short var);
 	int htonl(int var);
 };
 
+// Histograms in get_stats, shared with SocketManager.
+godot::Dictionary histogram_to_dictionary(const Histogram& histogram);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,359 @@
+/*************************************************************************/
+/*  SocketManager.cpp                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                       GODOT WINSOCK PLUGIN                            */
+/*             https://github.com/flodihn/GodotWinSocket                 */
+/*************************************************************************/
+/* Copyright (c) 2021 Christian Flodihn.                                 */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#include <cstring>
+
+#include <GodotGlobal.hpp>
+#include <PoolArrays.hpp>
+
+#include "SocketManager.hpp"
+#include "Socket.hpp"
+
+/*
+ * Typical use from a load test scene:
+ *
+ *   manager.set_worker_threads(4)
+ *   manager.set_message_header_size(2)
+ *   manager.connect("message_received", self, "on_message")
+ *   for i in range(500):
+ *       manager.connect_to_host("staging.example.com", 2000)
+ *
+ * connect_to_host returns right away, the outcome is signalled with
+ * connected(id) or connect_failed(id, error). Messages arrive as
+ * message_received(id, message) once per frame from _process, unless
+ * set_emit_messages(false) was called, then take_messages fetches them.
+ * Settings have to be made before the first connect_to_host.
+ */
+void SocketManager::_register_methods()
+{
+	godot::register_method("_init", &SocketManager::_init);
+	godot::register_method("_process", &SocketManager::_process);
+
+	godot::register_method("set_worker_threads", &SocketManager::set_worker_threads);
+	godot::register_method("set_queue_size", &SocketManager::set_queue_size);
+	godot::register_method("set_ssl", &SocketManager::set_ssl);
+	godot::register_method("set_message_header_size", &SocketManager::set_message_header_size);
+	godot::register_method("set_message_framing", &SocketManager::set_message_framing);
+	godot::register_method("set_fixed_message_size", &SocketManager::set_fixed_message_size);
+	godot::register_method("set_max_message_size", &SocketManager::set_max_message_size);
+	godot::register_method("set_emit_messages", &SocketManager::set_emit_messages);
+	godot::register_method("set_debug", &SocketManager::set_debug);
+
+	godot::register_method("connect_to_host", &SocketManager::connect_to_host);
+	godot::register_method("send_message", &SocketManager::send_message);
+	godot::register_method("close_connection", &SocketManager::close_connection);
+	godot::register_method("close_all", &SocketManager::close_all);
+	godot::register_method("get_connection_count", &SocketManager::get_connection_count);
+	godot::register_method("take_messages", &SocketManager::take_messages);
+	godot::register_method("get_stats", &SocketManager::get_stats);
+
+	godot::register_signal<SocketManager>("connected", "connection_id", GODOT_VARIANT_TYPE_INT);
+	godot::register_signal<SocketManager>("connect_failed",
+		"connection_id", GODOT_VARIANT_TYPE_INT, "error", GODOT_VARIANT_TYPE_STRING);
+	godot::register_signal<SocketManager>("message_received",
+		"connection_id", GODOT_VARIANT_TYPE_INT, "message", GODOT_VARIANT_TYPE_POOL_BYTE_ARRAY);
+	godot::register_signal<SocketManager>("disconnected", "connection_id", GODOT_VARIANT_TYPE_INT);
+}
+
+void SocketManager::_init()
+{
+}
+
+/*
+ * Emits everything the workers delivered since the last frame. Messages
+ * stay queued for take_messages when emitting them is turned off, the
+ * connection events are always emitted.
+ */
+void SocketManager::_process(float delta)
+{
+	if(!reactor) {
+		return;
+	}
+
+	// Held messages are older than anything still on the reactor.
+	while(emitMessages && !heldMessages.empty()) {
+		emit_event(heldMessages.front());
+		heldMessages.pop_front();
+	}
+
+	// Holding at most as many messages as the workers can queue keeps
+	// them from reading ahead of the game, events behind a full hold
+	// wait for take_messages.
+	size_t maxHeld = (size_t) queueSize * reactor->thread_count();
+	ReactorEvent event;
+	while((emitMessages || heldMessages.size() < maxHeld) && reactor->pop_event(event)) {
+		if(event.type == ReactorEventType::Message && !emitMessages) {
+			heldMessages.push_back(std::move(event));
+		} else {
+			emit_event(event);
+		}
+	}
+}
+
+void SocketManager::emit_event(ReactorEvent& event)
+{
+	switch(event.type) {
+	case ReactorEventType::Connected:
+		emit_signal("connected", event.connectionId);
+		break;
+	case ReactorEventType::ConnectFailed:
+		emit_signal("connect_failed", event.connectionId, godot::String(event.error.message().c_str()));
+		break;
+	case ReactorEventType::Message: {
+		godot::PoolByteArray data;
+		data.resize((int) event.frame.size());
+		memcpy(data.write().ptr(), event.frame.data(), event.frame.size());
+		event.frame.reset();
+		emit_signal("message_received", event.connectionId, data);
+		break;
+	}
+	case ReactorEventType::Disconnected:
+		emit_signal("disconnected", event.connectionId);
+		break;
+	}
+}
+
+void SocketManager::debug_print(const char* output)
+{
+	if (!debug) return;
+	godot::Godot::print(output);
+}
+
+// The reactor takes its settings when it is created.
+bool SocketManager::configurable()
+{
+	if(reactor) {
+		debug_print("SocketManager error: Settings must be made before the first connect_to_host.");
+		return false;
+	}
+	return true;
+}
+
+SocketReactor& SocketManager::get_reactor()
+{
+	if(!reactor) {
+		reactor.reset(new SocketReactor(workerThreads, queueSize));
+		reactor->sslEnabled = sslEnabled;
+		reactor->set_framing(frameFormat, fixedFrameSize);
+		reactor->set_max_message_size(maxMessageSize);
+	}
+	return *reactor;
+}
+
+void SocketManager::set_worker_threads(int count)
+{
+	if(count < 1) {
+		debug_print("set_worker_threads error: At least one thread is needed.");
+		return;
+	}
+	if(configurable()) {
+		workerThreads = count;
+	}
+}
+
+// Events each worker can have waiting for _process.
+void SocketManager::set_queue_size(int size)
+{
+	if(size < 1) {
+		debug_print("set_queue_size error: Size must be at least 1.");
+		return;
+	}
+	if(configurable()) {
+		queueSize = size;
+	}
+}
+
+void SocketManager::set_ssl(bool trueOrFalse)
+{
+	if(configurable()) {
+		sslEnabled = trueOrFalse;
+	}
+}
+
+void SocketManager::set_message_header_size(int size)
+{
+	if (!(size == 2 || size == 4)) {
+		debug_print("set_message_header_size error: Size must be 2 or 4 bytes.");
+		return;
+	}
+	if(configurable()) {
+		frameFormat = size == 2 ? FrameFormat::U16BE : FrameFormat::U32BE;
+	}
+}
+
+// Same formats as Socket.set_message_framing.
+void SocketManager::set_message_framing(godot::String format)
+{
+	FrameFormat parsed;
+	if(!parse_frame_format(format.ascii().get_data(), parsed)) {
+		debug_print("set_message_framing error: Unknown format, expected u16, u16le, u32, u32le or varint.");
+		return;
+	}
+	if(configurable()) {
+		frameFormat = parsed;
+	}
+}
+
+void SocketManager::set_fixed_message_size(int size)
+{
+	if(size < 1) {
+		debug_print("set_fixed_message_size error: Size must be at least 1 byte.");
+		return;
+	}
+	if(configurable()) {
+		frameFormat = FrameFormat::Fixed;
+		fixedFrameSize = size;
+	}
+}
+
+void SocketManager::set_max_message_size(int size)
+{
+	if(size < 1) {
+		debug_print("set_max_message_size error: Size must be at least 1 byte.");
+		return;
+	}
+	if(configurable()) {
+		maxMessageSize = size;
+	}
+}
+
+void SocketManager::set_emit_messages(bool trueOrFalse)
+{
+	emitMessages = trueOrFalse;
+}
+
+void SocketManager::set_debug(bool trueOrFalse)
+{
+	debug = trueOrFalse;
+}
+
+// Returns the id of the new connection, the outcome is signalled later.
+int SocketManager::connect_to_host(godot::String hostname, int port)
+{
+	return get_reactor().connect(hostname.ascii().get_data(), port);
+}
+
+// Returns 1 once the message is queued for the connection, -1 if the id
+// is unknown or the message does not fit the framing.
+int SocketManager::send_message(int connectionId, godot::PoolByteArray message)
+{
+	if(!reactor) {
+		return -1;
+	}
+	godot::PoolByteArray::Read read = message.read();
+	if(reactor->send_frame(connectionId, (const char*) read.ptr(), message.size()) == -1) {
+		debug_print("send_message: Unknown connection or bad message size.");
+		return -1;
+	}
+	return 1;
+}
+
+void SocketManager::close_connection(int connectionId)
+{
+	if(reactor) {
+		reactor->close(connectionId);
+	}
+}
+
+void SocketManager::close_all()
+{
+	if(reactor) {
+		reactor->close_all();
+	}
+}
+
+int SocketManager::get_connection_count()
+{
+	return reactor ? (int) reactor->connection_count() : 0;
+}
+
+/*
+ * Fetches every message received since the last call in one batch:
+ *   "connection_ids": PoolIntArray, the connection of each message,
+ *   "messages": Array of PoolByteArray.
+ * Connection events met on the way are emitted as signals.
+ */
+godot::Dictionary SocketManager::take_messages()
+{
+	godot::Dictionary result;
+	godot::PoolIntArray connectionIds;
+	godot::Array messages;
+
+	if(reactor) {
+		ReactorEvent event;
+		while(!heldMessages.empty() || reactor->pop_event(event)) {
+			if(!heldMessages.empty()) {
+				event = std::move(heldMessages.front());
+				heldMessages.pop_front();
+			} else if(event.type != ReactorEventType::Message) {
+				emit_event(event);
+				continue;
+			}
+			godot::PoolByteArray data;
+			data.resize((int) event.frame.size());
+			memcpy(data.write().ptr(), event.frame.data(), event.frame.size());
+			event.frame.reset();
+			connectionIds.append(event.connectionId);
+			messages.append(data);
+		}
+	}
+
+	result["connection_ids"] = connectionIds;
+	result["messages"] = messages;
+	return result;
+}
+
+// Totals over all connections, same keys as Socket.get_stats.
+godot::Dictionary SocketManager::get_stats()
+{
+	godot::Dictionary result;
+	if(!reactor) {
+		return result;
+	}
+	const SocketStats& stats = reactor->stats;
+
+	result["connections"] = (int64_t) reactor->connection_count();
+	result["worker_threads"] = reactor->thread_count();
+	result["bytes_in"] = (int64_t) stats.bytesIn.load();
+	result["bytes_out"] = (int64_t) stats.bytesOut.load();
+	result["messages_in"] = (int64_t) stats.messagesIn.load();
+	result["messages_out"] = (int64_t) stats.messagesOut.load();
+	result["read_calls"] = (int64_t) stats.readCalls.load();
+	result["write_calls"] = (int64_t) stats.writeCalls.load();
+	result["tls_records_in"] = (int64_t) stats.tlsRecordsIn.load();
+	result["tls_records_out"] = (int64_t) stats.tlsRecordsOut.load();
+	result["resumed_sessions"] = (int64_t) stats.resumedSessions.load();
+	result["frame_pool_bytes"] = (int64_t) reactor->frame_pool().cached_bytes();
+
+	result["message_size_in"] = histogram_to_dictionary(stats.messageSizeIn);
+	result["message_size_out"] = histogram_to_dictionary(stats.messageSizeOut);
+	result["connect_usec"] = histogram_to_dictionary(stats.connectUsec);
+	result["handshake_usec"] = histogram_to_dictionary(stats.handshakeUsec);
+	return result;
+}
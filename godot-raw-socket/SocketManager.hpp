@@ -0,0 +1,94 @@
+/*************************************************************************/
+/*  SocketManager.hpp                                                    */
+/*************************************************************************/
+/*                       This file is part of:                           */
+/*                       GODOT WINSOCK PLUGIN                            */
+/*             https://github.com/flodihn/GodotWinSocket                 */
+/*************************************************************************/
+/* Copyright (c) 2021 Christian Flodihn.                                 */
+/*                                                                       */
+/* Permission is hereby granted, free of charge, to any person obtaining */
+/* a copy of this software and associated documentation files (the       */
+/* "Software"), to deal in the Software without restriction, including   */
+/* without limitation the rights to use, copy, modify, merge, publish,   */
+/* distribute, sublicense, and/or sell copies of the Software, and to    */
+/* permit persons to whom the Software is furnished to do so, subject to */
+/* the following conditions:                                             */
+/*                                                                       */
+/* The above copyright notice and this permission notice shall be        */
+/* included in all copies or substantial portions of the Software.       */
+/*                                                                       */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,       */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF    */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.*/
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY  */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,  */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE     */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                */
+/*************************************************************************/
+
+#ifndef SOCKET_MANAGER_H
+#define SOCKET_MANAGER_H
+
+#include <deque>
+#include <memory>
+
+#include <Godot.hpp>
+#include <Node.hpp>
+
+#include "SocketReactor.hpp"
+
+/*
+ * Many client connections from a single node, for headless load test
+ * clients and bot swarms. Connections are served by a SocketReactor with
+ * a few worker threads instead of a thread per connection, and every
+ * signal carries the id connect_to_host returned for the connection.
+ */
+class SocketManager : public godot::Node {
+	GODOT_CLASS(SocketManager, godot::Node)
+
+private:
+	// Created by the first connect_to_host, with the settings made so far.
+	std::unique_ptr<SocketReactor> reactor;
+	int workerThreads = 1;
+	int queueSize = 4096;
+	bool sslEnabled = false;
+	FrameFormat frameFormat = FrameFormat::U16BE;
+	size_t fixedFrameSize = 0;
+	size_t maxMessageSize = 16 * 1024 * 1024;
+	bool emitMessages = true;
+	bool debug = false;
+	// Messages _process took off the reactor to get at the connection
+	// events behind them while emitting messages is off, handed out first
+	// by take_messages.
+	std::deque<ReactorEvent> heldMessages;
+
+	void debug_print(const char * output);
+	bool configurable();
+	SocketReactor& get_reactor();
+	void emit_event(ReactorEvent& event);
+public:
+	static void _register_methods();
+	void _init();
+	void _process(float delta);
+
+	void set_worker_threads(int count);
+	void set_queue_size(int size);
+	void set_ssl(bool trueOrFalse);
+	void set_message_header_size(int size);
+	void set_message_framing(godot::String format);
+	void set_fixed_message_size(int size);
+	void set_max_message_size(int size);
+	void set_emit_messages(bool trueOrFalse);
+	void set_debug(bool trueOrFalse);
+
+	int connect_to_host(godot::String hostname, int port);
+	int send_message(int connectionId, godot::PoolByteArray message);
+	void close_connection(int connectionId);
+	void close_all();
+	int get_connection_count();
+	godot::Dictionary take_messages();
+	godot::Dictionary get_stats();
+};
+
+#endif
@@ -0,0 +1,477 @@
+#include "SocketReactor.hpp"
+
+#include "ReadAheadBuffer.hpp"
+#include "TlsContext.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+
+// Smaller than the 64 KiB of a single Socket, hundreds of connections
+// each keep one. Larger messages grow the buffer as needed.
+static const size_t CONNECTION_READ_SIZE = 16384;
+
+/*
+ * One connection of a SocketReactor. Everything except the outgoing
+ * buffer is only touched from the thread of the connection's shard.
+ */
+struct ManagedConnection {
+	int id;
+	size_t shardIndex;
+	std::string hostname;
+	std::string sessionKey;
+	int port;
+
+	ip::tcp::resolver resolver;
+	ip::tcp::socket plainSocket;
+	std::shared_ptr<ssl::context> sslContext;
+	std::unique_ptr<ssl::stream<ip::tcp::socket>> secureSocket;
+	std::chrono::steady_clock::time_point connectStart;
+	bool open = false;
+	bool finished = false;
+	bool readPending = false;
+	// Whether the handshake offered a cached session.
+	bool sessionOffered = false;
+
+	ReadAheadBuffer readAhead{CONNECTION_READ_SIZE};
+	std::vector<FrameSpan> frames;
+
+	// Events that did not fit in the shard's queue, retried on a timer.
+	// Reading stops until they are all delivered.
+	std::vector<ReactorEvent> backlog;
+	size_t backlogStart = 0;
+	steady_timer retryTimer;
+	bool retryPending = false;
+
+	// Filled by send_frame on the game thread, swapped with inFlight by
+	// the shard for every write.
+	std::mutex sendMutex;
+	std::vector<char> outgoing;
+	bool writing = false;
+	std::vector<char> inFlight;
+
+	ManagedConnection(int connectionId, size_t shard, io_context& ioContext, const std::string& host, int hostPort) :
+		id(connectionId),
+		shardIndex(shard),
+		hostname(host),
+		sessionKey(host + ":" + std::to_string(hostPort)),
+		port(hostPort),
+		resolver(ioContext),
+		plainSocket(ioContext),
+		retryTimer(ioContext) {}
+
+	ip::tcp::socket& socket()
+	{
+		return secureSocket ? secureSocket->next_layer() : plainSocket;
+	}
+
+	template<typename Handler>
+	void async_read_some(const mutable_buffer& buffer, Handler&& handler)
+	{
+		if(secureSocket) {
+			secureSocket->async_read_some(buffer, std::forward<Handler>(handler));
+		} else {
+			plainSocket.async_read_some(buffer, std::forward<Handler>(handler));
+		}
+	}
+
+	template<typename Handler>
+	void async_write(const const_buffer& buffer, Handler&& handler)
+	{
+		if(secureSocket) {
+			boost::asio::async_write(*secureSocket, buffer, std::forward<Handler>(handler));
+		} else {
+			boost::asio::async_write(plainSocket, buffer, std::forward<Handler>(handler));
+		}
+	}
+};
+
+static uint64_t usec_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+SocketReactor::SocketReactor(int threadCount, size_t queueSize)
+{
+	if(threadCount < 1) {
+		threadCount = 1;
+	}
+	for(int i = 0; i < threadCount; i++) {
+		shards.emplace_back(new Shard(queueSize));
+	}
+	for(std::unique_ptr<Shard>& shard : shards) {
+		Shard* running = shard.get();
+		shard->thread = std::thread([running]() { running->ioContext.run(); });
+	}
+}
+
+SocketReactor::~SocketReactor()
+{
+	for(std::unique_ptr<Shard>& shard : shards) {
+		shard->work.reset();
+		shard->ioContext.stop();
+	}
+	for(std::unique_ptr<Shard>& shard : shards) {
+		shard->thread.join();
+	}
+	// The handlers still waiting in the io contexts hold connections,
+	// which have to go while the stats they count into are alive.
+	connections.clear();
+	shards.clear();
+}
+
+int SocketReactor::set_framing(FrameFormat format, size_t fixedSize)
+{
+	if(format == FrameFormat::Fixed && fixedSize == 0) {
+		return -1;
+	}
+	frameFormat = format;
+	fixedFrameSize = fixedSize;
+	return 0;
+}
+
+void SocketReactor::set_max_message_size(size_t size)
+{
+	maxMessageSize = size;
+}
+
+size_t SocketReactor::max_message_size() const
+{
+	return frame_size_limit(frameFormat, fixedFrameSize, maxMessageSize);
+}
+
+int SocketReactor::connect(const std::string& hostname, int port)
+{
+	size_t shardIndex = nextShard;
+	nextShard = (nextShard + 1) % shards.size();
+	Shard& shard = *shards[shardIndex];
+
+	int id = nextConnectionId++;
+	std::shared_ptr<ManagedConnection> connection(
+		new ManagedConnection(id, shardIndex, shard.ioContext, hostname, port));
+
+	if(sslEnabled) {
+		connection->sslContext = client_ssl_context();
+		connection->secureSocket.reset(new ssl::stream<ip::tcp::socket>(shard.ioContext, *connection->sslContext));
+		SSL* ssl = connection->secureSocket->native_handle();
+		SSL_set_msg_callback(ssl, count_tls_records);
+		SSL_set_msg_callback_arg(ssl, &stats);
+		connection->sessionOffered = prepare_client_session(ssl, connection->hostname, connection->sessionKey);
+		connection->secureSocket->set_verify_mode(ssl::verify_none);
+	}
+
+	connections[id] = connection;
+	post(shard.ioContext, [this, connection]() { start_connect(connection); });
+	return id;
+}
+
+void SocketReactor::start_connect(std::shared_ptr<ManagedConnection> connection)
+{
+	connection->connectStart = std::chrono::steady_clock::now();
+	connection->resolver.async_resolve(connection->hostname, std::to_string(connection->port),
+		[this, connection](const error_code& error, ip::tcp::resolver::results_type endpoints) {
+			if(error || connection->finished) {
+				fail(connection, error);
+				return;
+			}
+			boost::asio::async_connect(connection->socket(), endpoints,
+				[this, connection](const error_code& error, const ip::tcp::endpoint&) {
+					if(error || connection->finished) {
+						fail(connection, error);
+						return;
+					}
+					stats.connectUsec.record(usec_since(connection->connectStart));
+					if(noDelay) {
+						error_code ignored;
+						connection->socket().set_option(ip::tcp::no_delay(true), ignored);
+					}
+					start_handshake(connection);
+				});
+		});
+}
+
+void SocketReactor::start_handshake(std::shared_ptr<ManagedConnection> connection)
+{
+	if(!connection->secureSocket) {
+		connected(connection);
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	connection->secureSocket->async_handshake(ssl::stream_base::client,
+		[this, connection, start](const error_code& error) {
+			if(error || connection->finished) {
+				fail(connection, error);
+				return;
+			}
+			stats.handshakeUsec.record(usec_since(start));
+			if(connection->sessionOffered && SSL_session_reused(connection->secureSocket->native_handle()) == 1) {
+				count(stats.resumedSessions);
+			}
+			connected(connection);
+		});
+}
+
+void SocketReactor::connected(std::shared_ptr<ManagedConnection> connection)
+{
+	connection->open = true;
+	push_event(*connection, ReactorEventType::Connected, error_code());
+
+	// Messages sent while connecting are written now.
+	bool writeRequested;
+	{
+		std::lock_guard<std::mutex> lock(connection->sendMutex);
+		writeRequested = connection->writing;
+	}
+	if(writeRequested) {
+		start_write(connection);
+	}
+	deliver(connection);
+}
+
+void SocketReactor::start_read(std::shared_ptr<ManagedConnection> connection)
+{
+	ReadAheadBuffer& readAhead = connection->readAhead;
+	if(readAhead.size() == 0 && readAhead.capacity() > CONNECTION_READ_SIZE) {
+		readAhead.resize(CONNECTION_READ_SIZE);
+	}
+	readAhead.make_room(readAhead.size() + 1);
+
+	connection->readPending = true;
+	connection->async_read_some(buffer(readAhead.write_ptr(), readAhead.write_space()),
+		[this, connection](const error_code& error, size_t received) {
+			connection->readPending = false;
+			if(error || connection->finished) {
+				fail(connection, error);
+				return;
+			}
+			on_read(connection, received);
+		});
+}
+
+/*
+ * Turns every complete message of a read into an event. The bodies are
+ * copied into pooled buffers, so the read ahead buffer is free for the
+ * next read as soon as this returns.
+ */
+void SocketReactor::on_read(std::shared_ptr<ManagedConnection> connection, size_t received)
+{
+	ReadAheadBuffer& readAhead = connection->readAhead;
+	readAhead.commit(received);
+	count(stats.readCalls);
+	count(stats.bytesIn, received);
+
+	std::vector<FrameSpan>& frames = connection->frames;
+	frames.clear();
+	size_t pending = 0;
+	size_t position = scan_frames(frameFormat, fixedFrameSize, readAhead.data(), readAhead.size(),
+		(size_t) -1, max_message_size(), frames, pending);
+
+	for(const FrameSpan& span : frames) {
+		ReactorEvent event;
+		event.connectionId = connection->id;
+		event.type = ReactorEventType::Message;
+		event.frame = framePool.acquire(span.size);
+		if(!event.frame.data()) {
+			fail(connection, boost::system::errc::make_error_code(boost::system::errc::not_enough_memory));
+			return;
+		}
+		memcpy(event.frame.data(), readAhead.data() + span.offset, span.size);
+		queue_event(*connection, std::move(event));
+		stats.messageSizeIn.record(span.size);
+	}
+	count(stats.messagesIn, frames.size());
+	readAhead.consume(position);
+
+	if(pending == 0) {
+		fail(connection, boost::system::errc::make_error_code(boost::system::errc::bad_message));
+		return;
+	}
+	readAhead.make_room(pending);
+	deliver(connection);
+}
+
+int SocketReactor::send_frame(int connectionId, const char* bytes, size_t numBytes)
+{
+	auto found = connections.find(connectionId);
+	if(found == connections.end() || numBytes > max_message_size() ||
+		(frameFormat == FrameFormat::Fixed && numBytes != fixedFrameSize)) {
+		return -1;
+	}
+	std::shared_ptr<ManagedConnection>& connection = found->second;
+
+	unsigned char header[MAX_FRAME_HEADER_SIZE];
+	size_t headerSize = encode_frame_header(frameFormat, numBytes, header);
+	bool startWrite;
+	{
+		std::lock_guard<std::mutex> lock(connection->sendMutex);
+		connection->outgoing.insert(connection->outgoing.end(), header, header + headerSize);
+		connection->outgoing.insert(connection->outgoing.end(), bytes, bytes + numBytes);
+		startWrite = !connection->writing;
+		connection->writing = true;
+	}
+	count(stats.messagesOut);
+	stats.messageSizeOut.record(numBytes);
+
+	if(startWrite) {
+		post(shards[connection->shardIndex]->ioContext, [this, connection]() { start_write(connection); });
+	}
+	return 0;
+}
+
+// Writes everything queued so far in one write, then whatever was queued
+// while that write was in flight, until nothing is left.
+void SocketReactor::start_write(std::shared_ptr<ManagedConnection> connection)
+{
+	if(!connection->open) {
+		// Still connecting, connected picks the write up.
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(connection->sendMutex);
+		if(connection->outgoing.empty()) {
+			connection->writing = false;
+			return;
+		}
+		std::swap(connection->outgoing, connection->inFlight);
+	}
+
+	count(stats.writeCalls);
+	connection->async_write(buffer(connection->inFlight),
+		[this, connection](const error_code& error, size_t written) {
+			if(error) {
+				fail(connection, error);
+				return;
+			}
+			count(stats.bytesOut, written);
+			connection->inFlight.clear();
+			start_write(connection);
+		});
+}
+
+void SocketReactor::queue_event(ManagedConnection& connection, ReactorEvent&& event)
+{
+	if(connection.backlogStart == connection.backlog.size() &&
+		shards[connection.shardIndex]->events.try_push(std::move(event))) {
+		return;
+	}
+	connection.backlog.push_back(std::move(event));
+}
+
+void SocketReactor::push_event(ManagedConnection& connection, ReactorEventType type, const error_code& error)
+{
+	ReactorEvent event;
+	event.connectionId = connection.id;
+	event.type = type;
+	event.error = error;
+	queue_event(connection, std::move(event));
+}
+
+/*
+ * Hands the connection's backlog to the queue and reads on once it is
+ * empty. With the queue full the game is behind, the connection then
+ * waits a millisecond and tries again instead of reading more, which
+ * lets TCP flow control slow the server down. Other connections on the
+ * shard keep running.
+ */
+void SocketReactor::deliver(std::shared_ptr<ManagedConnection> connection)
+{
+	if(connection->retryPending) {
+		return;
+	}
+
+	FrameQueue<ReactorEvent>& events = shards[connection->shardIndex]->events;
+	std::vector<ReactorEvent>& backlog = connection->backlog;
+	while(connection->backlogStart < backlog.size()) {
+		if(!events.try_push(std::move(backlog[connection->backlogStart]))) {
+			connection->retryPending = true;
+			connection->retryTimer.expires_after(std::chrono::milliseconds(1));
+			connection->retryTimer.async_wait([this, connection](const error_code&) {
+				connection->retryPending = false;
+				deliver(connection);
+			});
+			return;
+		}
+		connection->backlogStart++;
+	}
+	backlog.clear();
+	connection->backlogStart = 0;
+
+	if(connection->open && !connection->readPending) {
+		start_read(connection);
+	}
+}
+
+// Ends the connection once, with ConnectFailed if it never got connected.
+void SocketReactor::fail(std::shared_ptr<ManagedConnection> connection, const error_code& error)
+{
+	if(connection->finished) {
+		return;
+	}
+	connection->finished = true;
+	bool wasOpen = connection->open;
+	connection->open = false;
+
+	error_code ignored;
+	connection->resolver.cancel();
+	if(connection->secureSocket) {
+		// Keeps the session resumable, see SocketWrapper::drop_connection.
+		SSL_set_shutdown(connection->secureSocket->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	}
+	connection->socket().close(ignored);
+
+	push_event(*connection, wasOpen ? ReactorEventType::Disconnected : ReactorEventType::ConnectFailed, error);
+	deliver(connection);
+}
+
+void SocketReactor::close(int connectionId)
+{
+	auto found = connections.find(connectionId);
+	if(found == connections.end()) {
+		return;
+	}
+	std::shared_ptr<ManagedConnection> connection = found->second;
+	connections.erase(found);
+	post(shards[connection->shardIndex]->ioContext, [this, connection]() { fail(connection, error_code()); });
+}
+
+void SocketReactor::close_all()
+{
+	while(!connections.empty()) {
+		close(connections.begin()->first);
+	}
+}
+
+bool SocketReactor::pop_event(ReactorEvent& event)
+{
+	for(size_t i = 0; i < shards.size(); i++) {
+		Shard& shard = *shards[nextPoll];
+		nextPoll = (nextPoll + 1) % shards.size();
+		if(shard.events.try_pop(event)) {
+			if(event.type == ReactorEventType::Disconnected || event.type == ReactorEventType::ConnectFailed) {
+				connections.erase(event.connectionId);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t SocketReactor::connection_count() const
+{
+	return connections.size();
+}
+
+int SocketReactor::thread_count() const
+{
+	return (int) shards.size();
+}
+
+const FramePool& SocketReactor::frame_pool() const
+{
+	return framePool;
+}
@@ -0,0 +1,124 @@
+#ifndef SOCKET_REACTOR_H
+#define SOCKET_REACTOR_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "FrameCodec.hpp"
+#include "FramePool.hpp"
+#include "FrameQueue.hpp"
+#include "SocketStats.hpp"
+
+struct ManagedConnection;
+
+enum class ReactorEventType {
+	Connected,
+	ConnectFailed,
+	Message,
+	Disconnected
+};
+
+// What the reactor hands to the game, tagged with the connection it is about.
+struct ReactorEvent {
+	int connectionId = 0;
+	ReactorEventType type = ReactorEventType::Message;
+	PooledFrame frame;
+	boost::system::error_code error;
+};
+
+/*
+ * Many connections served by a few threads, for load test clients and
+ * bots holding hundreds of connections.
+ *
+ * Connections are spread round robin over shards. A shard is one io
+ * context run by one worker thread, on Linux that is one epoll instance
+ * waiting on all of the shard's sockets, and all reads, writes and
+ * handshakes of a connection run asynchronously on its shard. Throughput
+ * scales with the number of shards, which should match the cores, not
+ * with the number of connections.
+ *
+ * Received messages and connection state changes are pushed as events on
+ * a bounded single producer queue per shard, pop_event takes them from
+ * all shards in turn, so the consumer sees them as a single stream. When
+ * the consumer falls behind, a connection stops reading until its events
+ * fit in the queue again.
+ *
+ * All public methods are meant to be called from one thread, the Godot
+ * main thread.
+ */
+class SocketReactor {
+private:
+	struct Shard {
+		boost::asio::io_context ioContext;
+		boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+		FrameQueue<ReactorEvent> events;
+		std::thread thread;
+
+		explicit Shard(size_t queueSize) :
+			work(boost::asio::make_work_guard(ioContext)),
+			events(queueSize) {}
+	};
+
+	// Declared before the shards so events still queued on destruction
+	// are handed back to a live pool.
+	FramePool framePool;
+	std::vector<std::unique_ptr<Shard>> shards;
+	size_t nextShard = 0;
+	size_t nextPoll = 0;
+	int nextConnectionId = 1;
+	std::unordered_map<int, std::shared_ptr<ManagedConnection>> connections;
+
+	FrameFormat frameFormat = FrameFormat::U16BE;
+	size_t fixedFrameSize = 0;
+	size_t maxMessageSize = 16 * 1024 * 1024;
+
+	void start_connect(std::shared_ptr<ManagedConnection> connection);
+	void start_handshake(std::shared_ptr<ManagedConnection> connection);
+	void connected(std::shared_ptr<ManagedConnection> connection);
+	void start_read(std::shared_ptr<ManagedConnection> connection);
+	void on_read(std::shared_ptr<ManagedConnection> connection, size_t received);
+	void start_write(std::shared_ptr<ManagedConnection> connection);
+	void deliver(std::shared_ptr<ManagedConnection> connection);
+	void queue_event(ManagedConnection& connection, ReactorEvent&& event);
+	void push_event(ManagedConnection& connection, ReactorEventType type, const boost::system::error_code& error);
+	void fail(std::shared_ptr<ManagedConnection> connection, const boost::system::error_code& error);
+public:
+	// threadCount shards, each with room for queueSize events.
+	explicit SocketReactor(int threadCount = 1, size_t queueSize = 4096);
+	~SocketReactor();
+
+	SocketReactor(const SocketReactor&) = delete;
+	SocketReactor& operator=(const SocketReactor&) = delete;
+
+	// Shared by all connections, set before connecting.
+	SocketStats stats;
+	bool sslEnabled = false;
+	bool noDelay = true;
+	// -1 for Fixed framing without a size.
+	int set_framing(FrameFormat format, size_t fixedSize = 0);
+	void set_max_message_size(size_t size);
+	size_t max_message_size() const;
+
+	// Starts connecting and returns the id of the new connection. The
+	// outcome arrives as a Connected or ConnectFailed event.
+	int connect(const std::string& hostname, int port);
+	// Queues a message, the shard writes everything queued for the
+	// connection in one write. Returns -1 for unknown ids or bad sizes.
+	int send_frame(int connectionId, const char* bytes, size_t numBytes);
+	// Closes the connection, followed by a Disconnected event.
+	void close(int connectionId);
+	void close_all();
+
+	bool pop_event(ReactorEvent& event);
+	size_t connection_count() const;
+	int thread_count() const;
+	const FramePool& frame_pool() const;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef SOCKET_STATS_H
+#define SOCKET_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Log linear histogram in the spirit of HdrHistogram. Values are bucketed
+ * by power of two, with 16 linear sub buckets per power, which bounds the
+ * error of any reported percentile to about 6%. Recording is a single
+ * relaxed increment, so it can stay on in production builds.
+ */
+class Histogram {
+public:
+	static const int SUB_BUCKET_BITS = 4;
+	static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static const int BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+private:
+	std::atomic<uint64_t> buckets[BUCKET_COUNT];
+	std::atomic<uint64_t> total{0};
+	std::atomic<uint64_t> sum{0};
+	std::atomic<uint64_t> maximum{0};
+
+	static int index_of(uint64_t value)
+	{
+		if(value < SUB_BUCKETS) {
+			return (int) value;
+		}
+		int magnitude = highest_bit(value) - SUB_BUCKET_BITS;
+		int subBucket = (int) (value >> magnitude) - SUB_BUCKETS;
+		return (magnitude + 1) * SUB_BUCKETS + subBucket;
+	}
+
+	// Highest value that lands in the bucket at index.
+	static uint64_t value_of(int index)
+	{
+		if(index < SUB_BUCKETS) {
+			return (uint64_t) index;
+		}
+		int magnitude = index / SUB_BUCKETS - 1;
+		uint64_t subBucket = (uint64_t) (index % SUB_BUCKETS) + SUB_BUCKETS;
+		return ((subBucket + 1) << magnitude) - 1;
+	}
+
+	static int highest_bit(uint64_t value)
+	{
+		int bit = 0;
+		for(int shift = 32; shift > 0; shift >>= 1) {
+			if(value >> shift) {
+				value >>= shift;
+				bit += shift;
+			}
+		}
+		return bit;
+	}
+public:
+	Histogram()
+	{
+		reset();
+	}
+
+	void record(uint64_t value)
+	{
+		buckets[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+		uint64_t current = maximum.load(std::memory_order_relaxed);
+		while(value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	void reset()
+	{
+		for(int i = 0; i < BUCKET_COUNT; i++) {
+			buckets[i].store(0, std::memory_order_relaxed);
+		}
+		total.store(0, std::memory_order_relaxed);
+		sum.store(0, std::memory_order_relaxed);
+		maximum.store(0, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const { return total.load(std::memory_order_relaxed); }
+	uint64_t max() const { return maximum.load(std::memory_order_relaxed); }
+
+	double mean() const
+	{
+		uint64_t n = count();
+		return n ? (double) sum.load(std::memory_order_relaxed) / n : 0.0;
+	}
+
+	// Value at or below which the given fraction of values fall.
+	uint64_t percentile(double fraction) const
+	{
+		uint64_t n = count();
+		if(n == 0) {
+			return 0;
+		}
+		uint64_t wanted = (uint64_t) (fraction * n + 0.5);
+		if(wanted == 0) {
+			wanted = 1;
+		}
+		uint64_t seen = 0;
+		for(int i = 0; i < BUCKET_COUNT; i++) {
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if(seen >= wanted) {
+				uint64_t value = value_of(i);
+				return value < max() ? value : max();
+			}
+		}
+		return max();
+	}
+};
+
+/*
+ * Per connection counters, updated with relaxed atomics from whichever
+ * thread does the io and sampled from the Godot main thread.
+ */
+struct SocketStats {
+	std::atomic<uint64_t> bytesIn{0};
+	std::atomic<uint64_t> bytesOut{0};
+	std::atomic<uint64_t> messagesIn{0};
+	std::atomic<uint64_t> messagesOut{0};
+	std::atomic<uint64_t> readCalls{0};
+	std::atomic<uint64_t> writeCalls{0};
+	std::atomic<uint64_t> tlsRecordsIn{0};
+	std::atomic<uint64_t> tlsRecordsOut{0};
+	// Bytes read from the socket but not yet handed out as messages.
+	std::atomic<uint64_t> readAheadBytes{0};
+	std::atomic<uint64_t> reconnects{0};
+	// Handshakes that resumed a cached TLS session instead of a full one.
+	std::atomic<uint64_t> resumedSessions{0};
+	// UDP side, see DatagramChannel. Bytes and messages of datagrams also
+	// count in the totals above.
+	std::atomic<uint64_t> datagramsIn{0};
+	std::atomic<uint64_t> datagramsOut{0};
+	std::atomic<uint64_t> staleDatagrams{0};
+	// Truncated, malformed, or not sent because the send buffer was full.
+	std::atomic<uint64_t> droppedDatagrams{0};
+	// Receive calls that returned at least one datagram.
+	std::atomic<uint64_t> datagramReceiveCalls{0};
+	std::atomic<uint64_t> datagramSendCalls{0};
+	// Messages that went over the wire compressed, with their sizes before
+	// and after, see FrameCompressor.
+	std::atomic<uint64_t> compressedMessagesOut{0};
+	std::atomic<uint64_t> compressedMessagesIn{0};
+	std::atomic<uint64_t> uncompressedBytesOut{0};
+	std::atomic<uint64_t> compressedBytesOut{0};
+	std::atomic<uint64_t> uncompressedBytesIn{0};
+	std::atomic<uint64_t> compressedBytesIn{0};
+	// Send thread, see SendQueue. Refused messages were turned away
+	// because the queue was above its high water mark.
+	std::atomic<uint64_t> sendQueueBytes{0};
+	std::atomic<uint64_t> refusedMessages{0};
+
+	Histogram messageSizeIn;
+	Histogram messageSizeOut;
+	// Microseconds spent inside blocking reads and writes.
+	Histogram receiveBlockedUsec;
+	Histogram sendBlockedUsec;
+	Histogram connectUsec;
+	Histogram handshakeUsec;
+	// From calling reconnect until the connection is usable again,
+	// including backoff between failed attempts.
+	Histogram reconnectUsec;
+	// Nanoseconds spent compressing or decompressing one message.
+	Histogram compressNsec;
+	Histogram decompressNsec;
+	// Receive latency by stage when timestamps are on, see FrameTimestamps.
+	// Kernel to read is time spent in the socket buffer and decrypting,
+	// read to decode waiting for the rest of the message, and decode to
+	// deliver waiting in the receive queue or for the game to ask.
+	Histogram kernelToReadUsec;
+	Histogram readToDecodeUsec;
+	Histogram decodeToDeliverUsec;
+	Histogram kernelToDeliverUsec;
+	// Time messages waited in each lane of the send queue.
+	Histogram inputQueueUsec;
+	Histogram gameplayQueueUsec;
+	Histogram bulkQueueUsec;
+
+	void reset()
+	{
+		bytesIn = 0;
+		bytesOut = 0;
+		messagesIn = 0;
+		messagesOut = 0;
+		readCalls = 0;
+		writeCalls = 0;
+		tlsRecordsIn = 0;
+		tlsRecordsOut = 0;
+		reconnects = 0;
+		resumedSessions = 0;
+		datagramsIn = 0;
+		datagramsOut = 0;
+		staleDatagrams = 0;
+		droppedDatagrams = 0;
+		datagramReceiveCalls = 0;
+		datagramSendCalls = 0;
+		compressedMessagesOut = 0;
+		compressedMessagesIn = 0;
+		uncompressedBytesOut = 0;
+		compressedBytesOut = 0;
+		uncompressedBytesIn = 0;
+		compressedBytesIn = 0;
+		refusedMessages = 0;
+		messageSizeIn.reset();
+		messageSizeOut.reset();
+		receiveBlockedUsec.reset();
+		sendBlockedUsec.reset();
+		connectUsec.reset();
+		handshakeUsec.reset();
+		reconnectUsec.reset();
+		compressNsec.reset();
+		decompressNsec.reset();
+		kernelToReadUsec.reset();
+		readToDecodeUsec.reset();
+		decodeToDeliverUsec.reset();
+		kernelToDeliverUsec.reset();
+		inputQueueUsec.reset();
+		gameplayQueueUsec.reset();
+		bulkQueueUsec.reset();
+	}
+};
+
+inline void count(std::atomic<uint64_t>& counter, uint64_t amount = 1)
+{
+	counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+// Measures the lifetime of the object in microseconds into a histogram.
+class ScopedTimer {
+private:
+	Histogram& histogram;
+	std::chrono::steady_clock::time_point start;
+public:
+	explicit ScopedTimer(Histogram& target) :
+		histogram(target),
+		start(std::chrono::steady_clock::now()) {}
+
+	~ScopedTimer()
+	{
+		histogram.record(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	}
+};
+
+#endif
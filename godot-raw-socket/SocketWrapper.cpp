@@ -1,174 +1,2950 @@
 #include "SocketWrapper.hpp"
-#include <GodotGlobal.hpp>
 
-#include <iostream>
+#include "DatagramChannel.hpp"
+#include "SharedRing.hpp"
+#include "TlsContext.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#endif
 
 #define NON_BLOCKING_RECEIVE_FLAGS 0
 
 using namespace boost::asio;
 using error_code = boost::system::error_code;
 
-using std::cout;
-using std::endl;
+/*
+ * TLS run by OpenSSL straight on the socket instead of through the
+ * memory buffers of the asio ssl stream, see open_connection. It offers
+ * read_some and write_some like a stream, so the asio read and write
+ * algorithms work on it. Once the keys are in the kernel, application
+ * data goes through the socket as plaintext and OpenSSL only handles
+ * the other records.
+ */
+struct DirectTls {
+	SSL* ssl = nullptr;
+	ip::tcp::socket* socket = nullptr;
+	bool kernelSend = false;
+	bool kernelReceive = false;
+
+	size_t result(int returned, error_code& error)
+	{
+		if(returned > 0) {
+			error = error_code();
+			return (size_t) returned;
+		}
+		switch(SSL_get_error(ssl, returned)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			error = error::would_block;
+			break;
+		case SSL_ERROR_ZERO_RETURN:
+			error = error::eof;
+			break;
+		case SSL_ERROR_SYSCALL:
+			error = errno != 0 ? error_code(errno, boost::system::system_category()) : error_code(error::eof);
+			break;
+		default:
+			error = error_code((int) ERR_get_error(), error::get_ssl_category());
+			break;
+		}
+		return 0;
+	}
+
+	size_t read_record(char* destination, size_t maxBytes, error_code& error)
+	{
+		ERR_clear_error();
+		errno = 0;
+		return result(SSL_read(ssl, destination, (int) std::min<size_t>(maxBytes, INT_MAX)), error);
+	}
+
+	/*
+	 * SSL_read hands out a single record, records OpenSSL already took
+	 * off the socket with the same read are decrypted right after it
+	 * without waiting, so one call returns a whole burst.
+	 */
+	template<typename MutableBufferSequence>
+	size_t read_some(const MutableBufferSequence& buffers, error_code& error)
+	{
+		mutable_buffer buffer = *buffer_sequence_begin(buffers);
+		if(kernelReceive) {
+			size_t received = socket->read_some(buffer, error);
+			// Records other than application data fail a plain read.
+			if(error != boost::system::errc::io_error) {
+				return received;
+			}
+		}
+
+		char* destination = (char*) buffer.data();
+		size_t received = read_record(destination, buffer.size(), error);
+		bool wasBlocking = !socket->non_blocking();
+		error_code ignored;
+		while(!error && received < buffer.size() && (SSL_pending(ssl) > 0 || SSL_has_pending(ssl))) {
+			if(wasBlocking) {
+				socket->non_blocking(true, ignored);
+			}
+			error_code more;
+			size_t next = read_record(destination + received, buffer.size() - received, more);
+			if(more) {
+				break;
+			}
+			received += next;
+		}
+		if(wasBlocking && socket->non_blocking()) {
+			socket->non_blocking(false, ignored);
+		}
+		return received;
+	}
+
+	template<typename ConstBufferSequence>
+	size_t write_some(const ConstBufferSequence& buffers, error_code& error)
+	{
+		if(kernelSend) {
+			return socket->write_some(buffers, error);
+		}
+		const_buffer buffer = *buffer_sequence_begin(buffers);
+		ERR_clear_error();
+		errno = 0;
+		return result(SSL_write(ssl, buffer.data(), (int) std::min<size_t>(buffer.size(), INT_MAX)), error);
+	}
+};
+
+// How long a wait on the shared ring sleeps before it checks the socket.
+static const int RING_WAIT_MS = 50;
+
+/*
+ * The shared memory ring of a local connection, see SharedRing. It
+ * offers read_some and write_some like the socket it stands in for, and
+ * follows the blocking mode of that socket, which stays connected only
+ * to tell when the peer is gone. shutdown wakes a thread waiting on the
+ * ring like shutting down the socket wakes one waiting on it.
+ */
+struct RingStream {
+	SharedRing ring;
+	ip::tcp::socket* socket = nullptr;
+	std::atomic<bool> receiveShut{false};
+	std::atomic<bool> sendShut{false};
+
+	bool closed(bool forWrite, error_code& error)
+	{
+		if(forWrite ? sendShut : receiveShut) {
+			error = error::shut_down;
+			return true;
+		}
+		if(ring.peer_closed()) {
+			error = forWrite ? error_code(error::broken_pipe) : error_code(error::eof);
+			return true;
+		}
+#if defined(__linux__)
+		// A peer that died without closing the ring only shows on the
+		// socket.
+		char peeked;
+		ssize_t result = recv(socket->native_handle(), &peeked, 1, MSG_PEEK | MSG_DONTWAIT);
+		if(result == 0 || (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			error = result == 0 ? error_code(error::eof) : error_code(errno, boost::system::system_category());
+			return true;
+		}
+#endif
+		return false;
+	}
+
+	// Waits for bytes to read, or room to write, until the stream closed.
+	bool wait(bool forWrite, error_code& error)
+	{
+		while(forWrite ? ring.writable() == 0 : ring.readable() == 0) {
+			if(closed(forWrite, error)) {
+				return false;
+			}
+			if(forWrite) {
+				ring.wait_writable(RING_WAIT_MS);
+			} else {
+				ring.wait_readable(RING_WAIT_MS);
+			}
+		}
+		return true;
+	}
+
+	void shutdown(socket_base::shutdown_type what)
+	{
+		if(what != socket_base::shutdown_send) {
+			receiveShut = true;
+		}
+		if(what != socket_base::shutdown_receive) {
+			sendShut = true;
+		}
+		ring.interrupt();
+	}
+
+	template<typename MutableBufferSequence>
+	size_t read_some(const MutableBufferSequence& buffers, error_code& error)
+	{
+		mutable_buffer buffer = *buffer_sequence_begin(buffers);
+		error = error_code();
+		while(buffer.size() > 0) {
+			size_t received = ring.read((char*) buffer.data(), buffer.size());
+			if(received > 0) {
+				return received;
+			}
+			if(socket->non_blocking()) {
+				if(!closed(false, error)) {
+					error = error::would_block;
+				}
+				return 0;
+			}
+			if(!wait(false, error)) {
+				return 0;
+			}
+		}
+		return 0;
+	}
+
+	template<typename ConstBufferSequence>
+	size_t write_some(const ConstBufferSequence& buffers, error_code& error)
+	{
+		error = error_code();
+		if(buffer_size(buffers) == 0) {
+			return 0;
+		}
+		while(true) {
+			if(sendShut || ring.peer_closed()) {
+				closed(true, error);
+				return 0;
+			}
+			size_t written = 0;
+			for(auto it = buffer_sequence_begin(buffers); it != buffer_sequence_end(buffers); ++it) {
+				const_buffer buffer = *it;
+				size_t copied = ring.stage((const char*) buffer.data(), buffer.size());
+				written += copied;
+				if(copied < buffer.size()) {
+					break;
+				}
+			}
+			if(written > 0) {
+				ring.commit();
+				return written;
+			}
+			if(socket->non_blocking()) {
+				if(!closed(true, error)) {
+					error = error::would_block;
+				}
+				return 0;
+			}
+			if(!wait(true, error)) {
+				return 0;
+			}
+		}
+	}
+};
+
+/*
+ * Everything a single connection needs from boost. Each SocketWrapper
+ * owns one, so multiple Socket nodes never share a stream.
+ * The io context is either private to the connection or borrowed from
+ * the owner of a shared context, see SocketWrapper(io_context&).
+ */
+struct Connection {
+	std::unique_ptr<io_context> ownContext;
+	io_context& ioContext;
+	std::shared_ptr<ssl::context> sslContext;
+	ip::tcp::socket tcpSocket;
+	std::unique_ptr<ssl::stream<ip::tcp::socket>> secureSocket;
+	// Set up instead of using the stream when kernel tls was asked for.
+	std::unique_ptr<DirectTls> directTls;
+	TlsPath tlsPath = TlsPath::None;
+
+	// Where the last connect went, kept for reconnect. localPath is set
+	// for unix: addresses, the ring only when it was asked for.
+	std::string localPath;
+	std::unique_ptr<RingStream> ringStream;
+	std::string hostname;
+	std::string sessionKey;
+	// Whether the handshake under way offered a cached session.
+	bool sessionOffered = false;
+	ip::tcp::resolver::results_type endpoints;
+
+	// Messages sent in one write over ssl are packed in here first.
+	std::vector<char> sendScratch;
+
+	// Opened by open_datagrams, next to the stream.
+	std::unique_ptr<DatagramChannel> datagrams;
+
+	// Serializes reads and writes on the ssl stream, which unlike a plain
+	// socket can not be read and written from two threads at once.
+	std::mutex streamMutex;
+
+	Connection() :
+		ownContext(new io_context()),
+		ioContext(*ownContext),
+		sslContext(client_ssl_context()),
+		tcpSocket(ioContext) {}
+
+	explicit Connection(io_context& sharedContext) :
+		ioContext(sharedContext),
+		sslContext(client_ssl_context()),
+		tcpSocket(ioContext) {}
+};
+
+SocketWrapper::SocketWrapper() : connection(new Connection())
+{
+}
+
+SocketWrapper::SocketWrapper(io_context& sharedContext) :
+	connection(new Connection(sharedContext))
+{
+}
+
+SocketWrapper::~SocketWrapper()
+{
+	stop_connect_thread();
+	stop_send_thread();
+	stop_receive_thread();
+	drop_connection();
+}
+
+static uint64_t usec_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t nsec_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+static ip::tcp::socket::lowest_layer_type& stream_socket(Connection& c, bool sslEnabled)
+{
+	return sslEnabled ? c.secureSocket->lowest_layer() : c.tcpSocket.lowest_layer();
+}
+
+/*
+ * Whether the ssl stream holds bytes a read returns without touching the
+ * socket: records already decrypted, or encrypted bytes an earlier read
+ * took off the socket along with the record it needed.
+ */
+static bool ssl_buffered(ssl::stream<ip::tcp::socket>& stream)
+{
+	SSL* ssl = stream.native_handle();
+	return SSL_pending(ssl) > 0 || SSL_has_pending(ssl) || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+}
+
+// Runs f on the tls stream in use, the asio one or the direct one.
+template<typename Function>
+static auto with_secure_stream(Connection& c, Function f)
+{
+	if(c.directTls) {
+		return f(*c.directTls);
+	}
+	return f(*c.secureSocket);
+}
+
+// Runs f on the plain stream in use, the socket or the shared ring.
+template<typename Function>
+static auto with_plain_stream(Connection& c, Function f)
+{
+	if(c.ringStream) {
+		return f(*c.ringStream);
+	}
+	return f(c.tcpSocket);
+}
 
 /*
- * Normally it is bad practice to put variables like this
- * outside the class in a C++ project. But because of 
- * issues with the Godot includes breaking the boost
- * includes, having these as class members is not
- * possible. Someone with better knowledge about C++ and
- * boost should probably look into this.
- *
- * Implications of putting variables here is that MULTIPLE
- * INSTANCES of SocketWrapper class WILL NOT WORK.
- * In practice this is not as problem as long as the code
- * is only used as a client.
+ * Blocks until the socket is ready for type. socket.wait gives up with
+ * would_block while the socket is switched to non blocking, which
+ * read_secure and write_secure do from the other thread for as long as
+ * they hold the stream mutex, so this waits on the descriptor itself.
  */
-boost::asio::io_service ioService;
-boost::asio::io_context ioContext;
-ssl::context sslContext(ssl::context::tls);
-ip::tcp::socket tcpSocket(ioService);
-ssl::stream<ip::tcp::socket> secureSocket(ioContext, sslContext);
+static void wait_socket(ip::tcp::socket::lowest_layer_type& socket, socket_base::wait_type type, error_code& error)
+{
+	namespace socket_ops = boost::asio::detail::socket_ops;
+	do {
+		error = error_code();
+		if(type == socket_base::wait_read) {
+			socket_ops::poll_read(socket.native_handle(), 0, -1, error);
+		} else if(type == socket_base::wait_write) {
+			socket_ops::poll_write(socket.native_handle(), 0, -1, error);
+		} else {
+			socket_ops::poll_error(socket.native_handle(), 0, -1, error);
+		}
+	} while(error == error::interrupted);
+}
+
+static void shutdown_stream(Connection& c, bool sslEnabled, socket_base::shutdown_type what)
+{
+	error_code ignored;
+	if(c.ringStream) {
+		c.ringStream->shutdown(what);
+	}
+	stream_socket(c, sslEnabled).shutdown(what, ignored);
+}
+
+static const char LOCAL_PREFIX[] = "unix:";
+static const size_t LOCAL_PREFIX_SIZE = sizeof(LOCAL_PREFIX) - 1;
+
+static bool local_address(const char* hostname)
+{
+	return strncmp(hostname, LOCAL_PREFIX, LOCAL_PREFIX_SIZE) == 0;
+}
+
+// The ssl stream only exists once connected.
+static bool stream_open(Connection& c, bool sslEnabled)
+{
+	return sslEnabled ? c.secureSocket && c.secureSocket->lowest_layer().is_open() : c.tcpSocket.is_open();
+}
+
+// Delimiters only frame the stream, datagrams carry the default header.
+static FrameFormat datagram_format(FrameFormat format)
+{
+	return format == FrameFormat::Delimited ? FrameFormat::U16BE : format;
+}
 
 int SocketWrapper::connect(const char* hostname, int port)
 {
+	Connection& c = *connection;
+	stop_connect_thread();
+	// The threads would read and write the stream being replaced.
+	stop_send_thread();
+	stop_receive_thread();
+	drop_connection();
+	keepReceiveThread = false;
+	keepSendThread = false;
+	auto start = std::chrono::steady_clock::now();
+	if(local_address(hostname)) {
+		set_local_target(hostname);
+		return open_connection(start);
+	}
 	try {
-		std::string portAsString = std::to_string(port);
-		ip::tcp::resolver resolver(ioService);
-		auto endpoints = resolver.resolve(hostname, portAsString);
+		ip::tcp::resolver resolver(c.ioContext);
+		c.endpoints = resolver.resolve(hostname, std::to_string(port));
+	} catch(boost::system::system_error &error) {
+		return connect_failed(error.code(), port);
+	}
+	c.localPath.clear();
+	c.hostname = hostname;
+	c.sessionKey = c.hostname + ":" + std::to_string(port);
+	return open_connection(start);
+}
 
-		if(sslEnabled) {
-			boost::asio::connect(secureSocket.next_layer(), endpoints);
-			secureSocket.set_verify_mode(ssl::verify_none);
-			secureSocket.handshake(ssl::stream_base::client);
+/*
+ * Connects to the endpoints of the last resolve and runs the handshake,
+ * offering the cached session of the host if there is one.
+ */
+int SocketWrapper::open_connection(std::chrono::steady_clock::time_point start)
+{
+	Connection& c = *connection;
+	int port = c.endpoints.empty() ? 0 : c.endpoints.begin()->endpoint().port();
+	reset_stream();
+
+	try {
+		if(c.localPath.empty()) {
+			boost::asio::connect(fresh_socket(), c.endpoints);
 		} else {
-			boost::asio::connect(tcpSocket, endpoints);
+			open_local(fresh_socket());
 		}
-
-		if(blocking == false) {
-			boost::system::error_code ec;
-			secureSocket.native_non_blocking(true, ec);
+		stats.connectUsec.record(usec_since(start));
+		if(sslEnabled) {
+			ScopedTimer handshakeTimer(stats.handshakeUsec);
+			handshake(std::chrono::steady_clock::time_point::max());
 		}
-		
-	} catch(error_code &error) {
-		cout << "Connect failed: " << error.message() << endl;
-		lastError = error;
-		return 1;
+		apply_socket_options();
+	} catch(boost::system::system_error &error) {
+		return connect_failed(error.code(), port);
 	}
 
+	SOCKET_TRACE_EVENT(trace, TRACE_CONNECT, sslEnabled, port);
 	return 0;
 }
 
-void SocketWrapper::close()
+/*
+ * Connects to a unix: address, a path of an AF_UNIX stream socket. The
+ * reads, writes and waits of the stream only use the descriptor, which
+ * works the same for a local socket, so the connected socket is handed
+ * to the tcp socket the rest of the code uses, which only skips the TCP
+ * options for it, see apply_socket_options. With sharedRingSize set
+ * the messages then go through a SharedRing instead of the socket.
+ */
+void SocketWrapper::set_local_target(const std::string& address)
 {
-	if(sslEnabled) {
-		secureSocket.shutdown();
+	Connection& c = *connection;
+	c.localPath = address.substr(LOCAL_PREFIX_SIZE);
+	c.hostname = address;
+	c.sessionKey = address;
+	c.endpoints = ip::tcp::resolver::results_type();
+}
+
+void SocketWrapper::open_local(ip::tcp::socket& target)
+{
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	Connection& c = *connection;
+	if(sharedRingSize > 0 && (sslEnabled || !SharedRing::supported())) {
+		throw boost::system::system_error(error::operation_not_supported);
+	}
+
+	local::stream_protocol::socket socket(c.ioContext);
+	socket.connect(local::stream_protocol::endpoint(c.localPath));
+	target.assign(ip::tcp::v4(), socket.release());
+
+	if(sharedRingSize > 0) {
+		std::unique_ptr<RingStream> ringStream(new RingStream());
+		ringStream->socket = &target;
+		if(ringStream->ring.create((int) target.native_handle(), sharedRingSize) == -1) {
+			error_code error(errno, boost::system::system_category());
+			error_code ignored;
+			target.close(ignored);
+			throw boost::system::system_error(error);
+		}
+		c.ringStream = std::move(ringStream);
+	}
+#else
+	throw boost::system::system_error(error::operation_not_supported);
+#endif
+}
+
+void SocketWrapper::reset_stream()
+{
+	// Bytes left over from an earlier connection belong to another stream.
+	readAhead.consume(readAhead.size());
+	scannedBytes = 0;
+	parseState = ParseState::Header;
+	// A message half read belongs to the old connection, as does the
+	// delimiter still to skip after it. The send queue only ever holds
+	// whole messages, see send_loop, so they start the new stream cleanly.
+	pendingTrailer = 0;
+	sessionResumed = false;
+	connection->directTls.reset();
+	connection->tlsPath = TlsPath::None;
+	connection->ringStream.reset();
+}
+
+// The socket the next connection goes through, closed.
+ip::tcp::socket& SocketWrapper::fresh_socket()
+{
+	Connection& c = *connection;
+	if(!sslEnabled) {
+		error_code ignored;
+		c.tcpSocket.close(ignored);
+		return c.tcpSocket;
+	}
+
+	// An ssl stream can not be reused after shutdown, so every connect
+	// gets a fresh one.
+	c.secureSocket.reset(new ssl::stream<ip::tcp::socket>(c.ioContext, *c.sslContext));
+	SSL* ssl = c.secureSocket->native_handle();
+	SSL_set_msg_callback(ssl, count_tls_records);
+	SSL_set_msg_callback_arg(ssl, &stats);
+	c.sessionOffered = prepare_client_session(ssl, c.hostname, c.sessionKey);
+	return c.secureSocket->next_layer();
+}
+
+/*
+ * Runs the tls handshake on the connected socket. Without a deadline it
+ * blocks like any other read, with one it gives up with timed_out.
+ */
+void SocketWrapper::handshake(std::chrono::steady_clock::time_point deadline)
+{
+	Connection& c = *connection;
+	SSL* ssl = c.secureSocket->native_handle();
+	c.secureSocket->set_verify_mode(ssl::verify_none);
+
+	if(kernelTls) {
+		handshake_direct(deadline);
+	} else if(deadline == std::chrono::steady_clock::time_point::max()) {
+		c.secureSocket->handshake(ssl::stream_base::client);
+		c.tlsPath = TlsPath::Stream;
 	} else {
-		tcpSocket.shutdown(ip::tcp::socket::shutdown_both);
+		bool done = false;
+		error_code error;
+		c.secureSocket->async_handshake(ssl::stream_base::client, [&](const error_code& result) {
+			error = result;
+			done = true;
+		});
+		if(!run_until(done, deadline)) {
+			error_code ignored;
+			c.secureSocket->lowest_layer().close(ignored);
+			drain_context();
+			error = connectCancelled ? error::operation_aborted : error::timed_out;
+		}
+		if(error) {
+			throw boost::system::system_error(error);
+		}
+		c.secureSocket->lowest_layer().non_blocking(false, error);
+		c.tlsPath = TlsPath::Stream;
+	}
+
+	// Only a session that was offered counts, not a full handshake.
+	sessionResumed = c.sessionOffered && SSL_session_reused(ssl) == 1;
+	if(sessionResumed) {
+		count(stats.resumedSessions);
+	}
+}
+
+void SocketWrapper::apply_socket_options()
+{
+	// Messages are already coalesced into single writes, so waiting for
+	// more data to fill a segment only adds latency. A unix socket only
+	// wears the tcp socket type, it has no TCP options to set.
+	if(noDelay && connection->localPath.empty()) {
+		error_code ignored;
+		stream_socket(*connection, sslEnabled).set_option(ip::tcp::no_delay(true), ignored);
+	}
+	if(timestampsEnabled) {
+		enable_kernel_timestamps();
 	}
 }
 
-int SocketWrapper::receive(int numBytes)
+/*
+ * Runs the handshake with OpenSSL reading and writing the socket itself,
+ * which the kernel tls offload needs: OpenSSL hands the keys to the
+ * kernel as soon as they are negotiated, when the kernel has the tls
+ * module and supports the cipher. Otherwise the connection stays in
+ * userspace, where OpenSSL reads ahead as much as the socket has and
+ * decrypts whole records straight into the read ahead buffer, instead of
+ * going through the buffers of the asio stream.
+ */
+void SocketWrapper::handshake_direct(std::chrono::steady_clock::time_point deadline)
 {
+	Connection& c = *connection;
+	std::unique_ptr<DirectTls> direct(new DirectTls());
+	direct->ssl = c.secureSocket->native_handle();
+	direct->socket = &c.secureSocket->next_layer();
+
+#if defined(SSL_OP_ENABLE_KTLS)
+	SSL_set_options(direct->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+	SSL_set_read_ahead(direct->ssl, 1);
+	SSL_set_mode(direct->ssl, SSL_MODE_AUTO_RETRY);
+	SSL_clear_mode(direct->ssl, SSL_MODE_RELEASE_BUFFERS);
+	// Replaces the memory buffers of the stream, which is not used for
+	// reading or writing from here on.
+	SSL_set_fd(direct->ssl, (int) direct->socket->native_handle());
+
+	// Without blocking, so the handshake can give up at the deadline.
 	error_code error;
+	direct->socket->non_blocking(true, error);
+	while(!error) {
+		ERR_clear_error();
+		errno = 0;
+		int result = SSL_connect(direct->ssl);
+		if(result == 1) {
+			break;
+		}
+		int reason = SSL_get_error(direct->ssl, result);
+		if(reason != SSL_ERROR_WANT_READ && reason != SSL_ERROR_WANT_WRITE) {
+			direct->result(result, error);
+			break;
+		}
+		wait_until(*direct->socket, reason == SSL_ERROR_WANT_READ ? socket_base::wait_read : socket_base::wait_write,
+			deadline, error);
+	}
+	if(error) {
+		throw boost::system::system_error(error);
+	}
+	// Also clears the non blocking mode asio sets for its own waits, the
+	// reads and writes of OpenSSL have to block.
+	direct->socket->non_blocking(false, error);
 
-	if(sslEnabled) {
-		read(secureSocket, buffer, transfer_exactly(numBytes), error);
+	// OpenSSL before 3.0 has neither, the records then stay in userspace.
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+	direct->kernelSend = BIO_get_ktls_send(SSL_get_wbio(direct->ssl)) != 0;
+	direct->kernelReceive = BIO_get_ktls_recv(SSL_get_rbio(direct->ssl)) != 0;
+#endif
+	if(direct->kernelSend && direct->kernelReceive) {
+		c.tlsPath = TlsPath::Kernel;
+	} else if(direct->kernelSend) {
+		c.tlsPath = TlsPath::KernelSend;
 	} else {
-		read(tcpSocket, buffer, transfer_exactly(numBytes), error);
+		c.tlsPath = TlsPath::Userspace;
 	}
+	c.directTls = std::move(direct);
+}
 
-	if(error && error != error::eof ) {
-		cout << "receive failed: " << error.message() << endl;
-		lastError = error;
-		return -1;
+const char* SocketWrapper::transport() const
+{
+	if(connectThread.joinable()) {
+		return "none";
 	}
+	if(connection->ringStream) {
+		return "shared_memory";
+	}
+	return connection->localPath.empty() ? "tcp" : "unix";
+}
 
-	return numBytes;
+TlsPath SocketWrapper::tls_path() const
+{
+	if(connectThread.joinable()) {
+		return TlsPath::None;
+	}
+	return connection->tlsPath;
 }
 
-const int SocketWrapper::receive_ushort(unsigned short &header)
+const char* tls_path_name(TlsPath path)
 {
-	int numBytes = sizeof(unsigned short);
-	buffer.prepare(numBytes);
-	int result = receive(numBytes);
+	switch(path) {
+	case TlsPath::None:
+		return "none";
+	case TlsPath::Stream:
+		return "stream";
+	case TlsPath::Userspace:
+		return "userspace";
+	case TlsPath::KernelSend:
+		return "kernel_send";
+	case TlsPath::Kernel:
+		return "kernel";
+	}
+	return "none";
+}
 
-	if(result == -1) {
+/*
+ * Turns tracing on with a ring of capacity records. The threads of the
+ * connection record without a lock, so the ring is only reallocated for
+ * another capacity while none of them runs, otherwise tracing goes on
+ * into the ring there is and -1 is returned.
+ */
+int SocketWrapper::enable_trace(size_t capacity)
+{
+	bool threadsRunning = receiveThread.joinable() || sendThread.joinable() || connectThread.joinable();
+	if(!trace.enable(capacity, !threadsRunning)) {
+		lastError = error::in_progress;
 		return -1;
 	}
+	return 0;
+}
 
-	header = *buffer_cast<const unsigned short*>(buffer.data());
+int SocketWrapper::connect_failed(const error_code& error, int port)
+{
+	(void) port;
+	SOCKET_TRACE_EVENT(trace, TRACE_CONNECT_FAILED, error.value(), port);
+	lastError = error;
+	return 1;
+}
 
-	// char debug_msg[128];
-	// sprintf(debug_msg, "Received 2 byte ushort %i.", *data);
-	// godot::Godot::print(debug_msg);
-	buffer.consume(numBytes);
+// How often waits of the connect thread look for a cancel.
+static const std::chrono::milliseconds CONNECT_POLL_INTERVAL(10);
 
-	// sprintf(debug_msg, "Received 2 byte ushort %i (after consume).", *data);
-	// godot::Godot::print(debug_msg);
-	// header = data;
-	return result;
+/*
+ * Connects like connect, but on a thread of its own: the caller returns
+ * right away and picks up the outcome with poll_connect, from _process.
+ * Each phase has its own limit, see ConnectTimeouts, and the addresses
+ * the host resolves to are raced, see race_endpoints. close and the
+ * other connects cancel a connect still running.
+ * The phases run on the io context of the connection, so this needs one
+ * of its own. Returns 0 when started, 1 with a shared context.
+ */
+int SocketWrapper::connect_async(const char* hostname, int port)
+{
+	Connection& c = *connection;
+	stop_connect_thread();
+	if(!c.ownContext) {
+		lastError = error::operation_not_supported;
+		return 1;
+	}
+
+	// The threads would read and write the stream being replaced.
+	stop_send_thread();
+	stop_receive_thread();
+	drop_connection();
+	keepReceiveThread = false;
+	keepSendThread = false;
+
+	connectDone = false;
+	connectCancelled = false;
+	reconnecting = false;
+	connectThread = std::thread(&SocketWrapper::connect_loop, this, std::string(hostname), port);
+	return 0;
 }
 
-int SocketWrapper::receive_bytes(int numBytes, char* byte_buffer)
+bool SocketWrapper::is_connecting() const
 {
-	buffer.prepare(numBytes);
-	int result = receive(numBytes);
+	return connectThread.joinable();
+}
 
-	if(result != -1) {
-		memcpy(byte_buffer, buffer_cast<const char*>(buffer.data()), numBytes);
-		//byte_buffer = (char*) buffer_cast<const char*>(buffer.data());
-		for(int i = 0; i < numBytes; i++) {
-			cout << byte_buffer[i];
-		}
-		cout << endl;
-		buffer.consume(numBytes);
-	} else {
-		char debug_msg[128];
-		sprintf(debug_msg, "receive_bytes: Failed receiving %i bytes!", numBytes);
-		cout << debug_msg << endl;
+bool SocketWrapper::poll_connect(ConnectReport& report)
+{
+	if(!connectThread.joinable() || !connectDone) {
+		return false;
 	}
-	return result;
+	connectThread.join();
+	report = connectReport;
+	if(report.result != 0) {
+		lastError = report.error;
+	} else if(reconnecting) {
+		restart_threads();
+	}
+	reconnecting = false;
+	return true;
 }
 
-int SocketWrapper::send_ushort(unsigned short ushort)
+void SocketWrapper::stop_connect_thread()
+{
+	if(connectThread.joinable()) {
+		connectCancelled = true;
+		connectThread.join();
+	}
+	reconnecting = false;
+}
+
+/*
+ * The connect thread owns the connection until poll_connect joins it,
+ * so I/O on it fails with not_connected before that.
+ */
+bool SocketWrapper::refuse_while_connecting()
 {
+	if(connectThread.joinable()) {
+		lastError = error::not_connected;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The lookup of a connect_async. getaddrinfo can not be interrupted, so
+ * it runs on a thread of its own which is left behind to finish on its
+ * own when it takes longer than the timeout.
+ */
+struct PendingResolve {
+	std::mutex mutex;
+	std::condition_variable resolved;
+	bool finished = false;
 	error_code error;
-	ushort = htons(ushort);
+	ip::tcp::resolver::results_type endpoints;
+};
 
-	if(sslEnabled) {
-		boost::asio::write(secureSocket, boost::asio::buffer(&ushort, 2), transfer_all(), error); 
-	} else {
-		boost::asio::write(tcpSocket, boost::asio::buffer(&ushort, 2), transfer_all(), error);
+static error_code resolve_until(const std::string& hostname, int port,
+	std::chrono::steady_clock::time_point deadline, const std::atomic<bool>& cancelled,
+	ip::tcp::resolver::results_type& endpoints)
+{
+	auto pending = std::make_shared<PendingResolve>();
+	std::thread([pending, hostname, port]() {
+		io_context context;
+		ip::tcp::resolver resolver(context);
+		error_code error;
+		auto endpoints = resolver.resolve(hostname, std::to_string(port), error);
+		std::lock_guard<std::mutex> lock(pending->mutex);
+		pending->error = error;
+		pending->endpoints = endpoints;
+		pending->finished = true;
+		pending->resolved.notify_one();
+	}).detach();
+
+	std::unique_lock<std::mutex> lock(pending->mutex);
+	while(!pending->finished) {
+		auto now = std::chrono::steady_clock::now();
+		if(cancelled) {
+			return error::operation_aborted;
+		}
+		if(now >= deadline) {
+			return error::timed_out;
+		}
+		pending->resolved.wait_until(lock, std::min(deadline, now + CONNECT_POLL_INTERVAL));
 	}
+	if(!pending->error && pending->endpoints.empty()) {
+		return error::host_not_found;
+	}
+	endpoints = pending->endpoints;
+	return pending->error;
+}
 
-	cout << "sent ushort: " << error.message() << endl;
+void SocketWrapper::connect_loop(std::string hostname, int port)
+{
+	Connection& c = *connection;
+	ConnectReport report;
+	auto start = std::chrono::steady_clock::now();
 
-	if(error && error != error::eof ) {
-		cout << "send failed: " << error.message() << endl;
-		lastError = error;
-		return -1;
+	ip::tcp::resolver::results_type endpoints;
+	error_code error;
+	if(local_address(hostname.c_str())) {
+		// Nothing to resolve, and nothing to race.
+		set_local_target(hostname);
+	} else {
+		error = resolve_until(hostname, port,
+			start + std::chrono::milliseconds(connectTimeouts.resolveMs), connectCancelled, endpoints);
+		report.resolveUsec = usec_since(start);
+		if(!error) {
+			// Only a host that resolved is kept for reconnect.
+			c.localPath.clear();
+			c.endpoints = endpoints;
+			c.hostname = hostname;
+			c.sessionKey = c.hostname + ":" + std::to_string(port);
+		}
 	}
 
-	return 0;
+	if(!error) {
+		error = connect_phases(start, report);
+	}
+	if(!error) {
+		SOCKET_TRACE_EVENT(trace, TRACE_CONNECT, sslEnabled, port);
+	} else {
+		SOCKET_TRACE_EVENT(trace, TRACE_CONNECT_FAILED, error.value(), port);
+	}
+	report.result = error ? 1 : 0;
+	report.error = error;
+	report.totalUsec = usec_since(start);
+	connectReport = report;
+	connectDone = true;
 }
 
-int SocketWrapper::send_bytes(const char* bytes, int numBytes)
+/*
+ * The connect and handshake phases of connect_loop and reconnect_loop,
+ * to the addresses or the local path of the last resolve. start is when
+ * the whole connect started. A connection that failed is dropped.
+ */
+error_code SocketWrapper::connect_phases(std::chrono::steady_clock::time_point start, ConnectReport& report)
 {
+	Connection& c = *connection;
 	error_code error;
-	if(sslEnabled) {
-		boost::asio::write(secureSocket, boost::asio::buffer(bytes, numBytes), transfer_all(), error); 
+	reset_stream();
+
+	report.phase = "connect";
+	auto connectStart = std::chrono::steady_clock::now();
+	if(!c.localPath.empty()) {
+		report.address = c.localPath;
+		report.attempts = 1;
+		try {
+			open_local(fresh_socket());
+		} catch(boost::system::system_error &localError) {
+			error = localError.code();
+		}
 	} else {
-		boost::asio::write(tcpSocket, boost::asio::buffer(bytes, numBytes), transfer_all(), error);
+		error = race_endpoints(connectStart + std::chrono::milliseconds(connectTimeouts.connectMs), report);
+	}
+	report.connectUsec = usec_since(connectStart);
+	if(!error) {
+		stats.connectUsec.record(usec_since(start));
 	}
 
-	 cout << "sent bytes: " << error.message() << endl;
+	if(!error && sslEnabled) {
+		report.phase = "handshake";
+		auto handshakeStart = std::chrono::steady_clock::now();
+		try {
+			handshake(handshakeStart + std::chrono::milliseconds(connectTimeouts.handshakeMs));
+		} catch(boost::system::system_error &handshakeError) {
+			error = handshakeError.code();
+		}
+		report.handshakeUsec = usec_since(handshakeStart);
+		if(!error) {
+			stats.handshakeUsec.record(report.handshakeUsec);
+		}
+	}
 
-	if(error && error != error::eof ) {
-		cout << "send failed: " << error.message() << endl;
-		lastError = error;
-		return -1;
+	if(!error) {
+		apply_socket_options();
+	} else {
+		drop_connection();
 	}
+	return error;
+}
 
-	return 0;
-}
\ No newline at end of file
+/*
+ * Orders the addresses of a host so the address families take turns,
+ * starting with the family of the first one, as in RFC 8305.
+ */
+static std::vector<ip::tcp::endpoint> interleave_families(const ip::tcp::resolver::results_type& results)
+{
+	std::vector<ip::tcp::endpoint> preferred;
+	std::vector<ip::tcp::endpoint> other;
+	bool preferV6 = results.begin()->endpoint().address().is_v6();
+	for(const auto& entry : results) {
+		(entry.endpoint().address().is_v6() == preferV6 ? preferred : other).push_back(entry.endpoint());
+	}
+
+	std::vector<ip::tcp::endpoint> order;
+	for(size_t i = 0; i < preferred.size() || i < other.size(); i++) {
+		if(i < preferred.size()) {
+			order.push_back(preferred[i]);
+		}
+		if(i < other.size()) {
+			order.push_back(other[i]);
+		}
+	}
+	return order;
+}
+
+/*
+ * Happy Eyeballs: connects to the addresses of the last resolve one after
+ * the other, but without waiting for an attempt to fail. Each attempt
+ * gets attemptDelayMs before the next one starts next to it, a failed one
+ * starts the next right away. The first to connect wins and the others
+ * are closed, so a host whose IPv6 route is broken connects over IPv4
+ * a moment later instead of after a full connect timeout.
+ */
+error_code SocketWrapper::race_endpoints(std::chrono::steady_clock::time_point deadline, ConnectReport& report)
+{
+	Connection& c = *connection;
+	std::vector<ip::tcp::endpoint> order = interleave_families(c.endpoints);
+	std::vector<std::unique_ptr<ip::tcp::socket>> attempts;
+	steady_timer nextAttempt(c.ioContext);
+	size_t winner = order.size();
+	size_t running = 0;
+	bool done = false;
+	error_code error;
+	error_code ignored;
+
+	std::function<void()> start_attempt = [&]() {
+		nextAttempt.cancel();
+		if(attempts.size() >= order.size()) {
+			return;
+		}
+		size_t index = attempts.size();
+		attempts.emplace_back(new ip::tcp::socket(c.ioContext));
+		running++;
+		attempts[index]->async_connect(order[index], [&, index](const error_code& result) {
+			running--;
+			if(done) {
+				return;
+			}
+			if(!result) {
+				winner = index;
+				done = true;
+				return;
+			}
+			error = result;
+			attempts[index]->close(ignored);
+			if(attempts.size() < order.size()) {
+				start_attempt();
+			} else if(running == 0) {
+				done = true;
+			}
+		});
+		if(attempts.size() < order.size()) {
+			nextAttempt.expires_after(std::chrono::milliseconds(connectTimeouts.attemptDelayMs));
+			nextAttempt.async_wait([&](const error_code& result) {
+				if(!result && !done) {
+					start_attempt();
+				}
+			});
+		}
+	};
+
+	start_attempt();
+	bool finished = run_until(done, deadline);
+	done = true;
+	nextAttempt.cancel();
+	for(size_t i = 0; i < attempts.size(); i++) {
+		if(i != winner) {
+			attempts[i]->close(ignored);
+		}
+	}
+	drain_context();
+	report.attempts = (int) attempts.size();
+
+	if(winner == order.size()) {
+		if(!finished) {
+			return connectCancelled ? error::operation_aborted : error::timed_out;
+		}
+		return error;
+	}
+
+	report.address = order[winner].address().to_string();
+	ip::tcp::socket& socket = fresh_socket();
+	socket = std::move(*attempts[winner]);
+	// The connect left the socket in the non blocking mode asio uses for
+	// its own waits, the reads and writes after it block.
+	socket.non_blocking(false, ignored);
+	return error_code();
+}
+
+/*
+ * Runs handlers of the connection's io context until done is set, the
+ * deadline passed or the connect was cancelled. Returns done.
+ */
+bool SocketWrapper::run_until(bool& done, std::chrono::steady_clock::time_point deadline)
+{
+	io_context& context = connection->ioContext;
+	context.restart();
+	while(!done && !connectCancelled) {
+		auto now = std::chrono::steady_clock::now();
+		if(now >= deadline || context.stopped()) {
+			break;
+		}
+		context.run_one_until(std::min(deadline, now + CONNECT_POLL_INTERVAL));
+	}
+	return done;
+}
+
+// Runs the handlers of operations that were cancelled or closed.
+void SocketWrapper::drain_context()
+{
+	connection->ioContext.restart();
+	connection->ioContext.run();
+}
+
+/*
+ * Waits for the socket to be ready for type, or until the deadline, which
+ * fails with timed_out. Without a deadline it blocks like a read, also
+ * on a socket switched to non blocking, see handshake_direct.
+ */
+void SocketWrapper::wait_until(ip::tcp::socket& socket, socket_base::wait_type type,
+	std::chrono::steady_clock::time_point deadline, error_code& error)
+{
+	if(deadline == std::chrono::steady_clock::time_point::max()) {
+		wait_socket(socket, type, error);
+		return;
+	}
+
+	bool done = false;
+	socket.async_wait(type, [&](const error_code& result) {
+		error = result;
+		done = true;
+	});
+	if(!run_until(done, deadline)) {
+		error_code ignored;
+		socket.cancel(ignored);
+		drain_context();
+		error = connectCancelled ? error::operation_aborted : error::timed_out;
+	}
+}
+
+/*
+ * Connects again to the host of the last connect after the connection
+ * dropped. The first attempt reuses the resolved addresses and, with
+ * ssl, resumes the cached session, which saves the DNS lookup and most
+ * of the handshake. Failed attempts are retried up to maxAttempts times
+ * with exponential backoff, resolving the host again in case it moved.
+ * Receive and send threads that ran on the old connection are started
+ * again on the new one. This blocks through the backoff, reconnect_async
+ * runs the same attempts on the connect thread.
+ * Returns 0 when connected, 1 when every attempt failed.
+ */
+int SocketWrapper::reconnect(int maxAttempts)
+{
+	Connection& c = *connection;
+	stop_connect_thread();
+	if(c.hostname.empty()) {
+		lastError = error::not_connected;
+		return 1;
+	}
+	stop_connection_threads();
+
+	auto start = std::chrono::steady_clock::now();
+	int delayMs = reconnectDelayMs;
+	for(int attempt = 1; ; attempt++) {
+		if(open_connection(std::chrono::steady_clock::now()) == 0) {
+			count(stats.reconnects);
+			stats.reconnectUsec.record(usec_since(start));
+			SOCKET_TRACE_EVENT(trace, TRACE_RECONNECT, attempt, sessionResumed);
+			restart_threads();
+			return 0;
+		}
+		if(attempt >= maxAttempts) {
+			return 1;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+		delayMs = std::min(delayMs * 2, maxReconnectDelayMs);
+
+		if(!c.localPath.empty()) {
+			continue;
+		}
+		error_code resolveError;
+		ip::tcp::resolver resolver(c.ioContext);
+		auto endpoints = resolver.resolve(c.hostname,
+			std::to_string(c.endpoints.begin()->endpoint().port()), resolveError);
+		if(!resolveError) {
+			c.endpoints = endpoints;
+		}
+	}
+}
+
+/*
+ * Reconnects like reconnect, but on the connect thread, so neither the
+ * attempts nor the backoff between them hold up the caller. The outcome
+ * is picked up with poll_connect like that of connect_async, which also
+ * starts the threads again. Each attempt has the limits of
+ * connectTimeouts. Returns 0 when started, 1 without a host to
+ * reconnect to or with a shared context.
+ */
+int SocketWrapper::reconnect_async(int maxAttempts)
+{
+	Connection& c = *connection;
+	stop_connect_thread();
+	if(c.hostname.empty()) {
+		lastError = error::not_connected;
+		return 1;
+	}
+	if(!c.ownContext) {
+		lastError = error::operation_not_supported;
+		return 1;
+	}
+	stop_connection_threads();
+
+	connectDone = false;
+	connectCancelled = false;
+	reconnecting = true;
+	connectThread = std::thread(&SocketWrapper::reconnect_loop, this, maxAttempts);
+	return 0;
+}
+
+void SocketWrapper::reconnect_loop(int maxAttempts)
+{
+	Connection& c = *connection;
+	ConnectReport report;
+	auto start = std::chrono::steady_clock::now();
+	int port = c.endpoints.empty() ? 0 : c.endpoints.begin()->endpoint().port();
+	int delayMs = reconnectDelayMs;
+	error_code error;
+
+	for(int attempt = 1; ; attempt++) {
+		error = connect_phases(std::chrono::steady_clock::now(), report);
+		if(!error) {
+			count(stats.reconnects);
+			stats.reconnectUsec.record(usec_since(start));
+			SOCKET_TRACE_EVENT(trace, TRACE_RECONNECT, attempt, sessionResumed);
+			break;
+		}
+		SOCKET_TRACE_EVENT(trace, TRACE_CONNECT_FAILED, error.value(), port);
+		if(attempt >= maxAttempts) {
+			break;
+		}
+
+		// The backoff is waited out in slices so close stays quick.
+		auto resume = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+		while(!connectCancelled && std::chrono::steady_clock::now() < resume) {
+			std::this_thread::sleep_for(CONNECT_POLL_INTERVAL);
+		}
+		if(connectCancelled) {
+			error = error::operation_aborted;
+			break;
+		}
+		delayMs = std::min(delayMs * 2, maxReconnectDelayMs);
+
+		if(!c.localPath.empty()) {
+			continue;
+		}
+		// A lookup that fails keeps the addresses there are.
+		report.phase = "resolve";
+		ip::tcp::resolver::results_type endpoints;
+		auto resolveStart = std::chrono::steady_clock::now();
+		if(!resolve_until(c.hostname, port,
+			resolveStart + std::chrono::milliseconds(connectTimeouts.resolveMs), connectCancelled, endpoints)) {
+			c.endpoints = endpoints;
+		}
+		report.resolveUsec = usec_since(resolveStart);
+	}
+
+	report.result = error ? 1 : 0;
+	report.error = error;
+	report.totalUsec = usec_since(start);
+	connectReport = report;
+	connectDone = true;
+}
+
+/*
+ * Stops the threads of a connection that is about to be replaced by a
+ * reconnect. The old connection is usually dead already, a graceful ssl
+ * shutdown would only wait for a close_notify that never comes. Queued
+ * sends are kept for the next connection, see reset_stream.
+ */
+void SocketWrapper::stop_connection_threads()
+{
+	stop_send_thread();
+	stop_receive_thread();
+	drop_connection();
+}
+
+// Starts the threads that ran before a reconnect on the new connection.
+void SocketWrapper::restart_threads()
+{
+	if(keepReceiveThread && receiveQueue) {
+		start_receive_thread(receiveQueue->capacity());
+	}
+	if(keepSendThread && sendQueue) {
+		start_send_thread(sendQueue->high_water_mark());
+	}
+}
+
+bool SocketWrapper::session_resumed() const
+{
+	return !connectThread.joinable() && sessionResumed;
+}
+
+void SocketWrapper::drop_connection()
+{
+	error_code ignored;
+	if(connection->ringStream) {
+		connection->ringStream->ring.close();
+	}
+	if(connection->secureSocket) {
+		// Freeing an ssl stream that was not shut down marks its session
+		// as not resumable, which would throw away the cached session.
+		SSL_set_shutdown(connection->secureSocket->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		connection->secureSocket->lowest_layer().close(ignored);
+	}
+	connection->tcpSocket.close(ignored);
+}
+
+void SocketWrapper::close()
+{
+	Connection& c = *connection;
+	error_code ignored;
+	stop_connect_thread();
+	stop_send_thread();
+	if(sendQueue) {
+		sendQueue->clear();
+	}
+	keepReceiveThread = false;
+	keepSendThread = false;
+	stop_receive_thread();
+	close_datagrams();
+	SOCKET_TRACE_EVENT(trace, TRACE_CLOSE, sslEnabled, 0);
+	if(sslEnabled) {
+		if(c.directTls) {
+			SSL_shutdown(c.directTls->ssl);
+			c.secureSocket->lowest_layer().close(ignored);
+		} else if(c.secureSocket) {
+			c.secureSocket->shutdown(ignored);
+			c.secureSocket->lowest_layer().close(ignored);
+		}
+	} else {
+		if(c.ringStream) {
+			c.ringStream->ring.close();
+		}
+		c.tcpSocket.shutdown(ip::tcp::socket::shutdown_both, ignored);
+		c.tcpSocket.close(ignored);
+	}
+}
+
+/*
+ * One read of whatever the stream has available, up to maxBytes.
+ * Blocks until at least one byte is available.
+ */
+size_t SocketWrapper::read_some(char* destination, size_t maxBytes, error_code& error)
+{
+	ScopedTimer timer(stats.receiveBlockedUsec);
+	size_t received = 0;
+	if(timestampsEnabled) {
+		stamp_kernel();
+	}
+	if(sslEnabled) {
+		received = read_secure(destination, maxBytes, error);
+	} else {
+		received = with_plain_stream(*connection, [&](auto& stream) {
+			return stream.read_some(boost::asio::buffer(destination, maxBytes), error);
+		});
+	}
+	count(stats.readCalls);
+	count(stats.bytesIn, received);
+	if(timestampsEnabled) {
+		stamp_read(received);
+	}
+	return received;
+}
+
+/*
+ * Reads from the ssl stream with the socket switched to non blocking for
+ * as long as the stream mutex is held. A record can come without anything
+ * for the read to return, like the session tickets following a TLS 1.3
+ * handshake, and waiting for more inside the stream would keep the send
+ * thread from writing until the peer sends again, which it may be waiting
+ * for us to do. A blocking read waits on the socket without the mutex.
+ */
+size_t SocketWrapper::read_secure(char* destination, size_t maxBytes, error_code& error)
+{
+	ip::tcp::socket::lowest_layer_type& socket = stream_socket(*connection, true);
+	bool nonBlocking = socket.non_blocking();
+
+	// With only one thread on the stream nobody else waits for the mutex.
+	if(!receiving && !sendThreadActive) {
+		std::lock_guard<std::mutex> lock(connection->streamMutex);
+		return with_secure_stream(*connection, [&](auto& stream) {
+			return stream.read_some(boost::asio::buffer(destination, maxBytes), error);
+		});
+	}
+
+	// Plaintext reads of kernel tls need no lock, only the records that
+	// fail them go through OpenSSL.
+	DirectTls* direct = connection->directTls.get();
+	if(direct && direct->kernelReceive) {
+		size_t received = direct->socket->read_some(boost::asio::buffer(destination, maxBytes), error);
+		if(error != boost::system::errc::io_error) {
+			return received;
+		}
+		error = error_code();
+	}
+
+	while(true) {
+		size_t received = 0;
+		{
+			std::lock_guard<std::mutex> lock(connection->streamMutex);
+			error_code ignored;
+			if(!nonBlocking) {
+				socket.non_blocking(true, ignored);
+			}
+			received = with_secure_stream(*connection, [&](auto& stream) {
+				return stream.read_some(boost::asio::buffer(destination, maxBytes), error);
+			});
+			if(!nonBlocking) {
+				socket.non_blocking(false, ignored);
+			}
+		}
+		if(nonBlocking || (error != error::would_block && error != error::try_again)) {
+			return received;
+		}
+
+		wait_socket(socket, socket_base::wait_read, error);
+		if(error) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * The receive thread writes the stamps without a lock, so they are only
+ * switched while it does not run, -1 otherwise.
+ */
+int SocketWrapper::set_timestamps(bool enabled)
+{
+	if(receiveThread.joinable()) {
+		lastError = error::in_progress;
+		return -1;
+	}
+	timestampsEnabled = enabled;
+	readStamps = FrameTimestamps();
+	frameStamps = FrameTimestamps();
+	// Later connects, and the one in progress, turn kernel timestamps on
+	// in open_connection.
+	if(enabled && !connectThread.joinable() && stream_open(*connection, sslEnabled)) {
+		enable_kernel_timestamps();
+	}
+	return 0;
+}
+
+bool SocketWrapper::timestamps_enabled() const
+{
+	return timestampsEnabled;
+}
+
+bool SocketWrapper::kernel_timestamps_supported()
+{
+#if defined(__linux__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+const FrameTimestamps& SocketWrapper::frame_timestamps() const
+{
+	return frameStamps;
+}
+
+/*
+ * Asks the kernel to stamp incoming segments in software, when they are
+ * handed to the network stack. Nothing to ask for outside Linux, the
+ * other stages are still stamped there.
+ */
+void SocketWrapper::enable_kernel_timestamps()
+{
+#if defined(__linux__)
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	setsockopt(stream_socket(*connection, sslEnabled).native_handle(), SOL_SOCKET, SO_TIMESTAMPING,
+		&flags, sizeof(flags));
+#endif
+}
+
+/*
+ * Picks up the kernel timestamp of the first segment the next read will
+ * return. The stamp comes with recvmsg, which neither asio nor OpenSSL
+ * use, so a single byte is peeked at first, which leaves the data in
+ * place for the read. The peek never blocks, when nothing has arrived
+ * yet a blocking read waits for data first. Bytes OpenSSL already
+ * decrypted came with an earlier read, whose stamp still holds.
+ */
+void SocketWrapper::stamp_kernel()
+{
+#if defined(__linux__)
+	Connection& c = *connection;
+	if(sslEnabled && ssl_buffered(*c.secureSocket)) {
+		return;
+	}
+	// Messages through the shared ring never pass the kernel.
+	if(c.ringStream) {
+		readStamps.kernelUsec = 0;
+		return;
+	}
+	ip::tcp::socket::lowest_layer_type& socket = stream_socket(c, sslEnabled);
+
+	char peeked;
+	char control[CMSG_SPACE(sizeof(scm_timestamping))];
+	for(int attempt = 0; attempt < 2; attempt++) {
+		iovec vector = { &peeked, 1 };
+		msghdr header = {};
+		header.msg_iov = &vector;
+		header.msg_iovlen = 1;
+		header.msg_control = control;
+		header.msg_controllen = sizeof(control);
+
+		if(recvmsg(socket.native_handle(), &header, MSG_PEEK | MSG_DONTWAIT) > 0) {
+			for(cmsghdr* message = CMSG_FIRSTHDR(&header); message; message = CMSG_NXTHDR(&header, message)) {
+				if(message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_TIMESTAMPING) {
+					scm_timestamping stamp;
+					memcpy(&stamp, CMSG_DATA(message), sizeof(stamp));
+					readStamps.kernelUsec = (uint64_t) stamp.ts[0].tv_sec * 1000000 + stamp.ts[0].tv_nsec / 1000;
+					return;
+				}
+			}
+			break;
+		}
+		if(attempt > 0 || socket.non_blocking()) {
+			break;
+		}
+		error_code ignored;
+		wait_socket(socket, socket_base::wait_read, ignored);
+	}
+	readStamps.kernelUsec = 0;
+#endif
+}
+
+void SocketWrapper::stamp_read(size_t received)
+{
+	if(received == 0) {
+		return;
+	}
+	readStamps.readUsec = timestamp_usec();
+	if(readStamps.kernelUsec != 0) {
+		stats.kernelToReadUsec.record(stamp_distance(readStamps.kernelUsec, readStamps.readUsec));
+	}
+}
+
+/*
+ * Stamps messages just cut out of the stream with the read that
+ * completed them.
+ */
+void SocketWrapper::stamp_frames(size_t frames)
+{
+	if(!timestampsEnabled) {
+		return;
+	}
+	frameStamps = readStamps;
+	frameStamps.decodedUsec = timestamp_usec();
+	uint64_t waited = stamp_distance(frameStamps.readUsec, frameStamps.decodedUsec);
+	for(size_t i = 0; i < frames; i++) {
+		stats.readToDecodeUsec.record(waited);
+	}
+}
+
+void SocketWrapper::record_delivery(FrameTimestamps& stamps)
+{
+	stamps.deliveredUsec = timestamp_usec();
+	if(stamps.decodedUsec != 0) {
+		stats.decodeToDeliverUsec.record(stamp_distance(stamps.decodedUsec, stamps.deliveredUsec));
+	}
+	if(stamps.kernelUsec != 0) {
+		stats.kernelToDeliverUsec.record(stamp_distance(stamps.kernelUsec, stamps.deliveredUsec));
+	}
+}
+
+// Set for the lifetime of a receive thread, see read_error.
+static thread_local bool onReceiveThread = false;
+
+/*
+ * Where a failed read is reported. lastError belongs to the main thread,
+ * the receive thread reports into receiveError, which is taken over once
+ * the thread is joined.
+ */
+error_code& SocketWrapper::read_error()
+{
+	return onReceiveThread ? receiveError : lastError;
+}
+
+/*
+ * Reads as much as the stream has available into the read ahead buffer.
+ * When waitFirst is set the stream mutex is only taken once data has
+ * arrived, see wait_readable.
+ */
+int SocketWrapper::fill(bool waitFirst)
+{
+	if(waitFirst && !wait_readable()) {
+		return -1;
+	}
+
+	// Give back memory a large message made the buffer grow for.
+	if(readAhead.size() == 0 && readAhead.capacity() > readAheadSize) {
+		readAhead.resize(readAheadSize);
+	}
+
+	error_code error;
+	readAhead.make_room(readAhead.size() + 1);
+	size_t received = read_some(readAhead.write_ptr(), readAhead.write_space(), error);
+	readAhead.commit(received);
+	stats.readAheadBytes.store(readAhead.size(), std::memory_order_relaxed);
+
+	if(error && received == 0) {
+		SOCKET_TRACE_EVENT(trace, TRACE_READ_FAILED, error.value(), readAhead.size());
+		read_error() = error;
+		return -1;
+	}
+	SOCKET_TRACE_EVENT(trace, TRACE_READ, received, readAhead.size());
+	return (int) received;
+}
+
+/*
+ * One read of whatever has arrived, without waiting for more. The socket
+ * is only switched to non blocking for this read, every other call keeps
+ * blocking semantics. Returns the number of bytes read, 0 when nothing
+ * was available and -1 on error.
+ */
+int SocketWrapper::read_available()
+{
+	ip::tcp::socket::lowest_layer_type& socket = stream_socket(*connection, sslEnabled);
+
+	error_code error;
+	socket.non_blocking(true, error);
+	if(error) {
+		lastError = error;
+		return -1;
+	}
+
+	readAhead.make_room(readAhead.size() + 1);
+	size_t received = read_some(readAhead.write_ptr(), readAhead.write_space(), error);
+	readAhead.commit(received);
+	stats.readAheadBytes.store(readAhead.size(), std::memory_order_relaxed);
+
+	error_code ignored;
+	socket.non_blocking(false, ignored);
+
+	if(error == error::would_block || error == error::try_again) {
+		return 0;
+	}
+	if(error && received == 0) {
+		SOCKET_TRACE_EVENT(trace, TRACE_READ_FAILED, error.value(), readAhead.size());
+		lastError = error;
+		return -1;
+	}
+	SOCKET_TRACE_EVENT(trace, TRACE_READ, received, readAhead.size());
+	return (int) received;
+}
+
+/*
+ * Resumable receive for games that poll from _process instead of using
+ * threads. Each call reads at most once, without waiting, and moves the
+ * parser from Header to Body to Complete as far as the buffered bytes
+ * allow. Bytes of an unfinished message stay in the read ahead buffer
+ * until a later call completes it, nothing is consumed before that.
+ * Returns 1 with the span of the next message, valid until release_frames
+ * or the next poll, 0 when no message is complete yet and -1 on error.
+ */
+int SocketWrapper::poll(FrameSpan& frame)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	if(parseState == ParseState::Complete) {
+		release_frames();
+	}
+
+	bool readOnce = false;
+	while(true) {
+		if(parseState == ParseState::Header) {
+			int headerSize = decode_header(readAhead.data(), readAhead.size(), parseBodySize);
+			if(headerSize == FRAME_MALFORMED || (headerSize >= 0 && parseBodySize > max_message_size())) {
+				return malformed_frame();
+			}
+			if(headerSize >= 0 && parseBodySize == 0) {
+				// Empty messages are skipped, as everywhere else.
+				readAhead.consume(headerSize + trailer_size());
+				continue;
+			}
+			if(headerSize >= 0) {
+				parseHeaderSize = headerSize;
+				parseState = ParseState::Body;
+				continue;
+			}
+			readAhead.make_room(header_room());
+		} else {
+			size_t frameSize = parseHeaderSize + parseBodySize + trailer_size();
+			if(readAhead.size() >= frameSize) {
+				frame.offset = parseHeaderSize;
+				frame.size = parseBodySize;
+				scannedBytes = frameSize;
+				parseState = ParseState::Complete;
+				count(stats.messagesIn);
+				stats.messageSizeIn.record(parseBodySize);
+				stamp_frames(1);
+				SOCKET_TRACE_EVENT(trace, TRACE_FRAMES, 1, frameSize);
+				return 1;
+			}
+			readAhead.make_room(frameSize);
+		}
+
+		if(readOnce) {
+			return 0;
+		}
+		readOnce = true;
+		int received = read_available();
+		if(received <= 0) {
+			return received;
+		}
+	}
+}
+
+/*
+ * Non blocking counterpart of receive for unframed reads. Returns
+ * numBytes once that many bytes have arrived, 0 until then.
+ */
+int SocketWrapper::poll_bytes(int numBytes, char* destination)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	size_t wanted = (size_t) numBytes;
+	if(readAhead.size() < wanted) {
+		readAhead.make_room(wanted);
+		if(read_available() == -1) {
+			return -1;
+		}
+		if(readAhead.size() < wanted) {
+			return 0;
+		}
+	}
+	readAhead.take(destination, wanted);
+	parseState = ParseState::Header;
+	stats.readAheadBytes.store(readAhead.size(), std::memory_order_relaxed);
+	return numBytes;
+}
+
+/*
+ * Reads exactly numBytes into destination, which for messages is the
+ * locked memory of the PoolByteArray handed to Godot. Buffered bytes are
+ * copied first. The rest is read through the read ahead buffer when it
+ * is small, so bytes of following messages are picked up by the same
+ * read, or straight into destination when it is large.
+ */
+int SocketWrapper::receive(char* destination, int numBytes)
+{
+	size_t wanted = (size_t) numBytes;
+	size_t copied = readAhead.take(destination, wanted);
+
+	while(copied < wanted) {
+		size_t remaining = wanted - copied;
+		if(remaining >= readAhead.capacity() / 2) {
+			error_code error;
+			size_t received = 0;
+			ScopedTimer timer(stats.receiveBlockedUsec);
+			count(stats.readCalls);
+			if(timestampsEnabled) {
+				stamp_kernel();
+			}
+			if(sslEnabled) {
+				std::lock_guard<std::mutex> lock(connection->streamMutex);
+				received = with_secure_stream(*connection, [&](auto& stream) {
+					return read(stream, boost::asio::buffer(destination + copied, remaining), transfer_exactly(remaining), error);
+				});
+			} else {
+				received = with_plain_stream(*connection, [&](auto& stream) {
+					return read(stream, boost::asio::buffer(destination + copied, remaining), transfer_exactly(remaining), error);
+				});
+			}
+
+			count(stats.bytesIn, received);
+			if(timestampsEnabled) {
+				stamp_read(received);
+			}
+
+			// A peer closing the connection mid message is reported as eof
+			// with fewer bytes than asked for, which is a failure as well.
+			if(received < remaining) {
+				SOCKET_TRACE_EVENT(trace, TRACE_READ_FAILED, error.value(), received);
+				lastError = error;
+				return -1;
+			}
+			SOCKET_TRACE_EVENT(trace, TRACE_READ, received, 0);
+			break;
+		}
+
+		if(fill(false) == -1) {
+			return -1;
+		}
+		copied += readAhead.take(destination + copied, remaining);
+	}
+
+	stats.readAheadBytes.store(readAhead.size(), std::memory_order_relaxed);
+	return numBytes;
+}
+
+int SocketWrapper::set_framing(FrameFormat format, size_t fixedSize)
+{
+	if(format == FrameFormat::Fixed && fixedSize == 0) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+		return -1;
+	}
+	frameFormat = format;
+	fixedFrameSize = fixedSize;
+	delimiterSearched = 0;
+	if(compressor.enabled() && (frameFormat == FrameFormat::Fixed || frameFormat == FrameFormat::Delimited)) {
+		compressor.set_codec(CompressionCodec::None, 0, 0);
+	}
+	if(connection->datagrams) {
+		connection->datagrams->set_framing(datagram_format(frameFormat), fixedFrameSize, maxMessageSize);
+	}
+	return 0;
+}
+
+int SocketWrapper::set_delimiter(const char* bytes, size_t size)
+{
+	if(!frameDelimiter.assign(bytes, size)) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+		return -1;
+	}
+	set_framing(FrameFormat::Delimited);
+	return 0;
+}
+
+void SocketWrapper::set_max_message_size(size_t size)
+{
+	maxMessageSize = size;
+	if(connection->datagrams) {
+		connection->datagrams->set_framing(datagram_format(frameFormat), fixedFrameSize, maxMessageSize);
+	}
+}
+
+size_t SocketWrapper::max_message_size() const
+{
+	return frame_size_limit(frameFormat, fixedFrameSize, maxMessageSize);
+}
+
+/*
+ * Where the delimiter search for the message at the front of the read
+ * ahead buffer can pick up. Everything is read and scanned from there,
+ * so a search that found nothing is only continued for the same message.
+ */
+size_t SocketWrapper::resume_search()
+{
+	if(delimiterFrom != readAhead.stream_position()) {
+		delimiterFrom = readAhead.stream_position();
+		delimiterSearched = 0;
+	}
+	return delimiterSearched;
+}
+
+size_t SocketWrapper::scan(const char* data, size_t available, size_t maxCount,
+	std::vector<FrameSpan>& frames, size_t& pending)
+{
+	if(frameFormat != FrameFormat::Delimited) {
+		return scan_frames(frameFormat, fixedFrameSize, data, available, maxCount, max_message_size(), frames, pending);
+	}
+	size_t searched = resume_search();
+	size_t position = scan_delimited(frameDelimiter, data, available, maxCount, max_message_size(),
+		frames, pending, searched);
+	delimiterFrom = readAhead.stream_position() + position;
+	delimiterSearched = searched;
+	return position;
+}
+
+int SocketWrapper::encode_header(const char* body, size_t bodySize, unsigned char* header)
+{
+	if(bodySize > max_message_size() ||
+		(frameFormat == FrameFormat::Fixed && bodySize != fixedFrameSize)) {
+		SOCKET_TRACE_EVENT(trace, TRACE_WRITE_FAILED, -1, bodySize);
+		lastError = boost::system::errc::make_error_code(boost::system::errc::message_size);
+		return -1;
+	}
+	if(frameFormat == FrameFormat::Delimited &&
+		find_delimiter(body, bodySize, frameDelimiter) != bodySize) {
+		SOCKET_TRACE_EVENT(trace, TRACE_WRITE_FAILED, -1, bodySize);
+		lastError = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+		return -1;
+	}
+	return (int) encode_frame_header(frameFormat, bodySize, header);
+}
+
+// Room the next header needs, for delimited messages the whole message.
+size_t SocketWrapper::header_room() const
+{
+	if(frameFormat != FrameFormat::Delimited) {
+		return MAX_FRAME_HEADER_SIZE;
+	}
+	return delimited_room(frameDelimiter, readAhead.size(), max_message_size());
+}
+
+// Bytes that follow every message body, the delimiter if there is one.
+size_t SocketWrapper::trailer_size() const
+{
+	return frameFormat == FrameFormat::Delimited ? frameDelimiter.size : 0;
+}
+
+const char* SocketWrapper::trailer() const
+{
+	return (const char*) frameDelimiter.bytes;
+}
+
+int SocketWrapper::malformed_frame()
+{
+	SOCKET_TRACE_EVENT(trace, TRACE_MALFORMED_FRAME, readAhead.size(), (int) frameFormat);
+	read_error() = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+	return -1;
+}
+
+int SocketWrapper::decode_header(const char* data, size_t available, size_t& bodySize)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	switch(frameFormat) {
+	case FrameFormat::U16BE:
+		return U16BECodec().decode(bytes, available, bodySize);
+	case FrameFormat::U16LE:
+		return U16LECodec().decode(bytes, available, bodySize);
+	case FrameFormat::U32BE:
+		return U32BECodec().decode(bytes, available, bodySize);
+	case FrameFormat::U32LE:
+		return U32LECodec().decode(bytes, available, bodySize);
+	case FrameFormat::Varint:
+		return VarintCodec().decode(bytes, available, bodySize);
+	case FrameFormat::Fixed:
+		return FixedSizeCodec{fixedFrameSize}.decode(bytes, available, bodySize);
+	case FrameFormat::Delimited:
+		resume_search();
+		return decode_delimited(frameDelimiter, data, available, max_message_size(), bodySize, delimiterSearched);
+	}
+	return FRAME_MALFORMED;
+}
+
+int SocketWrapper::receive_header(size_t& bodySize)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	while(true) {
+		int headerSize = decode_header(readAhead.data(), readAhead.size(), bodySize);
+		if(headerSize == FRAME_MALFORMED || (headerSize >= 0 && bodySize > max_message_size())) {
+			return malformed_frame();
+		}
+		if(headerSize >= 0) {
+			readAhead.consume(headerSize);
+			parseState = ParseState::Header;
+			if(bodySize > 0) {
+				count(stats.messagesIn);
+				stats.messageSizeIn.record(bodySize);
+				pendingTrailer = trailer_size();
+			} else {
+				readAhead.consume(trailer_size());
+			}
+			return 0;
+		}
+
+		readAhead.make_room(header_room());
+		if(fill(false) == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+ * Blocks until at least one complete message is buffered, then returns
+ * every complete message in the read ahead buffer, up to maxCount. The
+ * spans stay valid until release_frames. Empty messages are skipped, as
+ * in Socket::receive_message. Without blocking, and unless waitFirst is
+ * set, it reads at most once and returns 0 when no message is complete.
+ */
+int SocketWrapper::receive_frames(std::vector<FrameSpan>& frames, int maxCount, bool waitFirst)
+{
+	frames.clear();
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	scannedBytes = 0;
+	bool readOnce = false;
+
+	while(true) {
+		size_t pending = 0;
+		size_t position = scan(readAhead.data(), readAhead.size(), maxCount, frames, pending);
+
+		if(!frames.empty()) {
+			scannedBytes = position;
+			count(stats.messagesIn, frames.size());
+			for(const FrameSpan& frame : frames) {
+				stats.messageSizeIn.record(frame.size);
+			}
+			stamp_frames(frames.size());
+			SOCKET_TRACE_EVENT(trace, TRACE_FRAMES, frames.size(), position);
+			return (int) frames.size();
+		}
+		if(pending == 0) {
+			return malformed_frame();
+		}
+
+		// Large messages grow the buffer until they fit in one piece.
+		readAhead.consume(position);
+		readAhead.make_room(pending);
+		if(!blocking && !waitFirst) {
+			if(readOnce) {
+				return 0;
+			}
+			readOnce = true;
+			if(read_available() == -1) {
+				return -1;
+			}
+			continue;
+		}
+		if(fill(waitFirst) == -1) {
+			return -1;
+		}
+	}
+}
+
+const char* SocketWrapper::frame_data(const FrameSpan& frame) const
+{
+	return readAhead.data() + frame.offset;
+}
+
+void SocketWrapper::release_frames()
+{
+	readAhead.consume(scannedBytes);
+	scannedBytes = 0;
+	parseState = ParseState::Header;
+	stats.readAheadBytes.store(readAhead.size(), std::memory_order_relaxed);
+}
+
+void SocketWrapper::set_read_ahead_size(size_t size)
+{
+	readAheadSize = size;
+	// The connect thread empties the buffer, reads resize it later on.
+	if(!connectThread.joinable()) {
+		readAhead.resize(size);
+	}
+}
+
+const int SocketWrapper::receive_ushort(unsigned short &header)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	return receive((char*) &header, sizeof(unsigned short));
+}
+
+int SocketWrapper::receive_bytes(int numBytes, char* byte_buffer)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	int result = receive(byte_buffer, numBytes);
+	if(result != -1) {
+		stamp_frames(1);
+	}
+	if(pendingTrailer > 0) {
+		// Buffered along with the body, the message was only decoded once
+		// its delimiter was in.
+		readAhead.consume(pendingTrailer);
+		pendingTrailer = 0;
+	}
+	return result;
+}
+
+int SocketWrapper::send_ushort(unsigned short ushort)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	ushort = htons(ushort);
+	sendBuffers.assign(1, boost::asio::buffer(&ushort, 2));
+	return write_buffers(sendBuffers);
+}
+
+int SocketWrapper::send_bytes(const char* bytes, int numBytes)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	sendBuffers.assign(1, boost::asio::buffer(bytes, numBytes));
+	return write_buffers(sendBuffers);
+}
+
+/*
+ * Writes a sequence of buffers as one write. Plain sockets get it as a
+ * single gather write. The ssl stream would turn every buffer into its
+ * own record, so for ssl the buffers are first packed into one.
+ */
+int SocketWrapper::write_buffers(const std::vector<const_buffer>& buffers)
+{
+	error_code error;
+	ScopedTimer timer(stats.sendBlockedUsec);
+	count(stats.writeCalls);
+
+	DirectTls* direct = connection->directTls.get();
+	if(direct && direct->kernelSend) {
+		// The kernel encrypts, the buffers go out as one gather write.
+		boost::asio::write(*direct->socket, buffers, transfer_all(), error);
+	} else if(sslEnabled) {
+		std::vector<char>& scratch = connection->sendScratch;
+		scratch.resize(buffer_size(buffers));
+		buffer_copy(boost::asio::buffer(scratch), buffers);
+
+		std::lock_guard<std::mutex> lock(connection->streamMutex);
+		with_secure_stream(*connection, [&](auto& stream) {
+			return boost::asio::write(stream, boost::asio::buffer(scratch), transfer_all(), error);
+		});
+	} else {
+		with_plain_stream(*connection, [&](auto& stream) {
+			return boost::asio::write(stream, buffers, transfer_all(), error);
+		});
+	}
+
+	if(error && error != error::eof ) {
+		SOCKET_TRACE_EVENT(trace, TRACE_WRITE_FAILED, error.value(), buffer_size(buffers));
+		lastError = error;
+		return -1;
+	}
+
+	count(stats.bytesOut, buffer_size(buffers));
+	SOCKET_TRACE_EVENT(trace, TRACE_WRITE, buffer_size(buffers), buffers.size());
+	return 0;
+}
+
+int SocketWrapper::send_frame(const char* bytes, int numBytes, bool withHeader)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	unsigned char header[MAX_FRAME_HEADER_SIZE];
+	sendBuffers.clear();
+
+	if(withHeader && compressor.enabled()) {
+		compressedFrames.clear();
+		if(append_frame(compressedFrames, bytes, numBytes) == -1) {
+			return -1;
+		}
+		count_sent(bytes, numBytes);
+		sendBuffers.push_back(boost::asio::buffer(compressedFrames));
+		return write_buffers(sendBuffers);
+	}
+
+	if(withHeader) {
+		int headerSize = encode_header(bytes, numBytes, header);
+		if(headerSize == -1) {
+			return -1;
+		}
+		sendBuffers.push_back(boost::asio::buffer(header, headerSize));
+	}
+	sendBuffers.push_back(boost::asio::buffer(bytes, numBytes));
+	if(withHeader && trailer_size() > 0) {
+		sendBuffers.push_back(boost::asio::buffer(trailer(), trailer_size()));
+	}
+	count_sent(bytes, numBytes);
+	return write_buffers(sendBuffers);
+}
+
+int SocketWrapper::send_frames(const std::vector<const_buffer>& messages, bool withHeader)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	// The header and buffer lists are members and keep their capacity,
+	// sending batches of a similar size allocates nothing.
+	sendHeaders.resize(withHeader ? messages.size() * MAX_FRAME_HEADER_SIZE : 0);
+	sendBuffers.clear();
+
+	// Compressed messages are packed into one buffer as they are encoded.
+	if(withHeader && compressor.enabled()) {
+		compressedFrames.clear();
+		for(const const_buffer& message : messages) {
+			if(append_frame(compressedFrames, (const char*) message.data(), message.size()) == -1) {
+				return -1;
+			}
+			count_sent((const char*) message.data(), message.size());
+		}
+		sendBuffers.push_back(boost::asio::buffer(compressedFrames));
+		return write_buffers(sendBuffers);
+	}
+
+	for(size_t i = 0; i < messages.size(); i++) {
+		if(withHeader) {
+			unsigned char* header = &sendHeaders[i * MAX_FRAME_HEADER_SIZE];
+			int headerSize = encode_header((const char*) messages[i].data(), messages[i].size(), header);
+			if(headerSize == -1) {
+				return -1;
+			}
+			sendBuffers.push_back(boost::asio::buffer(header, headerSize));
+		}
+		sendBuffers.push_back(messages[i]);
+		if(withHeader && trailer_size() > 0) {
+			sendBuffers.push_back(boost::asio::buffer(trailer(), trailer_size()));
+		}
+		count_sent((const char*) messages[i].data(), messages[i].size());
+	}
+	return write_buffers(sendBuffers);
+}
+
+int SocketWrapper::stage_frame(const char* bytes, int numBytes, bool withHeader)
+{
+	if(withHeader && compressor.enabled()) {
+		if(append_frame(staged, bytes, numBytes) == -1) {
+			return -1;
+		}
+		count_sent(bytes, numBytes);
+		return 0;
+	}
+	if(withHeader) {
+		unsigned char header[MAX_FRAME_HEADER_SIZE];
+		int headerSize = encode_header(bytes, numBytes, header);
+		if(headerSize == -1) {
+			return -1;
+		}
+		staged.insert(staged.end(), header, header + headerSize);
+	}
+	staged.insert(staged.end(), bytes, bytes + numBytes);
+	if(withHeader) {
+		staged.insert(staged.end(), trailer(), trailer() + trailer_size());
+	}
+	count_sent(bytes, numBytes);
+	return 0;
+}
+
+/*
+ * Appends the header and the encoded body of a message to out, for
+ * connections with compression on. The body is the flag byte and the
+ * message, compressed when it is large enough, so the header carries the
+ * size on the wire. The caller counts the message once it is accepted.
+ */
+int SocketWrapper::append_frame(std::vector<char>& out, const char* bytes, size_t numBytes)
+{
+	if(numBytes > max_message_size()) {
+		SOCKET_TRACE_EVENT(trace, TRACE_WRITE_FAILED, -1, numBytes);
+		lastError = boost::system::errc::make_error_code(boost::system::errc::message_size);
+		return -1;
+	}
+
+	compressScratch.clear();
+	auto start = std::chrono::steady_clock::now();
+	bool compressed = compressor.encode(bytes, numBytes, compressScratch);
+	if(compressed) {
+		stats.compressNsec.record(nsec_since(start));
+		count(stats.compressedMessagesOut);
+		count(stats.uncompressedBytesOut, numBytes);
+		count(stats.compressedBytesOut, compressScratch.size());
+	}
+
+	unsigned char header[MAX_FRAME_HEADER_SIZE];
+	int headerSize = encode_header(compressScratch.data(), compressScratch.size(), header);
+	if(headerSize == -1) {
+		return -1;
+	}
+	out.insert(out.end(), header, header + headerSize);
+	out.insert(out.end(), compressScratch.begin(), compressScratch.end());
+	return 0;
+}
+
+/*
+ * The receive thread decodes with the codec and dictionary, and messages
+ * queued for the send thread were encoded with them, so neither can be
+ * changed while one of the threads runs.
+ */
+bool SocketWrapper::compressor_busy()
+{
+	if(receiveThread.joinable() || sendThread.joinable()) {
+		lastError = error::in_progress;
+		return true;
+	}
+	return false;
+}
+
+int SocketWrapper::set_compression(CompressionCodec codec, int level, size_t threshold)
+{
+	if(compressor_busy()) {
+		return -1;
+	}
+	// A compressed message has no fixed size and may hold any delimiter.
+	if(codec != CompressionCodec::None &&
+		(frameFormat == FrameFormat::Fixed || frameFormat == FrameFormat::Delimited)) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+		return -1;
+	}
+	if(compressor.set_codec(codec, level, threshold) == -1) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::not_supported);
+		return -1;
+	}
+	return 0;
+}
+
+int SocketWrapper::set_compression_dictionary(const char* bytes, size_t size)
+{
+	if(compressor_busy()) {
+		return -1;
+	}
+	if(compressor.set_dictionary(bytes, size) == -1) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::not_supported);
+		return -1;
+	}
+	return 0;
+}
+
+bool SocketWrapper::compression_enabled() const
+{
+	return compressor.enabled();
+}
+
+/*
+ * Size of the message a received body holds, -1 for a bad flag byte or a
+ * message larger than max_message_size, which also guards against bodies
+ * that would decompress to something huge.
+ */
+int64_t SocketWrapper::decoded_size(const char* body, size_t size)
+{
+	if(!compressor.enabled()) {
+		return (int64_t) size;
+	}
+	int64_t messageSize = compressor.decoded_size(body, size);
+	if(messageSize < 0 || (uint64_t) messageSize > maxMessageSize) {
+		malformed_frame();
+		return -1;
+	}
+	return messageSize;
+}
+
+int SocketWrapper::decode_frame(const char* body, size_t size, char* destination, size_t decodedSize)
+{
+	if(!compressor.enabled()) {
+		memcpy(destination, body, size);
+	} else if((unsigned char) body[0] == FRAME_RAW) {
+		memcpy(destination, body + 1, decodedSize);
+	} else {
+		auto start = std::chrono::steady_clock::now();
+		if(compressor.decode(body, size, destination, decodedSize) == -1) {
+			return malformed_frame();
+		}
+		stats.decompressNsec.record(nsec_since(start));
+		count(stats.compressedMessagesIn);
+		count(stats.uncompressedBytesIn, decodedSize);
+		count(stats.compressedBytesIn, size);
+	}
+
+	if(capturing) {
+		capture.append(CaptureKind::StreamIn, destination, decodedSize);
+	}
+	return 0;
+}
+
+void SocketWrapper::count_sent(const char* message, size_t messageSize)
+{
+	count(stats.messagesOut);
+	stats.messageSizeOut.record(messageSize);
+	if(capturing) {
+		capture.append(CaptureKind::StreamOut, message, messageSize);
+	}
+}
+
+int SocketWrapper::flush_staged()
+{
+	if(staged.empty()) {
+		return 0;
+	}
+	// Staged messages are kept for after the connect.
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	sendBuffers.assign(1, boost::asio::buffer(staged));
+	int result = write_buffers(sendBuffers);
+	staged.clear();
+	return result;
+}
+
+size_t SocketWrapper::staged_bytes() const
+{
+	return staged.size();
+}
+
+size_t SocketWrapper::buffered_bytes() const
+{
+	if(connectThread.joinable()) {
+		return 0;
+	}
+	return stats.readAheadBytes.load(std::memory_order_relaxed);
+}
+
+/*
+ * Opens the UDP channel to the host of the current connection, on
+ * remotePort there and localPort here, 0 for any. Messages use the
+ * framing of the stream. Stays open over reconnects, close closes it.
+ */
+int SocketWrapper::open_datagrams(int remotePort, int localPort)
+{
+	if(refuse_while_connecting()) {
+		return -1;
+	}
+	Connection& c = *connection;
+	error_code error;
+	if(!c.localPath.empty()) {
+		lastError = error::operation_not_supported;
+		return -1;
+	}
+	ip::tcp::endpoint remote = sslEnabled && c.secureSocket ?
+		c.secureSocket->lowest_layer().remote_endpoint(error) :
+		c.tcpSocket.remote_endpoint(error);
+	if(error) {
+		lastError = error;
+		return -1;
+	}
+
+	if(!c.datagrams) {
+		c.datagrams.reset(new DatagramChannel(c.ioContext, stats, trace, framePool));
+	}
+	c.datagrams->set_framing(datagram_format(frameFormat), fixedFrameSize, maxMessageSize);
+	c.datagrams->set_max_datagram_size(maxDatagramSize);
+	if(c.datagrams->open(remote.address(), remotePort, localPort, error) == -1) {
+		lastError = error;
+		return -1;
+	}
+	return 0;
+}
+
+void SocketWrapper::close_datagrams()
+{
+	if(connection->datagrams) {
+		connection->datagrams->close();
+	}
+}
+
+bool SocketWrapper::datagrams_open() const
+{
+	return connection->datagrams && connection->datagrams->is_open();
+}
+
+int SocketWrapper::datagram_port() const
+{
+	return datagrams_open() ? connection->datagrams->local_port() : 0;
+}
+
+void SocketWrapper::set_max_datagram_size(size_t size)
+{
+	maxDatagramSize = size;
+	if(connection->datagrams) {
+		connection->datagrams->set_max_datagram_size(size);
+	}
+}
+
+int SocketWrapper::stage_datagram(const char* bytes, int numBytes)
+{
+	if(!datagrams_open()) {
+		lastError = error::not_connected;
+		return -1;
+	}
+	if(connection->datagrams->stage(bytes, numBytes) == -1) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::message_size);
+		return -1;
+	}
+	if(capturing) {
+		capture.append(CaptureKind::DatagramOut, bytes, numBytes);
+	}
+	return 0;
+}
+
+// Sends everything staged, returns the number of datagrams sent or -1.
+int SocketWrapper::flush_datagrams()
+{
+	if(!datagrams_open()) {
+		return 0;
+	}
+	error_code error;
+	int sent = connection->datagrams->flush(error);
+	if(sent == -1) {
+		lastError = error;
+	}
+	return sent;
+}
+
+size_t SocketWrapper::staged_datagrams() const
+{
+	return connection->datagrams ? connection->datagrams->staged_datagrams() : 0;
+}
+
+// Never blocks, returns the number of messages appended or -1.
+int SocketWrapper::receive_datagrams(std::vector<PooledFrame>& frames, int maxCount, int waitMs)
+{
+	if(!datagrams_open()) {
+		lastError = error::not_connected;
+		return -1;
+	}
+	error_code error;
+	size_t before = frames.size();
+	int received = connection->datagrams->receive(frames, maxCount, waitMs, error);
+	if(received == -1) {
+		lastError = error;
+	}
+	if(capturing) {
+		for(size_t i = before; i < frames.size(); i++) {
+			capture.append(CaptureKind::DatagramIn, frames[i].data(), frames[i].size());
+		}
+	}
+	return received;
+}
+
+int SocketWrapper::start_receive_thread(size_t queueSize)
+{
+	join_finished_receive_thread();
+	if(receiveThread.joinable() || refuse_while_connecting()) {
+		return 1;
+	}
+	receiveQueue.reset(new FrameQueue<PooledFrame>(queueSize));
+	keepReceiveThread = true;
+	receiveThreadDone = false;
+	receiveError = error_code();
+	receiving = true;
+	receiveThread = std::thread(&SocketWrapper::receive_loop, this);
+	return 0;
+}
+
+bool SocketWrapper::is_receive_thread_running() const
+{
+	return receiving && !receiveThreadDone;
+}
+
+bool SocketWrapper::pop_frame(PooledFrame& frame)
+{
+	if(!receiveQueue) {
+		return false;
+	}
+	return receiveQueue->try_pop(frame);
+}
+
+size_t SocketWrapper::queued_frames() const
+{
+	return receiveQueue ? receiveQueue->size() : 0;
+}
+
+void SocketWrapper::set_frame_pool_size(size_t maxBytes)
+{
+	framePool.set_max_cached_bytes(maxBytes);
+}
+
+const FramePool& SocketWrapper::frame_pool() const
+{
+	return framePool;
+}
+
+int SocketWrapper::start_capture(const char* path)
+{
+	if(capture.open(path) == -1) {
+		lastError = error_code(errno, boost::system::system_category());
+		capture.close();
+		return 1;
+	}
+	capturing = true;
+	return 0;
+}
+
+void SocketWrapper::stop_capture()
+{
+	capturing = false;
+	capture.close();
+}
+
+bool SocketWrapper::is_capturing() const
+{
+	return capturing;
+}
+
+void SocketWrapper::capture_frame(CaptureKind kind, const char* bytes, size_t size)
+{
+	if(capturing) {
+		capture.append(kind, bytes, size);
+	}
+}
+
+void SocketWrapper::flush_capture()
+{
+	if(capturing) {
+		capture.flush_if_due();
+	}
+}
+
+int SocketWrapper::start_replay(const char* path, bool paced, size_t queueSize)
+{
+	if(receiveThread.joinable()) {
+		return 1;
+	}
+	std::unique_ptr<CaptureReader> reader(new CaptureReader(maxMessageSize));
+	if(reader->open(path) == -1) {
+		lastError = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+		return 1;
+	}
+
+	receiveQueue.reset(new FrameQueue<PooledFrame>(queueSize));
+	receiveError = error_code();
+	receiveThreadDone = false;
+	receiving = true;
+	receiveThread = std::thread(&SocketWrapper::replay_loop, this, std::move(reader), paced);
+	return 0;
+}
+
+/*
+ * Stands in for receive_loop during a replay. Paced replays wait in short
+ * sleeps, so stopping the replay does not wait for a long gap between
+ * two recorded messages.
+ */
+void SocketWrapper::replay_loop(std::unique_ptr<CaptureReader> reader, bool paced)
+{
+	std::vector<char> message;
+	CaptureKind kind;
+	uint64_t timestamp = 0;
+	auto start = std::chrono::steady_clock::now();
+	int result = 0;
+
+	while(receiving && (result = reader->next(kind, timestamp, message)) == 1) {
+		if(kind != CaptureKind::StreamIn || message.empty()) {
+			continue;
+		}
+		if(paced) {
+			auto due = start + std::chrono::microseconds(timestamp - reader->start_usec());
+			for(auto now = std::chrono::steady_clock::now(); receiving && now < due; now = std::chrono::steady_clock::now()) {
+				std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(due - now, std::chrono::milliseconds(5)));
+			}
+		}
+
+		PooledFrame frame = framePool.acquire(message.size());
+		if(!frame.data()) {
+			receiveError = boost::system::errc::make_error_code(boost::system::errc::not_enough_memory);
+			break;
+		}
+		memcpy(frame.data(), message.data(), message.size());
+		count(stats.messagesIn);
+		count(stats.bytesIn, message.size());
+		stats.messageSizeIn.record(message.size());
+		if(timestampsEnabled) {
+			frame.timestamps.readUsec = timestamp_usec();
+			frame.timestamps.decodedUsec = frame.timestamps.readUsec;
+		}
+		push_frame(frame);
+	}
+
+	if(result == -1) {
+		receiveError = boost::system::errc::make_error_code(boost::system::errc::bad_message);
+	}
+	receiveThreadDone = true;
+}
+
+int SocketWrapper::start_send_thread(size_t highWaterMark)
+{
+	if(sendThread.joinable() || refuse_while_connecting() || !stream_open(*connection, sslEnabled)) {
+		return 1;
+	}
+	if(sendQueue) {
+		sendQueue->set_high_water_mark(highWaterMark);
+		sendQueue->restart();
+	} else {
+		sendQueue.reset(new SendQueue(stats, highWaterMark));
+	}
+	sendError = error_code();
+	keepSendThread = true;
+	sendThreadDone = false;
+	sendThreadActive = true;
+	sendThread = std::thread(&SocketWrapper::send_loop, this);
+	return 0;
+}
+
+bool SocketWrapper::is_send_thread_running() const
+{
+	return sendThreadActive && !sendThreadDone;
+}
+
+/*
+ * Frames the message, compressed when compression is on, and queues it
+ * in the lane. Framing happens here rather than on the send thread so
+ * the encoder state stays with the game thread.
+ */
+int SocketWrapper::queue_frame(const char* bytes, int numBytes, bool withHeader, SendLane lane)
+{
+	if(!sendQueue) {
+		lastError = error::not_connected;
+		return -1;
+	}
+
+	queuedFrame.clear();
+	if(withHeader && compressor.enabled()) {
+		if(append_frame(queuedFrame, bytes, numBytes) == -1) {
+			return -1;
+		}
+	} else {
+		if(withHeader) {
+			unsigned char header[MAX_FRAME_HEADER_SIZE];
+			int headerSize = encode_header(bytes, numBytes, header);
+			if(headerSize == -1) {
+				return -1;
+			}
+			queuedFrame.insert(queuedFrame.end(), header, header + headerSize);
+		}
+		queuedFrame.insert(queuedFrame.end(), bytes, bytes + numBytes);
+		if(withHeader) {
+			queuedFrame.insert(queuedFrame.end(), trailer(), trailer() + trailer_size());
+		}
+	}
+
+	// A refused message is neither counted nor captured.
+	if(sendQueue->push(lane, queuedFrame.data(), queuedFrame.size()) == 0) {
+		SOCKET_TRACE_EVENT(trace, TRACE_SEND_REFUSED, (int) lane, queuedFrame.size());
+		return 0;
+	}
+	count_sent(bytes, numBytes);
+	return 1;
+}
+
+size_t SocketWrapper::queued_send_bytes() const
+{
+	return sendQueue ? sendQueue->queued_bytes() : 0;
+}
+
+size_t SocketWrapper::send_high_water_mark() const
+{
+	return sendQueue ? sendQueue->high_water_mark() : 0;
+}
+
+/*
+ * Stops the send thread, leaving what is still queued for a restart.
+ * A write blocked on a peer that stopped reading is given a moment to
+ * finish, then the sending side is shut down to wake the thread.
+ */
+void SocketWrapper::stop_send_thread()
+{
+	if(!sendThread.joinable()) {
+		return;
+	}
+	if(sendQueue->stop(std::chrono::milliseconds(100)) && stream_open(*connection, sslEnabled)) {
+		shutdown_stream(*connection, sslEnabled, socket_base::shutdown_send);
+	}
+	sendThread.join();
+	sendThreadActive = false;
+
+	if(sendError) {
+		lastError = sendError;
+	}
+}
+
+/*
+ * Roughly how many bytes the send buffer of the socket takes without a
+ * write blocking. Linux counts its bookkeeping against the buffer size
+ * too, so that is half the size less what is still queued, elsewhere a
+ * quarter of the size is taken as free.
+ */
+static size_t send_room(ip::tcp::socket::lowest_layer_type& socket)
+{
+	socket_base::send_buffer_size bufferSize;
+	error_code error;
+	socket.get_option(bufferSize, error);
+	if(error) {
+		return 0;
+	}
+#if defined(__linux__)
+	int queued = 0;
+	if(ioctl(socket.native_handle(), SIOCOUTQ, &queued) == 0) {
+		return bufferSize.value() / 2 > queued ? (size_t) (bufferSize.value() / 2 - queued) : 0;
+	}
+#endif
+	return (size_t) bufferSize.value() / 4;
+}
+
+/*
+ * Writes through the ssl stream a record at a time. The stream mutex is
+ * only taken once the socket has room, so a peer that is slow to read
+ * does not also keep the receive thread from reading, which would leave
+ * both ends waiting on each other. Nor is it held while the socket fills
+ * up: OpenSSL on the socket writes without blocking and lets go of the
+ * mutex to wait for room, the asio stream, which loses what it could not
+ * write that way, only gets as much as the socket has room for.
+ */
+void SocketWrapper::write_secure(const std::vector<char>& pending, error_code& error)
+{
+	DirectTls* direct = connection->directTls.get();
+	if(direct && direct->kernelSend) {
+		count(stats.writeCalls);
+		boost::asio::write(*direct->socket, boost::asio::buffer(pending), transfer_all(), error);
+		return;
+	}
+
+	const size_t RECORD_SIZE = 16 * 1024;
+	const size_t MIN_CHUNK_SIZE = 1024;
+	ip::tcp::socket::lowest_layer_type& socket = stream_socket(*connection, true);
+	size_t written = 0;
+	while(written < pending.size()) {
+		wait_socket(socket, socket_base::wait_write, error);
+		if(error) {
+			return;
+		}
+		count(stats.writeCalls);
+		std::lock_guard<std::mutex> lock(connection->streamMutex);
+		if(direct) {
+			// A write that would block is repeated with the same bytes
+			// once there is room, as OpenSSL requires.
+			size_t chunk = std::min(RECORD_SIZE, pending.size() - written);
+			error_code ignored;
+			bool nonBlocking = socket.non_blocking();
+			socket.non_blocking(true, ignored);
+			written += direct->write_some(boost::asio::buffer(pending.data() + written, chunk), error);
+			if(!nonBlocking) {
+				socket.non_blocking(false, ignored);
+			}
+			if(error == error::would_block) {
+				error = error_code();
+				continue;
+			}
+		} else {
+			size_t room = std::max(MIN_CHUNK_SIZE, std::min(RECORD_SIZE, send_room(socket)));
+			size_t chunk = std::min(room, pending.size() - written);
+			written += boost::asio::write(*connection->secureSocket,
+				boost::asio::buffer(pending.data() + written, chunk), transfer_all(), error);
+		}
+		if(error) {
+			return;
+		}
+	}
+}
+
+void SocketWrapper::send_loop()
+{
+	std::vector<char> pending;
+
+	while(sendQueue->take(pending)) {
+		error_code error;
+		{
+			ScopedTimer timer(stats.sendBlockedUsec);
+			if(sslEnabled) {
+				write_secure(pending, error);
+			} else {
+				count(stats.writeCalls);
+				with_plain_stream(*connection, [&](auto& stream) {
+					return boost::asio::write(stream, boost::asio::buffer(pending), transfer_all(), error);
+				});
+			}
+		}
+		sendQueue->write_done();
+
+		if(error) {
+			// The batch is dropped whole, the part that went out went to
+			// the old connection, so a reconnect never starts halfway
+			// through a message.
+			SOCKET_TRACE_EVENT(trace, TRACE_WRITE_FAILED, error.value(), pending.size());
+			sendError = error;
+			break;
+		}
+		count(stats.bytesOut, pending.size());
+		SOCKET_TRACE_EVENT(trace, TRACE_WRITE, pending.size(), 1);
+	}
+	sendThreadDone = true;
+}
+
+void SocketWrapper::stop_receive_thread()
+{
+	if(!receiveThread.joinable()) {
+		return;
+	}
+	receiving = false;
+
+	// Shutting down the receiving side wakes the thread if it is blocked
+	// waiting for data, the sending side stays usable for a clean close.
+	shutdown_stream(*connection, sslEnabled, socket_base::shutdown_receive);
+	receiveThread.join();
+
+	if(receiveError) {
+		lastError = receiveError;
+	}
+}
+
+/*
+ * Waits until the socket has something to read without holding the
+ * stream mutex, so sends from the main thread are not held up by a
+ * receive thread waiting on an idle connection. Data already buffered
+ * by the ssl stream does not show up on the socket, so that is checked
+ * first.
+ */
+bool SocketWrapper::wait_readable()
+{
+	Connection& c = *connection;
+	error_code error;
+
+	if(sslEnabled) {
+		if(ssl_buffered(*c.secureSocket)) {
+			return true;
+		}
+		wait_socket(c.secureSocket->lowest_layer(), socket_base::wait_read, error);
+	} else if(c.ringStream) {
+		c.ringStream->wait(false, error);
+	} else {
+		wait_socket(c.tcpSocket, socket_base::wait_read, error);
+	}
+
+	if(error) {
+		receiveError = error;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The queue is bounded, when the game falls behind the thread stops
+ * reading and lets TCP flow control slow the server down.
+ */
+void SocketWrapper::push_frame(PooledFrame& frame)
+{
+	while(!receiveQueue->try_push(std::move(frame))) {
+		SOCKET_TRACE_EVENT(trace, TRACE_QUEUE_FULL, receiveQueue->capacity(), 0);
+		if(!receiving) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void SocketWrapper::receive_loop()
+{
+	std::vector<FrameSpan> frames;
+	onReceiveThread = true;
+
+	while(receiving) {
+		if(receive_frames(frames, (int) receiveQueue->capacity(), true) == -1) {
+			break;
+		}
+
+		bool failed = false;
+		for(const FrameSpan& span : frames) {
+			int64_t size = decoded_size(frame_data(span), span.size);
+			if(size == -1) {
+				failed = true;
+				break;
+			}
+			PooledFrame frame = framePool.acquire((size_t) size);
+			if(!frame.data()) {
+				receiveError = boost::system::errc::make_error_code(boost::system::errc::not_enough_memory);
+				failed = true;
+				break;
+			}
+			frame.timestamps = frameStamps;
+			if(decode_frame(frame_data(span), span.size, frame.data(), (size_t) size) == -1) {
+				failed = true;
+				break;
+			}
+
+			push_frame(frame);
+		}
+		release_frames();
+		if(failed) {
+			break;
+		}
+	}
+	receiveThreadDone = true;
+}
+
+/*
+ * Joins a receive thread that ended on its own, when the peer closed the
+ * connection or sent a malformed message, and takes over its error.
+ * receiveThreadDone is only set once the thread wrote receiveError.
+ */
+void SocketWrapper::join_finished_receive_thread()
+{
+	if(!receiveThread.joinable() || !receiveThreadDone) {
+		return;
+	}
+	receiveThread.join();
+	if(receiveError) {
+		lastError = receiveError;
+	}
+}
@@ -3,25 +3,386 @@
 
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <boost/asio.hpp>
-#include <boost/asio/ssl.hpp>
+
+#include "FrameCapture.hpp"
+#include "FrameCodec.hpp"
+#include "FrameCompression.hpp"
+#include "FrameDelimiter.hpp"
+#include "FramePool.hpp"
+#include "FrameQueue.hpp"
+#include "FrameTimestamps.hpp"
+#include "ReadAheadBuffer.hpp"
+#include "SendQueue.hpp"
+#include "SocketStats.hpp"
+#include "TraceLog.hpp"
+
+/*
+ * All boost state (io context, ssl context and the streams) lives in
+ * a per instance Connection defined in SocketWrapper.cpp, which keeps
+ * the ssl includes away from the Godot headers and lets any number of
+ * Socket nodes run side by side without sharing a stream.
+ */
+struct Connection;
+
+/*
+ * How the records of a tls connection are encrypted and decrypted, see
+ * SocketWrapper::kernelTls. Kernel tls can be limited to sending on
+ * kernels without receive offload.
+ */
+enum class TlsPath {
+	None,
+	Stream,
+	Userspace,
+	KernelSend,
+	Kernel
+};
+
+const char* tls_path_name(TlsPath path);
+
+/*
+ * Limits of the phases of connect_async in milliseconds, each at least 1.
+ * attemptDelayMs is how long an address gets before the next one is
+ * tried next to it.
+ */
+struct ConnectTimeouts {
+	int resolveMs = 5000;
+	int connectMs = 5000;
+	int handshakeMs = 5000;
+	int attemptDelayMs = 250;
+};
+
+/*
+ * Outcome of connect_async. phase is the phase that failed, or the last
+ * one that ran when result is 0. Phases that did not run take 0 usec.
+ */
+struct ConnectReport {
+	int result = 1;
+	const char* phase = "resolve";
+	boost::system::error_code error;
+	// The address that answered first.
+	std::string address;
+	int attempts = 0;
+	uint64_t resolveUsec = 0;
+	uint64_t connectUsec = 0;
+	uint64_t handshakeUsec = 0;
+	uint64_t totalUsec = 0;
+};
 
 class SocketWrapper {
 private:
-	boost::asio::streambuf buffer;
-	int receive(int numBytes);
+	std::unique_ptr<Connection> connection;
+	int receive(char* destination, int numBytes);
+
+	bool sessionResumed = false;
+	int open_connection(std::chrono::steady_clock::time_point start);
+	void drop_connection();
+	int connect_failed(const boost::system::error_code& error, int port);
+	void reset_stream();
+	void set_local_target(const std::string& address);
+	void open_local(boost::asio::ip::tcp::socket& target);
+	boost::asio::ip::tcp::socket& fresh_socket();
+	void handshake(std::chrono::steady_clock::time_point deadline);
+	void handshake_direct(std::chrono::steady_clock::time_point deadline);
+	void apply_socket_options();
+
+	// Background connecting, see connect_async.
+	std::thread connectThread;
+	std::atomic<bool> connectDone{false};
+	std::atomic<bool> connectCancelled{false};
+	ConnectReport connectReport;
+	void connect_loop(std::string hostname, int port);
+	void reconnect_loop(int maxAttempts);
+	boost::system::error_code connect_phases(std::chrono::steady_clock::time_point start, ConnectReport& report);
+	boost::system::error_code race_endpoints(std::chrono::steady_clock::time_point deadline, ConnectReport& report);
+	bool run_until(bool& done, std::chrono::steady_clock::time_point deadline);
+	void drain_context();
+	void wait_until(boost::asio::ip::tcp::socket& socket, boost::asio::socket_base::wait_type type,
+		std::chrono::steady_clock::time_point deadline, boost::system::error_code& error);
+	void stop_connect_thread();
+	bool refuse_while_connecting();
+
+	// Whether the connect thread reconnects, and the threads a reconnect
+	// starts again on the new connection. Set by their start, cleared by
+	// close and by connects to a host.
+	bool reconnecting = false;
+	bool keepReceiveThread = false;
+	bool keepSendThread = false;
+	void stop_connection_threads();
+	void restart_threads();
+
+	ReadAheadBuffer readAhead{65536};
+	size_t readAheadSize = 65536;
+	size_t scannedBytes = 0;
+	size_t read_some(char* destination, size_t maxBytes, boost::system::error_code& error);
+	size_t read_secure(char* destination, size_t maxBytes, boost::system::error_code& error);
+	int fill(bool waitFirst);
+	int read_available();
+
+	// Stamps of the last read and of the messages last cut out of the
+	// stream, see set_timestamps.
+	std::atomic<bool> timestampsEnabled{false};
+	FrameTimestamps readStamps;
+	FrameTimestamps frameStamps;
+	void enable_kernel_timestamps();
+	void stamp_kernel();
+	void stamp_read(size_t received);
+	void stamp_frames(size_t frames);
+
+	// Where poll left off. The header of a message in Body is only
+	// consumed together with its body, see poll.
+	enum class ParseState { Header, Body, Complete };
+	ParseState parseState = ParseState::Header;
+	size_t parseHeaderSize = 0;
+	size_t parseBodySize = 0;
+	// Delimiter of a message returned by receive_header, consumed after
+	// its body.
+	size_t pendingTrailer = 0;
+
+	std::vector<char> staged;
+	std::vector<unsigned char> sendHeaders;
+	std::vector<boost::asio::const_buffer> sendBuffers;
+	int write_buffers(const std::vector<boost::asio::const_buffer>& buffers);
+	void count_sent(const char* message, size_t messageSize);
+
+	FrameFormat frameFormat = FrameFormat::U16BE;
+	size_t fixedFrameSize = 0;
+	size_t maxMessageSize = 16 * 1024 * 1024;
+	FrameDelimiter frameDelimiter;
+	// How far the search for the delimiter of the message starting at
+	// stream position delimiterFrom got, see decode_delimited.
+	uint64_t delimiterFrom = 0;
+	size_t delimiterSearched = 0;
+	size_t resume_search();
+	size_t scan(const char* data, size_t available, size_t maxCount, std::vector<FrameSpan>& frames, size_t& pending);
+	int decode_header(const char* data, size_t available, size_t& bodySize);
+	int encode_header(const char* body, size_t bodySize, unsigned char* header);
+	size_t header_room() const;
+	size_t trailer_size() const;
+	const char* trailer() const;
+	int malformed_frame();
+
+	FrameCompressor compressor;
+	std::vector<char> compressScratch;
+	std::vector<char> compressedFrames;
+	int append_frame(std::vector<char>& out, const char* bytes, size_t numBytes);
+	bool compressor_busy();
+
+	std::thread receiveThread;
+	std::atomic<bool> receiving{false};
+	std::atomic<bool> receiveThreadDone{false};
+	boost::system::error_code receiveError;
+	// Declared before the queue so frames still queued on destruction are
+	// handed back to a live pool.
+	FramePool framePool;
+	std::unique_ptr<FrameQueue<PooledFrame>> receiveQueue;
+	void receive_loop();
+	void push_frame(PooledFrame& frame);
+	bool wait_readable();
+	void stop_receive_thread();
+	boost::system::error_code& read_error();
+
+	std::atomic<bool> capturing{false};
+	CaptureWriter capture;
+	void replay_loop(std::unique_ptr<CaptureReader> reader, bool paced);
+
+	// Background sending, see start_send_thread.
+	std::thread sendThread;
+	// Set from before the send thread starts until it is joined, for the
+	// receive thread, which can not look at sendThread itself.
+	std::atomic<bool> sendThreadActive{false};
+	std::atomic<bool> sendThreadDone{false};
+	boost::system::error_code sendError;
+	std::unique_ptr<SendQueue> sendQueue;
+	std::vector<char> queuedFrame;
+	void send_loop();
+	void write_secure(const std::vector<char>& pending, boost::system::error_code& error);
+	void stop_send_thread();
+
+	size_t maxDatagramSize = 1472;
 public:
+	SocketWrapper();
+	// Runs the sockets on an io context owned by someone else, typically
+	// a context shared by many connections and run by a pool of threads.
+	explicit SocketWrapper(boost::asio::io_context& sharedContext);
+	~SocketWrapper();
+
+	SocketWrapper(const SocketWrapper&) = delete;
+	SocketWrapper& operator=(const SocketWrapper&) = delete;
+
 	boost::system::error_code lastError;
+	// Recorded into from every thread of the connection, so it is turned
+	// on through enable_trace, which only resizes it while none runs.
+	TraceLog trace;
+	int enable_trace(size_t capacity);
+	SocketStats stats;
 	bool sslEnabled = false;
-	bool blocking = false;
+	// Without blocking, receive_frames returns 0 instead of waiting for a
+	// message. poll and poll_bytes never block.
+	bool blocking = true;
+	bool noDelay = true;
+	// Runs tls on the socket and hands the keys to the kernel after the
+	// handshake where Linux supports it, falling back to OpenSSL reading
+	// whole records itself. Applies from the next connect, tls_path tells
+	// which path the connection got.
+	bool kernelTls = false;
+	TlsPath tls_path() const;
+	// Hostnames starting with "unix:" connect to the AF_UNIX stream socket
+	// at the path that follows, the port is not used. With a size here,
+	// such a connection hands messages through a shared memory ring of
+	// that many bytes each way instead, see SharedRing. Both apply from
+	// the next connect.
+	size_t sharedRingSize = 0;
+	// "tcp", "unix" or "shared_memory".
+	const char* transport() const;
 	int connect(const char* hostname, int port);
 	void close();
+
+	// Connects on a thread of its own, so the caller never waits on the
+	// network, see connect_async in SocketWrapper.cpp. poll_connect
+	// returns true once, with the report, when it is done. Until then
+	// sending, receiving and starting threads fail with not_connected.
+	ConnectTimeouts connectTimeouts;
+	int connect_async(const char* hostname, int port);
+	bool is_connecting() const;
+	bool poll_connect(ConnectReport& report);
+
+	// Connects again to the host of the last connect, see reconnect in
+	// SocketWrapper.cpp. The delay between failed attempts starts at
+	// reconnectDelayMs and doubles up to maxReconnectDelayMs.
+	// reconnect_async waits it out on the connect thread.
+	int reconnectDelayMs = 100;
+	int maxReconnectDelayMs = 5000;
+	int reconnect(int maxAttempts);
+	int reconnect_async(int maxAttempts);
+	bool session_resumed() const;
 	const int receive_ushort(unsigned short &header);
 	int receive_bytes(int numBytes, char* byte_buffer);
 
 	int send_ushort(unsigned short ushort);
 	int send_bytes(const char* bytes, int numBytes);
+
+	// -1 for Fixed framing without a size, whose empty messages would
+	// never move the stream on.
+	int set_framing(FrameFormat format, size_t fixedSize = 0);
+	void set_max_message_size(size_t size);
+	// Switches to Delimited framing, -1 for a delimiter that is empty or
+	// longer than MAX_FRAME_DELIMITER_SIZE. Sending a message that holds
+	// the delimiter fails, as its receiver would split it.
+	int set_delimiter(const char* bytes, size_t size);
+	size_t max_message_size() const;
+
+	// Header and body of a message go out in a single write, as do all
+	// messages passed to send_frames. Staged messages are kept until
+	// flush_staged writes them together.
+	int send_frame(const char* bytes, int numBytes, bool withHeader);
+	int send_frames(const std::vector<boost::asio::const_buffer>& messages, bool withHeader);
+	int stage_frame(const char* bytes, int numBytes, bool withHeader);
+	int flush_staged();
+	size_t staged_bytes() const;
+	size_t buffered_bytes() const;
+
+	// Compresses framed messages from threshold bytes up, see
+	// FrameCompressor. Received bodies go through decode_frame, which
+	// writes the message straight into the destination. Both setters
+	// fail while the receive or send thread runs.
+	int set_compression(CompressionCodec codec, int level, size_t threshold);
+	int set_compression_dictionary(const char* bytes, size_t size);
+	bool compression_enabled() const;
+	int64_t decoded_size(const char* body, size_t size);
+	int decode_frame(const char* body, size_t size, char* destination, size_t decodedSize);
+
+	// Reads and consumes the next message header, bodySize is then read
+	// with receive_bytes. Large bodies are not buffered but read straight
+	// into the destination, so they can be as large as max_message_size.
+	int receive_header(size_t& bodySize);
+
+	// Batch receiving straight from the read ahead buffer. A single read
+	// usually picks up a whole burst of messages, which are then handed
+	// out together without further reads.
+	int receive_frames(std::vector<FrameSpan>& frames, int maxCount, bool waitFirst = false);
+	const char* frame_data(const FrameSpan& frame) const;
+	void release_frames();
+	void set_read_ahead_size(size_t size);
+
+	// Non blocking receive driven from the game loop, see poll in
+	// SocketWrapper.cpp. Returns 1 and the next message, or 0 for not yet.
+	int poll(FrameSpan& frame);
+	int poll_bytes(int numBytes, char* destination);
+
+	// Background receiving. The thread reads 2 byte header framed messages
+	// and pushes them on a bounded queue which is drained with pop_frame
+	// from the Godot main thread. The thread runs until close is called
+	// or the connection fails. Popped frames live in pooled memory which
+	// is recycled when the frame is destroyed or reset. Once it stopped on
+	// its own, join_finished_receive_thread puts its error in lastError.
+	int start_receive_thread(size_t queueSize);
+	bool is_receive_thread_running() const;
+	void join_finished_receive_thread();
+	bool pop_frame(PooledFrame& frame);
+	size_t queued_frames() const;
+	void set_frame_pool_size(size_t maxBytes);
+	const FramePool& frame_pool() const;
+
+	// Per message receive timestamps, see FrameTimestamps. Frames popped
+	// from the receive thread carry their own, the messages last returned
+	// by receive_frames, poll or receive_bytes share frame_timestamps.
+	// record_delivery stamps a message as handed over and adds it to the
+	// stage histograms in stats. Switched before start_receive_thread.
+	int set_timestamps(bool enabled);
+	bool timestamps_enabled() const;
+	static bool kernel_timestamps_supported();
+	const FrameTimestamps& frame_timestamps() const;
+	void record_delivery(FrameTimestamps& stamps);
+
+	// Background sending. Messages are framed on the calling thread and
+	// queued in a lane, see SendQueue, the thread writes them out so the
+	// caller never waits on a full socket buffer. queue_frame returns 1
+	// when queued, 0 when refused because the queue is above its high
+	// water mark, -1 if the message can not be framed. While the thread
+	// runs, messages have to go through queue_frame only.
+	int start_send_thread(size_t highWaterMark);
+	bool is_send_thread_running() const;
+	int queue_frame(const char* bytes, int numBytes, bool withHeader, SendLane lane);
+	size_t queued_send_bytes() const;
+	size_t send_high_water_mark() const;
+
+	// Records every message sent and received into a capture file, see
+	// FrameCapture.hpp. Messages Socket reads past decode_frame are
+	// recorded with capture_frame. flush_capture writes out records
+	// buffered for a second, it is called once a frame.
+	int start_capture(const char* path);
+	void stop_capture();
+	bool is_capturing() const;
+	void capture_frame(CaptureKind kind, const char* bytes, size_t size);
+	void flush_capture();
+
+	// Plays the received stream messages of a capture file into the
+	// receive queue in place of the receive thread, at their original
+	// pacing or as fast as the queue is drained. The connection is not
+	// used, the replay ends like a receive thread whose peer closed.
+	int start_replay(const char* path, bool paced, size_t queueSize);
+
+	// Unreliable messages over UDP next to the stream, see DatagramChannel.
+	// Staged messages are packed into datagrams and sent by flush_datagrams,
+	// receive_datagrams drops stale datagrams and hands out the messages of
+	// the rest in pooled memory, waiting up to waitMs for the first one.
+	int open_datagrams(int remotePort, int localPort);
+	void close_datagrams();
+	bool datagrams_open() const;
+	int datagram_port() const;
+	void set_max_datagram_size(size_t size);
+	int stage_datagram(const char* bytes, int numBytes);
+	int flush_datagrams();
+	size_t staged_datagrams() const;
+	int receive_datagrams(std::vector<PooledFrame>& frames, int maxCount, int waitMs = 0);
 };
 
 #endif
-
@@ -0,0 +1,109 @@
+#include "TlsContext.hpp"
+
+#include <map>
+#include <mutex>
+
+#include "SocketStats.hpp"
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+
+/*
+ * TLS sessions of all connections, keyed by "host:port". OpenSSL hands
+ * every new session, a TLS 1.2 session id or a TLS 1.3 ticket, to
+ * store_session and prepare_client_session offers the cached one back,
+ * which turns the next handshake to that host into an abbreviated one.
+ */
+struct SessionCache {
+	std::mutex mutex;
+	std::map<std::string, SSL_SESSION*> sessions;
+	int keyIndex = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+
+	~SessionCache()
+	{
+		for(auto& entry : sessions) {
+			SSL_SESSION_free(entry.second);
+		}
+	}
+
+	// Returns a new reference, or nullptr when the host has no session.
+	SSL_SESSION* find(const std::string& key)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto entry = sessions.find(key);
+		if(entry == sessions.end()) {
+			return nullptr;
+		}
+		SSL_SESSION_up_ref(entry->second);
+		return entry->second;
+	}
+};
+
+static SessionCache& session_cache()
+{
+	static SessionCache cache;
+	return cache;
+}
+
+static int store_session(SSL* ssl, SSL_SESSION* session)
+{
+	SessionCache& cache = session_cache();
+	const std::string* key = (const std::string*) SSL_get_ex_data(ssl, cache.keyIndex);
+	if(key == nullptr) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	SSL_SESSION*& cached = cache.sessions[*key];
+	if(cached != nullptr) {
+		SSL_SESSION_free(cached);
+	}
+	cached = session;
+	return 1;
+}
+
+/*
+ * All client connections share one ssl context, which is what the
+ * session callback is registered on. Creating the context also loads
+ * the ciphers and is not cheap, so it is done once per process.
+ */
+std::shared_ptr<ssl::context> client_ssl_context()
+{
+	static std::shared_ptr<ssl::context> context = []() {
+		std::shared_ptr<ssl::context> created(new ssl::context(ssl::context::tls_client));
+		SSL_CTX_set_session_cache_mode(created->native_handle(),
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(created->native_handle(), store_session);
+		return created;
+	}();
+	return context;
+}
+
+bool prepare_client_session(SSL* ssl, const std::string& hostname, const std::string& sessionKey)
+{
+	SSL_set_ex_data(ssl, session_cache().keyIndex, (void*) &sessionKey);
+
+	// Servers pick the session and certificate by name, an ip address is
+	// not a valid server name.
+	error_code notAnAddress;
+	ip::make_address(hostname, notAnAddress);
+	if(notAnAddress) {
+		SSL_set_tlsext_host_name(ssl, hostname.c_str());
+	}
+
+	SSL_SESSION* session = session_cache().find(sessionKey);
+	if(session == nullptr) {
+		return false;
+	}
+	int offered = SSL_set_session(ssl, session);
+	SSL_SESSION_free(session);
+	return offered == 1;
+}
+
+void count_tls_records(int writing, int, int contentType, const void*, size_t, SSL*, void* arg)
+{
+	if(contentType != SSL3_RT_HEADER) {
+		return;
+	}
+	SocketStats* stats = (SocketStats*) arg;
+	count(writing ? stats->tlsRecordsOut : stats->tlsRecordsIn);
+}
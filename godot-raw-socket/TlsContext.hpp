@@ -0,0 +1,27 @@
+#ifndef TLS_CONTEXT_H
+#define TLS_CONTEXT_H
+
+#include <memory>
+#include <string>
+
+#include <boost/asio/ssl.hpp>
+
+/*
+ * Client side TLS shared by every connection in the process: a single
+ * ssl context, and a cache of the last session per "host:port" so that
+ * connecting to the same server again resumes instead of running a full
+ * handshake. Only included by the core sources, the Godot headers never
+ * see OpenSSL.
+ */
+std::shared_ptr<boost::asio::ssl::context> client_ssl_context();
+
+// Sets the server name and offers the cached session of sessionKey, true
+// when there was one. The key must outlive ssl, new sessions for it are
+// stored from a callback.
+bool prepare_client_session(SSL* ssl, const std::string& hostname, const std::string& sessionKey);
+
+// OpenSSL reports every record header it reads or writes through the
+// message callback, arg is the SocketStats the records are counted in.
+void count_tls_records(int writing, int version, int contentType, const void* buffer, size_t length, SSL* ssl, void* arg);
+
+#endif
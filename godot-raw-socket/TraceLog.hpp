@@ -0,0 +1,170 @@
+#ifndef TRACE_LOG_H
+#define TRACE_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * Binary event log for the io paths.
+ *
+ * Events are fixed size records written into a lock free ring, nothing is
+ * formatted or printed on the thread doing the io. The ring is allocated
+ * when tracing is enabled at runtime and read back with dump, which
+ * Socket.dump_trace turns into something readable.
+ *
+ * The SOCKET_TRACE_EVENT macro compiles to nothing unless SOCKET_TRACE is
+ * defined, which SConstruct does for debug builds and when trace=yes.
+ */
+enum TraceEvent : uint32_t {
+	TRACE_CONNECT,
+	TRACE_CONNECT_FAILED,
+	TRACE_CLOSE,
+	TRACE_READ,
+	TRACE_READ_FAILED,
+	TRACE_WRITE,
+	TRACE_WRITE_FAILED,
+	TRACE_FRAMES,
+	TRACE_MALFORMED_FRAME,
+	TRACE_QUEUE_FULL,
+	TRACE_RECONNECT,
+	TRACE_DATAGRAMS_IN,
+	TRACE_DATAGRAMS_OUT,
+	TRACE_SEND_REFUSED,
+	TRACE_EVENT_COUNT
+};
+
+inline const char* trace_event_name(uint32_t event)
+{
+	static const char* names[TRACE_EVENT_COUNT] = {
+		"connect",
+		"connect_failed",
+		"close",
+		"read",
+		"read_failed",
+		"write",
+		"write_failed",
+		"frames",
+		"malformed_frame",
+		"queue_full",
+		"reconnect",
+		"datagrams_in",
+		"datagrams_out",
+		"send_refused"
+	};
+	return event < TRACE_EVENT_COUNT ? names[event] : "unknown";
+}
+
+struct TraceRecord {
+	uint64_t timestamp;
+	uint32_t event;
+	int64_t a;
+	int64_t b;
+};
+
+class TraceLog {
+private:
+	/*
+	 * Each slot is guarded by a sequence number, odd while a writer is
+	 * filling it in, so dump can skip slots that are being overwritten.
+	 */
+	struct Slot {
+		std::atomic<uint64_t> sequence{0};
+		std::atomic<uint64_t> timestamp{0};
+		std::atomic<uint32_t> event{0};
+		std::atomic<int64_t> a{0};
+		std::atomic<int64_t> b{0};
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	size_t mask = 0;
+	std::atomic<bool> enabled{false};
+	std::atomic<uint64_t> next{0};
+public:
+	/*
+	 * Turns recording on, into a ring of capacity records rounded up to a
+	 * power of two. The ring is allocated by the first call and kept, an
+	 * io thread may still be writing into it right after disable. Another
+	 * capacity reallocates it only with resize set, which is only safe
+	 * while no io thread records. Returns false when the ring kept its
+	 * old size, recording is on either way.
+	 */
+	bool enable(size_t capacity, bool resize)
+	{
+		size_t size = 2;
+		while(size < capacity) {
+			size <<= 1;
+		}
+		bool resized = true;
+		if(!slots || (size != mask + 1 && resize)) {
+			slots.reset(new Slot[size]);
+			mask = size - 1;
+			next = 0;
+		} else if(size != mask + 1) {
+			resized = false;
+		}
+		enabled.store(true, std::memory_order_release);
+		return resized;
+	}
+
+	void disable()
+	{
+		enabled.store(false, std::memory_order_release);
+	}
+
+	bool is_enabled() const
+	{
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	void record(uint32_t event, int64_t a, int64_t b)
+	{
+		if(!enabled.load(std::memory_order_acquire)) {
+			return;
+		}
+		uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+		Slot& slot = slots[index & mask];
+		slot.sequence.store(index * 2 + 1, std::memory_order_release);
+		slot.timestamp.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+		slot.event.store(event, std::memory_order_relaxed);
+		slot.a.store(a, std::memory_order_relaxed);
+		slot.b.store(b, std::memory_order_relaxed);
+		slot.sequence.store(index * 2 + 2, std::memory_order_release);
+	}
+
+	// Copies the records still in the ring, oldest first.
+	void dump(std::vector<TraceRecord>& records) const
+	{
+		records.clear();
+		if(!slots) {
+			return;
+		}
+		uint64_t end = next.load(std::memory_order_acquire);
+		uint64_t begin = end > mask + 1 ? end - (mask + 1) : 0;
+
+		for(uint64_t index = begin; index < end; index++) {
+			const Slot& slot = slots[index & mask];
+			uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			TraceRecord record;
+			record.timestamp = slot.timestamp.load(std::memory_order_relaxed);
+			record.event = slot.event.load(std::memory_order_relaxed);
+			record.a = slot.a.load(std::memory_order_relaxed);
+			record.b = slot.b.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(sequence == index * 2 + 2 && slot.sequence.load(std::memory_order_relaxed) == sequence) {
+				records.push_back(record);
+			}
+		}
+	}
+};
+
+#ifdef SOCKET_TRACE
+#define SOCKET_TRACE_EVENT(log, event, a, b) (log).record((event), (int64_t) (a), (int64_t) (b))
+#else
+#define SOCKET_TRACE_EVENT(log, event, a, b) ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,1106 @@
+/*
+ * Loopback benchmark of the networking core, runs without Godot.
+ *
+ * Starts an echo server in process, over plain TCP and over TLS with a
+ * self signed certificate generated at startup, and measures round trips
+ * through SocketWrapper for a sweep of message sizes and batch depths.
+ * A batch of messages is sent with one send_frames call and then received
+ * back, the time for that is one round trip sample.
+ *
+ * Every run prints one JSON object per line, for example:
+ *   {"transport":"tls","message_size":256,"batch":8,"messages":80000,
+ *    "seconds":0.91,"messages_per_sec":87912,"mb_per_sec":21.4,
+ *    "rtt_usec":{"p50":88,"p99":140,"p999":412,"max":950}, ...}
+ *
+ * After the sweep each transport is reconnected a number of times, which
+ * reports reconnect and handshake times and how many TLS sessions were
+ * resumed instead of negotiated from scratch. Finally a SocketReactor
+ * runs 100 connections echoing messages at once, with 1, 2 and 4
+ * worker threads, and the datagram channel is run against a UDP echo
+ * which sends every 100th datagram twice, to exercise the stale drop.
+ * When built with lz4=yes or zstd=yes, compressible 4 KiB messages are
+ * echoed with each codec that is compiled in. Delimiter framing reports
+ * the scan throughput on its own as well as line echo rates. TLS runs
+ * once more through the asio stream and with kernel tls asked for, and
+ * reports the path the connection got. The local transports, a unix
+ * socket and the shared memory ring, run the same sweep as TCP against
+ * an echo server on a socket file in the temp directory.
+ *
+ * Usage: SocketBenchmark [messages per run] [tcp|tls|local|both]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <unistd.h>
+#endif
+
+#include "SharedRing.hpp"
+#include "SocketReactor.hpp"
+#include "SocketWrapper.hpp"
+
+using namespace boost::asio;
+using error_code = boost::system::error_code;
+
+static const size_t MESSAGE_SIZES[] = { 16, 64, 256, 1024, 4096, 16384 };
+static const size_t BATCH_DEPTHS[] = { 1, 8, 64 };
+
+// The client only starts reading once a whole batch is written, larger
+// batches could fill both socket buffers and stall the echo.
+static const size_t MAX_BYTES_IN_FLIGHT = 256 * 1024;
+// Holds a whole batch each way, for the same reason.
+static const size_t SHARED_RING_SIZE = 1024 * 1024;
+
+/*
+ * Self signed P-256 certificate for localhost, only used to give the
+ * loopback server something to present.
+ */
+static bool make_self_signed(ssl::context& context)
+{
+	EVP_PKEY* key = nullptr;
+	EVP_PKEY_CTX* keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+	if(keyContext == nullptr ||
+		EVP_PKEY_keygen_init(keyContext) <= 0 ||
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) <= 0 ||
+		EVP_PKEY_keygen(keyContext, &key) <= 0) {
+		EVP_PKEY_CTX_free(keyContext);
+		return false;
+	}
+	EVP_PKEY_CTX_free(keyContext);
+
+	X509* certificate = X509_new();
+	X509_set_version(certificate, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+	X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+	X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 60 * 60);
+	X509_set_pubkey(certificate, key);
+
+	X509_NAME* name = X509_get_subject_name(certificate);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*) "localhost", -1, -1, 0);
+	X509_set_issuer_name(certificate, name);
+	X509_sign(certificate, key, EVP_sha256());
+
+	bool ok = SSL_CTX_use_certificate(context.native_handle(), certificate) == 1 &&
+		SSL_CTX_use_PrivateKey(context.native_handle(), key) == 1;
+	X509_free(certificate);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+/*
+ * Echoes every byte back. Framing does not matter to an echo server,
+ * whatever the client sends comes back in the same order.
+ */
+template<typename Stream>
+static void echo(Stream& stream)
+{
+	std::vector<char> buffer(256 * 1024);
+	error_code error;
+	while(true) {
+		size_t received = stream.read_some(boost::asio::buffer(buffer), error);
+		if(error || received == 0) {
+			return;
+		}
+		write(stream, boost::asio::buffer(buffer.data(), received), error);
+		if(error) {
+			return;
+		}
+	}
+}
+
+// The same through a shared ring, until the client closes it.
+static void echo(SharedRing& ring)
+{
+	std::vector<char> buffer(256 * 1024);
+	while(!ring.peer_closed() || ring.readable() > 0) {
+		size_t received = ring.read(buffer.data(), buffer.size());
+		if(received == 0) {
+			ring.wait_readable(50);
+			continue;
+		}
+		for(size_t written = 0; written < received; ) {
+			size_t copied = ring.write(buffer.data() + written, received - written);
+			if(copied == 0) {
+				if(ring.peer_closed()) {
+					return;
+				}
+				ring.wait_writable(50);
+			}
+			written += copied;
+		}
+	}
+}
+
+// One thread per accepted connection.
+class EchoServer {
+private:
+	io_context ioContext;
+	ip::tcp::acceptor acceptor;
+	ssl::context sslContext;
+	bool useTls;
+	std::atomic<bool> stopping{false};
+	std::thread acceptThread;
+	std::vector<std::thread> connectionThreads;
+
+	void accept_loop()
+	{
+		while(true) {
+			std::shared_ptr<ip::tcp::socket> socket(new ip::tcp::socket(ioContext));
+			error_code error;
+			acceptor.accept(*socket, error);
+			if(error || stopping) {
+				return;
+			}
+			socket->set_option(ip::tcp::no_delay(true), error);
+
+			connectionThreads.emplace_back([this, socket]() {
+				if(useTls) {
+					ssl::stream<ip::tcp::socket&> stream(*socket, sslContext);
+					error_code handshakeError;
+					stream.handshake(ssl::stream_base::server, handshakeError);
+					if(!handshakeError) {
+						echo(stream);
+					}
+				} else {
+					echo(*socket);
+				}
+			});
+		}
+	}
+public:
+	explicit EchoServer(bool tls) :
+		acceptor(ioContext, ip::tcp::endpoint(ip::address_v4::loopback(), 0)),
+		sslContext(ssl::context::tls_server),
+		useTls(tls)
+	{
+		if(useTls && !make_self_signed(sslContext)) {
+			fprintf(stderr, "Failed to create a self signed certificate.\n");
+			exit(1);
+		}
+		acceptThread = std::thread(&EchoServer::accept_loop, this);
+	}
+
+	~EchoServer()
+	{
+		// Closing the acceptor does not wake a blocking accept, a last
+		// connection does.
+		stopping = true;
+		error_code ignored;
+		ip::tcp::socket wakeUp(ioContext);
+		wakeUp.connect(acceptor.local_endpoint(), ignored);
+		acceptThread.join();
+		acceptor.close(ignored);
+		for(std::thread& thread : connectionThreads) {
+			thread.join();
+		}
+	}
+
+	int port() const
+	{
+		return acceptor.local_endpoint().port();
+	}
+};
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+/*
+ * EchoServer for unix: addresses, on a socket file in the temp directory.
+ * With a shared ring, each client hands one over right after connecting
+ * and the echo goes through it, as with a game server that accepts
+ * set_shared_memory_ring.
+ */
+class LocalEchoServer {
+private:
+	io_context ioContext;
+	std::string socketPath;
+	local::stream_protocol::acceptor acceptor;
+	bool useRing;
+	std::atomic<bool> stopping{false};
+	std::thread acceptThread;
+	std::vector<std::thread> connectionThreads;
+
+	void accept_loop()
+	{
+		while(true) {
+			std::shared_ptr<local::stream_protocol::socket> socket(new local::stream_protocol::socket(ioContext));
+			error_code error;
+			acceptor.accept(*socket, error);
+			if(error || stopping) {
+				return;
+			}
+
+			connectionThreads.emplace_back([this, socket]() {
+				if(!useRing) {
+					echo(*socket);
+					return;
+				}
+				SharedRing ring;
+				if(ring.accept(socket->native_handle()) == 0) {
+					echo(ring);
+					ring.close();
+				}
+			});
+		}
+	}
+
+	static std::string temp_path(bool ring)
+	{
+		const char* directory = getenv("TMPDIR");
+		return std::string(directory ? directory : "/tmp") + "/SocketBenchmark-" +
+			std::to_string(getpid()) + (ring ? "-ring" : "") + ".sock";
+	}
+public:
+	explicit LocalEchoServer(bool sharedRing) :
+		socketPath(temp_path(sharedRing)),
+		acceptor(ioContext),
+		useRing(sharedRing)
+	{
+		unlink(socketPath.c_str());
+		local::stream_protocol::endpoint endpoint(socketPath);
+		acceptor.open(endpoint.protocol());
+		acceptor.bind(endpoint);
+		acceptor.listen();
+		acceptThread = std::thread(&LocalEchoServer::accept_loop, this);
+	}
+
+	~LocalEchoServer()
+	{
+		stopping = true;
+		error_code ignored;
+		local::stream_protocol::socket wakeUp(ioContext);
+		wakeUp.connect(acceptor.local_endpoint(), ignored);
+		acceptThread.join();
+		acceptor.close(ignored);
+		for(std::thread& thread : connectionThreads) {
+			thread.join();
+		}
+		unlink(socketPath.c_str());
+	}
+
+	std::string address() const
+	{
+		return "unix:" + socketPath;
+	}
+};
+#endif
+
+class DatagramEcho {
+private:
+	io_context ioContext;
+	ip::udp::socket socket;
+	std::atomic<bool> stopping{false};
+	std::thread thread;
+
+	void echo_loop()
+	{
+		std::vector<char> buffer(65536);
+		ip::udp::endpoint sender;
+		uint64_t received = 0;
+		while(true) {
+			error_code error;
+			size_t size = socket.receive_from(boost::asio::buffer(buffer), sender, 0, error);
+			if(stopping) {
+				return;
+			}
+			if(error) {
+				continue;
+			}
+			socket.send_to(boost::asio::buffer(buffer.data(), size), sender, 0, error);
+			if(++received % 100 == 0) {
+				socket.send_to(boost::asio::buffer(buffer.data(), size), sender, 0, error);
+			}
+		}
+	}
+public:
+	DatagramEcho() :
+		socket(ioContext, ip::udp::endpoint(ip::address_v4::loopback(), 0))
+	{
+		socket.set_option(socket_base::receive_buffer_size(4 * 1024 * 1024));
+		thread = std::thread(&DatagramEcho::echo_loop, this);
+	}
+
+	~DatagramEcho()
+	{
+		stopping = true;
+		error_code ignored;
+		ip::udp::socket wakeUp(ioContext, ip::udp::v4());
+		wakeUp.send_to(boost::asio::buffer("", 0), socket.local_endpoint(), 0, ignored);
+		thread.join();
+	}
+
+	int port() const
+	{
+		return socket.local_endpoint().port();
+	}
+};
+
+static double elapsed_seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_histogram(const char* name, const Histogram& histogram)
+{
+	printf("\"%s\":{\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}", name,
+		(unsigned long long) histogram.percentile(0.5),
+		(unsigned long long) histogram.percentile(0.99),
+		(unsigned long long) histogram.percentile(0.999),
+		(unsigned long long) histogram.max());
+}
+
+static bool run(const std::string& host, int port, bool tls, size_t sharedRingSize,
+	size_t messageSize, size_t batch, size_t messages)
+{
+	SocketWrapper client;
+	client.sslEnabled = tls;
+	client.sharedRingSize = sharedRingSize;
+	client.blocking = true;
+	if(client.connect(host.c_str(), port) != 0) {
+		fprintf(stderr, "Connect failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	std::vector<char> payload(messageSize, 'x');
+	std::vector<const_buffer> buffers(batch, boost::asio::buffer(payload));
+	std::vector<FrameSpan> frames;
+	Histogram roundTrips;
+	size_t batches = (messages + batch - 1) / batch;
+
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < batches; i++) {
+		auto sent = std::chrono::steady_clock::now();
+		if(client.send_frames(buffers, true) == -1) {
+			fprintf(stderr, "Send failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+
+		size_t received = 0;
+		while(received < batch) {
+			int count = client.receive_frames(frames, (int) (batch - received));
+			if(count == -1) {
+				fprintf(stderr, "Receive failed: %s\n", client.lastError.message().c_str());
+				return false;
+			}
+			received += count;
+			client.release_frames();
+		}
+		roundTrips.record(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - sent).count());
+	}
+	double seconds = elapsed_seconds(start);
+	std::string transport = tls ? "tls" : client.transport();
+	client.close();
+
+	size_t total = batches * batch;
+	const SocketStats& stats = client.stats;
+	printf("{\"transport\":\"%s\",\"message_size\":%zu,\"batch\":%zu,\"messages\":%zu,"
+		"\"seconds\":%.6f,\"messages_per_sec\":%.0f,\"mb_per_sec\":%.3f,",
+		transport.c_str(), messageSize, batch, total,
+		seconds, total / seconds, total * messageSize / seconds / (1024.0 * 1024.0));
+	print_histogram("rtt_usec", roundTrips);
+	printf(",\"read_calls\":%llu,\"write_calls\":%llu,\"tls_records_in\":%llu,\"tls_records_out\":%llu}\n",
+		(unsigned long long) stats.readCalls.load(),
+		(unsigned long long) stats.writeCalls.load(),
+		(unsigned long long) stats.tlsRecordsIn.load(),
+		(unsigned long long) stats.tlsRecordsOut.load());
+	fflush(stdout);
+	return true;
+}
+
+// One message there and back, which also makes the client read the
+// session ticket a TLS 1.3 server sends after the handshake.
+static bool round_trip(SocketWrapper& client)
+{
+	std::vector<FrameSpan> frames;
+	if(client.send_frame("ping", 4, true) == -1) {
+		return false;
+	}
+	while(frames.empty()) {
+		if(client.receive_frames(frames, 1) == -1) {
+			return false;
+		}
+	}
+	client.release_frames();
+	return true;
+}
+
+static bool run_reconnects(bool tls, int port, int reconnects)
+{
+	SocketWrapper client;
+	client.sslEnabled = tls;
+	client.blocking = true;
+	if(client.connect("127.0.0.1", port) != 0 || !round_trip(client)) {
+		fprintf(stderr, "Connect failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+	// The first connect may resume a session of an earlier run already.
+	uint64_t resumedBefore = client.stats.resumedSessions.load();
+
+	for(int i = 0; i < reconnects; i++) {
+		if(client.reconnect(3) != 0 || !round_trip(client)) {
+			fprintf(stderr, "Reconnect failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+	}
+	client.close();
+
+	const SocketStats& stats = client.stats;
+	uint64_t resumed = stats.resumedSessions.load() - resumedBefore;
+	printf("{\"transport\":\"%s\",\"reconnects\":%llu,\"resumed_sessions\":%llu,",
+		tls ? "tls" : "tcp",
+		(unsigned long long) stats.reconnects.load(),
+		(unsigned long long) resumed);
+	print_histogram("reconnect_usec", stats.reconnectUsec);
+	printf(",");
+	print_histogram("handshake_usec", stats.handshakeUsec);
+	printf("}\n");
+	fflush(stdout);
+	if(tls && resumed != stats.reconnects.load()) {
+		fprintf(stderr, "Only %llu of %llu reconnects resumed their session\n",
+			(unsigned long long) resumed, (unsigned long long) stats.reconnects.load());
+		return false;
+	}
+	return true;
+}
+
+static bool run_reactor(bool tls, int port, int connectionCount, int threads, size_t messagesPerConnection)
+{
+	SocketReactor reactor(threads, 65536);
+	reactor.sslEnabled = tls;
+	for(int i = 0; i < connectionCount; i++) {
+		reactor.connect("127.0.0.1", port);
+	}
+
+	ReactorEvent event;
+	int connected = 0;
+	std::vector<int> ids;
+	while(connected < connectionCount) {
+		if(!reactor.pop_event(event)) {
+			std::this_thread::yield();
+			continue;
+		}
+		if(event.type != ReactorEventType::Connected) {
+			fprintf(stderr, "Reactor connect failed: %s\n", event.error.message().c_str());
+			return false;
+		}
+		ids.push_back(event.connectionId);
+		connected++;
+	}
+
+	std::vector<char> payload(64, 'x');
+	size_t expected = messagesPerConnection * connectionCount;
+	size_t received = 0;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < messagesPerConnection; i++) {
+		for(int id : ids) {
+			reactor.send_frame(id, payload.data(), payload.size());
+		}
+	}
+	while(received < expected) {
+		if(!reactor.pop_event(event)) {
+			std::this_thread::yield();
+			continue;
+		}
+		if(event.type != ReactorEventType::Message) {
+			fprintf(stderr, "Reactor connection lost: %s\n", event.error.message().c_str());
+			return false;
+		}
+		received++;
+	}
+	double seconds = elapsed_seconds(start);
+	reactor.close_all();
+
+	const SocketStats& stats = reactor.stats;
+	printf("{\"transport\":\"%s\",\"reactor_threads\":%d,\"connections\":%d,\"messages\":%zu,"
+		"\"seconds\":%.6f,\"messages_per_sec\":%.0f,\"read_calls\":%llu,\"write_calls\":%llu}\n",
+		tls ? "tls" : "tcp", threads, connectionCount, expected, seconds, expected / seconds,
+		(unsigned long long) stats.readCalls.load(),
+		(unsigned long long) stats.writeCalls.load());
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Sends bursts of datagram messages to the echo and collects them again.
+ * Nothing is resent, so lost messages are only counted, the interesting
+ * numbers are datagrams per receive call and the stale drops.
+ */
+static bool run_datagrams(int port, int datagramPort, size_t messageSize, size_t messages)
+{
+	SocketWrapper client;
+	if(client.connect("127.0.0.1", port) != 0 || client.open_datagrams(datagramPort, 0) == -1) {
+		fprintf(stderr, "Datagram setup failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	const size_t burst = 64;
+	std::vector<char> payload(messageSize, 'x');
+	std::vector<PooledFrame> frames;
+	size_t received = 0;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t sent = 0; sent < messages; sent += burst) {
+		for(size_t i = 0; i < burst; i++) {
+			if(client.stage_datagram(payload.data(), (int) payload.size()) == -1) {
+				fprintf(stderr, "Datagram staging failed.\n");
+				return false;
+			}
+		}
+		if(client.flush_datagrams() == -1) {
+			fprintf(stderr, "Datagram flush failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+
+		size_t wanted = received + burst;
+		auto waitStart = std::chrono::steady_clock::now();
+		while(received < wanted && elapsed_seconds(waitStart) < 0.1) {
+			frames.clear();
+			int waitMs = 100 - (int) (elapsed_seconds(waitStart) * 1000);
+			int count = client.receive_datagrams(frames, (int) (wanted - received), waitMs < 1 ? 1 : waitMs);
+			if(count == -1) {
+				fprintf(stderr, "Datagram receive failed: %s\n", client.lastError.message().c_str());
+				return false;
+			}
+			received += count;
+		}
+	}
+	double seconds = elapsed_seconds(start);
+	client.close();
+
+	const SocketStats& stats = client.stats;
+	size_t sentMessages = (messages + burst - 1) / burst * burst;
+	printf("{\"transport\":\"udp\",\"message_size\":%zu,\"messages\":%zu,\"received\":%zu,"
+		"\"seconds\":%.6f,\"messages_per_sec\":%.0f,\"datagrams_out\":%llu,\"datagrams_in\":%llu,"
+		"\"send_calls\":%llu,\"receive_calls\":%llu,\"stale\":%llu,\"dropped\":%llu}\n",
+		messageSize, sentMessages, received, seconds, received / seconds,
+		(unsigned long long) stats.datagramsOut.load(),
+		(unsigned long long) stats.datagramsIn.load(),
+		(unsigned long long) stats.datagramSendCalls.load(),
+		(unsigned long long) stats.datagramReceiveCalls.load(),
+		(unsigned long long) stats.staleDatagrams.load(),
+		(unsigned long long) stats.droppedDatagrams.load());
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Echoes JSON like messages with compression on. The echo sends the
+ * compressed frames back as they are, so every message is compressed
+ * once and decompressed once.
+ */
+static bool run_compression(int port, const char* codecName, CompressionCodec codec, size_t messages)
+{
+	SocketWrapper client;
+	if(client.connect("127.0.0.1", port) != 0 || client.set_compression(codec, 0, 256) == -1) {
+		fprintf(stderr, "Compression setup failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	std::string payload;
+	for(int i = 0; payload.size() < 4096; i++) {
+		payload += "{\"slot\":" + std::to_string(i) + ",\"item\":\"iron_sword\",\"count\":1,\"durability\":"
+			+ std::to_string(100 - i % 7) + "},";
+	}
+	payload.resize(4096);
+
+	std::vector<FrameSpan> frames;
+	std::vector<char> message(payload.size());
+	size_t received = 0;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t sent = 0; sent < messages; sent++) {
+		if(client.send_frame(payload.data(), (int) payload.size(), true) == -1) {
+			fprintf(stderr, "Compressed send failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+		while(received <= sent) {
+			int count = client.receive_frames(frames, 64, true);
+			if(count == -1) {
+				fprintf(stderr, "Compressed receive failed: %s\n", client.lastError.message().c_str());
+				return false;
+			}
+			for(const FrameSpan& frame : frames) {
+				const char* body = client.frame_data(frame);
+				if(client.decoded_size(body, frame.size) != (int64_t) payload.size() ||
+					client.decode_frame(body, frame.size, message.data(), message.size()) == -1 ||
+					memcmp(message.data(), payload.data(), payload.size()) != 0) {
+					fprintf(stderr, "Compressed message came back different.\n");
+					return false;
+				}
+				received++;
+			}
+			client.release_frames();
+		}
+	}
+	double seconds = elapsed_seconds(start);
+	client.close();
+
+	const SocketStats& stats = client.stats;
+	printf("{\"transport\":\"tcp\",\"compression\":\"%s\",\"message_size\":%zu,\"messages\":%zu,"
+		"\"seconds\":%.6f,\"messages_per_sec\":%.0f,\"ratio\":%.2f,\"wire_bytes_out\":%llu,",
+		codecName, payload.size(), messages, seconds, messages / seconds,
+		(double) stats.uncompressedBytesOut.load() / stats.compressedBytesOut.load(),
+		(unsigned long long) stats.bytesOut.load());
+	print_histogram("compress_nsec", stats.compressNsec);
+	printf(",");
+	print_histogram("decompress_nsec", stats.decompressNsec);
+	printf("}\n");
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Ping pong through the receive thread with timestamps on, reporting how
+ * long messages spend in each stage between the kernel and the consumer.
+ */
+static bool run_timestamps(bool tls, int port, size_t messages)
+{
+	SocketWrapper client;
+	client.sslEnabled = tls;
+	client.set_timestamps(true);
+	if(client.connect("127.0.0.1", port) != 0 || client.start_receive_thread(256) != 0) {
+		fprintf(stderr, "Timestamps setup failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	std::vector<char> payload(64, 't');
+	PooledFrame frame;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t sent = 0; sent < messages; sent++) {
+		if(client.send_frame(payload.data(), (int) payload.size(), true) == -1) {
+			fprintf(stderr, "Timestamps send failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+		while(!client.pop_frame(frame)) {
+			if(!client.is_receive_thread_running()) {
+				fprintf(stderr, "Timestamps receive failed.\n");
+				return false;
+			}
+		}
+		client.record_delivery(frame.timestamps);
+		frame.reset();
+	}
+	double seconds = elapsed_seconds(start);
+	client.close();
+
+	const SocketStats& stats = client.stats;
+	printf("{\"transport\":\"%s\",\"timestamps\":true,\"message_size\":%zu,\"messages\":%zu,"
+		"\"seconds\":%.6f,\"messages_per_sec\":%.0f,",
+		tls ? "tls" : "tcp", payload.size(), messages, seconds, messages / seconds);
+	print_histogram("kernel_to_read_usec", stats.kernelToReadUsec);
+	printf(",");
+	print_histogram("read_to_decode_usec", stats.readToDecodeUsec);
+	printf(",");
+	print_histogram("decode_to_deliver_usec", stats.decodeToDeliverUsec);
+	printf(",");
+	print_histogram("kernel_to_deliver_usec", stats.kernelToDeliverUsec);
+	printf("}\n");
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Floods the bulk lane of the send thread while queueing small input
+ * messages in between, reporting how long each lane waited and how
+ * often the high water mark turned messages away.
+ */
+static bool run_send_lanes(bool tls, int port, size_t messages)
+{
+	SocketWrapper client;
+	client.sslEnabled = tls;
+	if(client.connect("127.0.0.1", port) != 0 || client.start_receive_thread(4096) != 0 ||
+		client.start_send_thread(256 * 1024) != 0) {
+		fprintf(stderr, "Send lanes setup failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	std::vector<char> bulk(4096, 'b');
+	std::vector<char> input(16, 'i');
+	PooledFrame frame;
+	size_t echoed = 0;
+	size_t queued = 0;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t i = 0; i < messages; i++) {
+		if(i % 16 == 0) {
+			if(client.queue_frame(input.data(), (int) input.size(), true, SendLane::Input) == 1) {
+				queued++;
+			}
+		}
+		while(client.queue_frame(bulk.data(), (int) bulk.size(), true, SendLane::Bulk) == 0) {
+			while(client.pop_frame(frame)) {
+				echoed++;
+			}
+			std::this_thread::yield();
+		}
+		queued++;
+		while(client.pop_frame(frame)) {
+			echoed++;
+		}
+	}
+	while(echoed < queued) {
+		if(!client.is_receive_thread_running() || !client.is_send_thread_running()) {
+			fprintf(stderr, "Send lanes connection failed.\n");
+			return false;
+		}
+		while(client.pop_frame(frame)) {
+			echoed++;
+		}
+		std::this_thread::yield();
+	}
+	double seconds = elapsed_seconds(start);
+	client.close();
+
+	const SocketStats& stats = client.stats;
+	printf("{\"transport\":\"%s\",\"send_lanes\":true,\"messages\":%zu,\"seconds\":%.6f,"
+		"\"mb_per_sec\":%.3f,\"refused_messages\":%llu,\"write_calls\":%llu,",
+		tls ? "tls" : "tcp", queued, seconds, messages * bulk.size() / seconds / (1024 * 1024),
+		(unsigned long long) stats.refusedMessages.load(), (unsigned long long) stats.writeCalls.load());
+	print_histogram("input_queue_usec", stats.inputQueueUsec);
+	printf(",");
+	print_histogram("bulk_queue_usec", stats.bulkQueueUsec);
+	printf("}\n");
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Captures an echo run, then replays the capture as fast as it can be
+ * drained, which is how fast game side handling of a recorded match can
+ * be benchmarked.
+ */
+static bool run_capture_replay(int port, size_t messages)
+{
+	const char* path = "SocketBenchmark.capture";
+	SocketWrapper client;
+	if(client.connect("127.0.0.1", port) != 0 || client.start_capture(path) != 0) {
+		fprintf(stderr, "Capture setup failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	std::vector<char> payload(64, 'c');
+	std::vector<boost::asio::const_buffer> batch(64, boost::asio::buffer(payload));
+	std::vector<FrameSpan> frames;
+	size_t received = 0;
+	while(received < messages) {
+		if(client.send_frames(batch, true) == -1) {
+			fprintf(stderr, "Capture send failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+		for(size_t echoed = 0; echoed < batch.size(); ) {
+			int count = client.receive_frames(frames, 64, true);
+			if(count == -1) {
+				fprintf(stderr, "Capture receive failed: %s\n", client.lastError.message().c_str());
+				return false;
+			}
+			for(const FrameSpan& frame : frames) {
+				client.decode_frame(client.frame_data(frame), frame.size, payload.data(), payload.size());
+			}
+			client.release_frames();
+			echoed += count;
+		}
+		received += batch.size();
+	}
+	client.stop_capture();
+	client.close();
+
+	SocketWrapper replayer;
+	if(replayer.start_replay(path, false, 4096) != 0) {
+		fprintf(stderr, "Replay setup failed: %s\n", replayer.lastError.message().c_str());
+		return false;
+	}
+	PooledFrame frame;
+	size_t replayed = 0;
+	auto start = std::chrono::steady_clock::now();
+	while(replayer.is_receive_thread_running() || replayer.queued_frames() > 0) {
+		while(replayer.pop_frame(frame)) {
+			replayed++;
+		}
+	}
+	double seconds = elapsed_seconds(start);
+	remove(path);
+	if(replayed != received) {
+		fprintf(stderr, "Replayed %zu of %zu captured messages.\n", replayed, received);
+		return false;
+	}
+
+	printf("{\"transport\":\"replay\",\"message_size\":%zu,\"messages\":%zu,\"seconds\":%.6f,"
+		"\"messages_per_sec\":%.0f}\n", payload.size(), replayed, seconds, replayed / seconds);
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Delimiter framing: first the scan alone over a buffer of text lines
+ * ending in "\r\n", then lines echoed in batches of 64, each checked
+ * to come back whole.
+ */
+static bool run_delimited(bool tls, int port, size_t messages)
+{
+	FrameDelimiter delimiter;
+	delimiter.assign("\r\n", 2);
+	std::string text;
+	for(size_t line = 0; text.size() < 4 * 1024 * 1024; line++) {
+		text.append(16 + (line * 7919) % 240, (char) ('a' + line % 26));
+		text.append("\r\n");
+	}
+
+	std::vector<FrameSpan> frames;
+	size_t lines = 0;
+	int passes = 20;
+	auto start = std::chrono::steady_clock::now();
+	for(int pass = 0; pass < passes; pass++) {
+		size_t position = 0;
+		while(position < text.size()) {
+			size_t pending = 0;
+			size_t searched = 0;
+			frames.clear();
+			position += scan_delimited(delimiter, text.data() + position, text.size() - position,
+				4096, text.size(), frames, pending, searched);
+			lines += frames.size();
+		}
+	}
+	double scanSeconds = elapsed_seconds(start);
+
+	SocketWrapper client;
+	client.sslEnabled = tls;
+	if(client.connect("127.0.0.1", port) != 0 || client.set_delimiter("\r\n", 2) != 0) {
+		fprintf(stderr, "Delimited setup failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+	std::string payload(62, 'd');
+	std::vector<const_buffer> batch(64, boost::asio::buffer(payload));
+	size_t received = 0;
+	start = std::chrono::steady_clock::now();
+	while(received < messages) {
+		if(client.send_frames(batch, true) == -1) {
+			fprintf(stderr, "Delimited send failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+		for(size_t echoed = 0; echoed < batch.size(); ) {
+			int count = client.receive_frames(frames, 64, true);
+			if(count == -1) {
+				fprintf(stderr, "Delimited receive failed: %s\n", client.lastError.message().c_str());
+				return false;
+			}
+			for(const FrameSpan& frame : frames) {
+				if(frame.size != payload.size() || memcmp(client.frame_data(frame), payload.data(), frame.size) != 0) {
+					fprintf(stderr, "Delimited line came back changed.\n");
+					return false;
+				}
+			}
+			client.release_frames();
+			echoed += count;
+		}
+		received += batch.size();
+	}
+	double seconds = elapsed_seconds(start);
+	client.close();
+
+	printf("{\"transport\":\"%s\",\"framing\":\"delimited\",\"isa\":\"%s\",\"scan_mb_per_sec\":%.1f,"
+		"\"scan_lines_per_sec\":%.0f,\"message_size\":%zu,\"messages\":%zu,\"seconds\":%.6f,"
+		"\"messages_per_sec\":%.0f}\n",
+		tls ? "tls" : "tcp", delimiter_search_isa(), passes * text.size() / scanSeconds / (1024.0 * 1024.0),
+		lines / scanSeconds, payload.size(), received, seconds, received / seconds);
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Echoes 1 KiB messages in batches of 64 over TLS through the asio ssl
+ * stream and with kernel tls asked for, which reports the path it got:
+ * the kernel, or OpenSSL on the socket when the kernel has no tls.
+ */
+static bool run_tls_path(int port, bool kernelTls, size_t messages)
+{
+	SocketWrapper client;
+	client.sslEnabled = true;
+	client.kernelTls = kernelTls;
+	if(client.connect("127.0.0.1", port) != 0) {
+		fprintf(stderr, "TLS path connect failed: %s\n", client.lastError.message().c_str());
+		return false;
+	}
+
+	std::vector<char> payload(1024);
+	for(size_t i = 0; i < payload.size(); i++) {
+		payload[i] = (char) i;
+	}
+	std::vector<const_buffer> batch(64, boost::asio::buffer(payload));
+	std::vector<FrameSpan> frames;
+	size_t received = 0;
+	auto start = std::chrono::steady_clock::now();
+	while(received < messages) {
+		if(client.send_frames(batch, true) == -1) {
+			fprintf(stderr, "TLS path send failed: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+		for(size_t echoed = 0; echoed < batch.size(); ) {
+			int count = client.receive_frames(frames, 64, true);
+			if(count == -1) {
+				fprintf(stderr, "TLS path receive failed: %s\n", client.lastError.message().c_str());
+				return false;
+			}
+			for(const FrameSpan& frame : frames) {
+				if(frame.size != payload.size() || memcmp(client.frame_data(frame), payload.data(), frame.size) != 0) {
+					fprintf(stderr, "TLS path message came back changed.\n");
+					return false;
+				}
+			}
+			client.release_frames();
+			echoed += count;
+		}
+		received += batch.size();
+	}
+	double seconds = elapsed_seconds(start);
+	TlsPath path = client.tls_path();
+	client.close();
+
+	const SocketStats& stats = client.stats;
+	printf("{\"transport\":\"tls\",\"tls_path\":\"%s\",\"message_size\":%zu,\"batch\":%zu,"
+		"\"messages\":%zu,\"seconds\":%.6f,\"messages_per_sec\":%.0f,\"mb_per_sec\":%.3f,"
+		"\"read_calls\":%llu,\"write_calls\":%llu}\n",
+		tls_path_name(path), payload.size(), batch.size(), received, seconds, received / seconds,
+		received * payload.size() / seconds / (1024.0 * 1024.0),
+		(unsigned long long) stats.readCalls.load(),
+		(unsigned long long) stats.writeCalls.load());
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * Connects with connect_async to "localhost", which races ::1 against
+ * 127.0.0.1, and polls for the outcome the way _process does. call_usec
+ * is how long connect_async kept the caller, the time a frame would lose.
+ */
+static bool run_connect_async(bool tls, int port, bool kernelTls, int connects)
+{
+	Histogram callUsec;
+	Histogram resolveUsec;
+	Histogram connectUsec;
+	Histogram handshakeUsec;
+	Histogram totalUsec;
+	SocketWrapper client;
+	client.sslEnabled = tls;
+	client.kernelTls = kernelTls;
+	int attempts = 0;
+
+	for(int i = 0; i < connects; i++) {
+		auto start = std::chrono::steady_clock::now();
+		if(client.connect_async("localhost", port) != 0) {
+			fprintf(stderr, "Async connect did not start: %s\n", client.lastError.message().c_str());
+			return false;
+		}
+		callUsec.record(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count());
+
+		ConnectReport report;
+		while(!client.poll_connect(report)) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		if(report.result != 0 || !round_trip(client)) {
+			fprintf(stderr, "Async connect failed in %s: %s\n", report.phase, report.error.message().c_str());
+			return false;
+		}
+		resolveUsec.record(report.resolveUsec);
+		connectUsec.record(report.connectUsec);
+		handshakeUsec.record(report.handshakeUsec);
+		totalUsec.record(report.totalUsec);
+		attempts += report.attempts;
+	}
+	TlsPath path = client.tls_path();
+	client.close();
+
+	printf("{\"transport\":\"%s\",\"connect\":\"async\",\"tls_path\":\"%s\",\"connects\":%d,\"attempts\":%d,",
+		tls ? "tls" : "tcp", tls_path_name(path), connects, attempts);
+	print_histogram("call_usec", callUsec);
+	printf(",");
+	print_histogram("resolve_usec", resolveUsec);
+	printf(",");
+	print_histogram("connect_usec", connectUsec);
+	printf(",");
+	print_histogram("handshake_usec", handshakeUsec);
+	printf(",");
+	print_histogram("total_usec", totalUsec);
+	printf("}\n");
+	fflush(stdout);
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	size_t messages = argc > 1 ? (size_t) atol(argv[1]) : 20000;
+	std::string transports = argc > 2 ? argv[2] : "both";
+	bool ok = true;
+
+	for(int tls = 0; tls < 2; tls++) {
+		if(transports == "local" || (tls && transports == "tcp") || (!tls && transports == "tls")) {
+			continue;
+		}
+		EchoServer server(tls == 1);
+		for(size_t messageSize : MESSAGE_SIZES) {
+			for(size_t batch : BATCH_DEPTHS) {
+				if(messageSize * batch > MAX_BYTES_IN_FLIGHT) {
+					continue;
+				}
+				ok = run("127.0.0.1", server.port(), tls == 1, 0, messageSize, batch, messages) && ok;
+			}
+		}
+		ok = run_reconnects(tls == 1, server.port(), 100) && ok;
+		ok = run_connect_async(tls == 1, server.port(), false, 100) && ok;
+		ok = run_timestamps(tls == 1, server.port(), messages) && ok;
+		ok = run_send_lanes(tls == 1, server.port(), messages) && ok;
+		ok = run_delimited(tls == 1, server.port(), messages) && ok;
+		for(int threads : { 1, 2, 4 }) {
+			ok = run_reactor(tls == 1, server.port(), 100, threads, messages / 100 + 1) && ok;
+		}
+		if(tls) {
+			ok = run_tls_path(server.port(), false, messages) && ok;
+			ok = run_tls_path(server.port(), true, messages) && ok;
+			ok = run_connect_async(true, server.port(), true, 100) && ok;
+		}
+		if(!tls) {
+			if(FrameCompressor::available(CompressionCodec::LZ4)) {
+				ok = run_compression(server.port(), "lz4", CompressionCodec::LZ4, messages) && ok;
+			}
+			if(FrameCompressor::available(CompressionCodec::Zstd)) {
+				ok = run_compression(server.port(), "zstd", CompressionCodec::Zstd, messages) && ok;
+			}
+			ok = run_capture_replay(server.port(), messages) && ok;
+			DatagramEcho datagramEcho;
+			for(size_t messageSize : { (size_t) 64, (size_t) 1024 }) {
+				ok = run_datagrams(server.port(), datagramEcho.port(), messageSize, messages) && ok;
+			}
+		}
+	}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	if(transports == "local" || transports == "both") {
+		for(bool sharedRing : { false, true }) {
+			if(sharedRing && !SharedRing::supported()) {
+				continue;
+			}
+			LocalEchoServer server(sharedRing);
+			for(size_t messageSize : MESSAGE_SIZES) {
+				for(size_t batch : BATCH_DEPTHS) {
+					if(messageSize * batch > MAX_BYTES_IN_FLIGHT) {
+						continue;
+					}
+					ok = run(server.address(), 0, false, sharedRing ? SHARED_RING_SIZE : 0,
+						messageSize, batch, messages) && ok;
+				}
+			}
+		}
+	}
+#endif
+	return ok ? 0 : 1;
+}